@@ -4,25 +4,44 @@
 #include <stdlib.h> /* srand */
 #include <time.h> /* time */
 #include <string.h> /* strncpy */
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <avahi-core/core.h>
 #include <avahi-core/lookup.h>
+#include <avahi-core/publish.h>
+#include <avahi-common/alternative.h>
 #include <avahi-common/simple-watch.h>
+#include <avahi-common/timeval.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
 
+#include "avahi_handling.h"
+
 
 /**
  * NOTE:
- * Code based on avahi provided example at master/examples/core-browse-services.c
+ * Code based on avahi provided examples at master/examples/core-browse-services.c
+ * and master/examples/core-publish-service.c
  */
 
 /***********************************************************************************************************************
 * MACROS
 ***********************************************************************************************************************/
 #define PRINT_RES 0
-#define IP_ADDR_LEN 16
-#define SEARCH_TO_SEC 30
+#define MAX_SERVICES 16
+#define BROWSE_RETRY_MIN_MS 1000 // a failed browser is recreated after this delay, doubled per failure
+#define BROWSE_RETRY_MAX_MS 60000
+
+
+/***********************************************************************************************************************
+* DATA STRUCTURES
+***********************************************************************************************************************/
+typedef struct
+{
+	char name[SRVC_NAME_LEN]; // empty if unused
+	unsigned instances; // announced instances of the service (one per interface/protocol)
+} service_t;
 
 
 /***********************************************************************************************************************
@@ -30,12 +49,98 @@
 ***********************************************************************************************************************/
 static AvahiServer *server = NULL;
 static AvahiSimplePoll *simple_poll = NULL;
-static volatile bool service_found = false;
+static AvahiSServiceBrowser *g_browser = NULL;
+static AvahiSEntryGroup *g_group = NULL;
+static pthread_t g_avahi_tid;
+static bool g_avahi_running = false;
+
+// target data, only accessed by the discovery thread
+char *g_target_service_name; // prefix of the service names
+avahi_target_cb_t g_target_cb;
+service_t g_services[MAX_SERVICES];
+
+// recreation of a failed browser, only accessed by the discovery thread (but the counter)
+static AvahiTimeout *g_retry = NULL;
+static unsigned g_retry_ms = BROWSE_RETRY_MIN_MS;
+static bool g_browse_resync = false; // services that are not announced again by the new browser are removed
+static atomic_ulong g_browse_failures;
+
+// published service, only accessed by the avahi thread once it is started
+static char *g_publish_name; // allocated by avahi, replaced by an alternative name on a collision
+static uint16_t g_publish_port;
+static char g_publish_formats[TXT_FORMATS_LEN];
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static bool is_target(const char *name)
+{
+	return !strncmp(name, g_target_service_name, strlen(g_target_service_name));
+}
+
+/* find the entry of a service, or a free entry if 'create' is set */
+static service_t *find_service(const char *name, bool create)
+{
+	int i;
+
+	for (i = 0; i < MAX_SERVICES; i++)
+		if (!strcmp(g_services[i].name, name))
+			return &g_services[i];
+
+	if (!create)
+		return NULL;
 
-// target data
-unsigned *g_target_port;
-char **g_target_ip;
-char *g_target_service_name;
+	for (i = 0; i < MAX_SERVICES; i++) {
+		if (!g_services[i].name[0]) {
+			strncpy(g_services[i].name, name, SRVC_NAME_LEN - 1);
+			return &g_services[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+static int add_service(AvahiServer *s);
+static void browse_callback(AvahiSServiceBrowser *, AvahiIfIndex, AvahiProtocol, AvahiBrowserEvent, const char *,
+	const char *, const char *, AvahiLookupResultFlags, void *);
+static void retry_callback(AvahiTimeout *, void *);
+
+/* recreate the browser after the current backoff, the backoff doubles until the browser delivered its results */
+static void schedule_browse_retry(void)
+{
+	struct timeval tv;
+	const AvahiPoll *poll_api = avahi_simple_poll_get(simple_poll);
+
+	avahi_elapse_time(&tv, g_retry_ms, 0);
+	if (g_retry)
+		poll_api->timeout_update(g_retry, &tv);
+	else if (!(g_retry = poll_api->timeout_new(poll_api, &tv, retry_callback, NULL)))
+		fprintf(stderr, "Failed to schedule the service browser, discovery stopped\n");
+
+	g_retry_ms = g_retry_ms * 2 > BROWSE_RETRY_MAX_MS ? BROWSE_RETRY_MAX_MS : g_retry_ms * 2;
+}
+
+/**
+ * A new browser announces every service again: the known services keep their destinations meanwhile,
+ * a service that is not announced until the browser reports ALL_FOR_NOW was removed during the outage.
+ */
+static void finish_browse_resync(void)
+{
+	int i;
+	char name[SRVC_NAME_LEN];
+
+	g_browse_resync = false;
+
+	for (i = 0; i < MAX_SERVICES; i++) {
+		if (!g_services[i].name[0] || g_services[i].instances)
+			continue;
+		strcpy(name, g_services[i].name);
+		g_services[i].name[0] = '\0';
+		g_target_cb(name, NULL, 0, NULL);
+	}
+}
 
 
 /***********************************************************************************************************************
@@ -83,16 +188,26 @@ static void resolve_callback(AvahiSServiceResolver *r,
 			!!(flags & AVAHI_LOOKUP_RESULT_MULTICAST),
 			!!(flags & AVAHI_LOOKUP_RESULT_CACHED));
 
-		// check if the found service is the one we are looking for
-		if (!strcmp(name, g_target_service_name)) {
+		// check if the found service is one of those we are looking for
+		if (is_target(name)) {
+			char formats[TXT_FORMATS_LEN] = "";
+
 			if (PRINT_RES) printf("(Resolver) Found '%s' Service!\n", name);
 
-			// save address data
-			strncpy(*g_target_ip, a, IP_ADDR_LEN);
-			*g_target_port = port;
+			// the advertised wire formats, a service without the record only knows protobuf
+			if ((txt = avahi_string_list_find(txt, TXT_KEY_FORMATS))) {
+				char *key, *val;
+
+				if (!avahi_string_list_get_pair(txt, &key, &val, NULL)) {
+					if (val)
+						strncpy(formats, val, sizeof(formats) - 1);
+					avahi_free(key);
+					avahi_free(val);
+				}
+			}
 
-			// indicate that search is over
-			service_found = true;
+			// a restarted receiver is resolved again, i.e. the address is replaced by the latest one
+			g_target_cb(name, a, port, formats);
 		}
 
 		avahi_free(t);
@@ -104,6 +219,35 @@ static void resolve_callback(AvahiSServiceResolver *r,
     avahi_s_service_resolver_free(r);
 }
 
+/* Called once the backoff after a browser failure expired, the browser is created again */
+static void retry_callback(AVAHI_GCC_UNUSED AvahiTimeout *t, AVAHI_GCC_UNUSED void *userdata)
+{
+	int i;
+
+	// the timeout stays allocated (disabled) for the next failure
+	avahi_simple_poll_get(simple_poll)->timeout_update(g_retry, NULL);
+
+	if (g_browser)
+		avahi_s_service_browser_free(g_browser);
+
+	for (i = 0; i < MAX_SERVICES; i++)
+		g_services[i].instances = 0;
+	g_browse_resync = true;
+
+	if (!(g_browser = avahi_s_service_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, SRVC_TYPE, NULL, 0,
+		browse_callback, server))) {
+		fprintf(stderr, "Failed to create service browser: %s\n", avahi_strerror(avahi_server_errno(server)));
+		atomic_fetch_add(&g_browse_failures, 1);
+		schedule_browse_retry();
+	}
+}
+
+/* Called once the timeout given to avahi_start_discovery() expired */
+static void timeout_callback(AVAHI_GCC_UNUSED AvahiTimeout *t, AVAHI_GCC_UNUSED void *userdata)
+{
+	g_target_cb(NULL, NULL, 0, NULL);
+}
+
 /* Called whenever a new services becomes available on the LAN or is removed from the LAN */
 static void browse_callback(AvahiSServiceBrowser *b,
 							AvahiIfIndex interface,
@@ -120,13 +264,24 @@ static void browse_callback(AvahiSServiceBrowser *b,
 
     switch (event) {
         case AVAHI_BROWSER_FAILURE:
-            fprintf(stderr, "(Browser) %s\n", avahi_strerror(avahi_server_errno(server)));
-            avahi_simple_poll_quit(simple_poll);
+			// discovery runs for the whole lifetime, the known destinations are kept until the browser is back
+			fprintf(stderr, "(Browser) %s, retrying in %u ms\n", avahi_strerror(avahi_server_errno(server)), g_retry_ms);
+			atomic_fetch_add(&g_browse_failures, 1);
+			schedule_browse_retry();
             return;
 
         case AVAHI_BROWSER_NEW:
             if (PRINT_RES) fprintf(stderr, "(Browser) NEW: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
 
+			if (is_target(name)) {
+				service_t *srvc = find_service(name, true);
+
+				if (srvc)
+					srvc->instances++;
+				else
+					fprintf(stderr, "Too many services, ignoring removals of '%s'\n", name);
+			}
+
             /**
 			 * We ignore the returned resolver object. In the callback
 			 * function we free it. If the server is terminated before
@@ -140,24 +295,176 @@ static void browse_callback(AvahiSServiceBrowser *b,
 
         case AVAHI_BROWSER_REMOVE:
             if (PRINT_RES) fprintf(stderr, "(Browser) REMOVE: service '%s' of type '%s' in domain '%s'\n", name, type, domain);
+
+			// the receiver is gone once its last instance is removed
+			if (is_target(name)) {
+				service_t *srvc = find_service(name, false);
+
+				if (srvc && srvc->instances && !--srvc->instances) {
+					srvc->name[0] = '\0';
+					g_target_cb(name, NULL, 0, NULL);
+				}
+			}
             break;
 
         case AVAHI_BROWSER_ALL_FOR_NOW:
         case AVAHI_BROWSER_CACHE_EXHAUSTED:
             if (PRINT_RES) fprintf(stderr, "(Browser) %s\n", event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "CACHE_EXHAUSTED" : "ALL_FOR_NOW");
+
+			// the browser works (again)
+			if (event == AVAHI_BROWSER_ALL_FOR_NOW) {
+				g_retry_ms = BROWSE_RETRY_MIN_MS;
+				if (g_browse_resync)
+					finish_browse_resync();
+			}
             break;
     }
 }
 
 
-/***********************************************************************************************************************
-* IMPLEMENTATION OF EXPORTED FUNCTIONS
-***********************************************************************************************************************/
-int avahi_find_host_addr(char *srvc_name, char **ip, unsigned *port) {
-    int error, ret = -1;
-	clock_t endwait;
+/* Called whenever the state of the published service changes */
+static void entry_group_callback(AvahiServer *s, AvahiSEntryGroup *g, AvahiEntryGroupState state, AVAHI_GCC_UNUSED void *userdata)
+{
+	char *n;
+
+	switch (state) {
+		case AVAHI_ENTRY_GROUP_ESTABLISHED:
+			printf("Service '%s' published\n", g_publish_name);
+			break;
+
+		case AVAHI_ENTRY_GROUP_COLLISION:
+			// another host announces the same name, e.g. a second receiver on the LAN
+			n = avahi_alternative_service_name(g_publish_name);
+			fprintf(stderr, "Service name collision, renaming '%s' to '%s'\n", g_publish_name, n);
+			avahi_free(g_publish_name);
+			g_publish_name = n;
+
+			avahi_s_entry_group_reset(g);
+			add_service(s);
+			break;
+
+		case AVAHI_ENTRY_GROUP_FAILURE:
+			fprintf(stderr, "Failed to publish service: %s\n", avahi_strerror(avahi_server_errno(s)));
+			avahi_simple_poll_quit(simple_poll);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/* Called whenever the state of the server changes, services can only be added while it is running */
+static void server_callback(AvahiServer *s, AvahiServerState state, AVAHI_GCC_UNUSED void *userdata)
+{
+	char *n;
+
+	switch (state) {
+		case AVAHI_SERVER_RUNNING:
+			if (!g_group)
+				add_service(s);
+			break;
+
+		case AVAHI_SERVER_COLLISION:
+			// the host name is taken, e.g. by the avahi daemon of the same host
+			n = avahi_alternative_host_name(avahi_server_get_host_name(s));
+			fprintf(stderr, "Host name collision, retrying with '%s'\n", n);
+			avahi_server_set_host_name(s, n);
+			avahi_free(n);
+			break;
+
+		case AVAHI_SERVER_REGISTERING:
+			// the records are added again once the server is running under its new name
+			if (g_group)
+				avahi_s_entry_group_reset(g_group);
+			break;
+
+		case AVAHI_SERVER_FAILURE:
+			fprintf(stderr, "Server failure: %s\n", avahi_strerror(avahi_server_errno(s)));
+			avahi_simple_poll_quit(simple_poll);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/* (Re-)add the published service with its formats TXT record to the entry group and commit it */
+static int add_service(AvahiServer *s)
+{
+	int rc;
+	char txt[sizeof(TXT_KEY_FORMATS) + TXT_FORMATS_LEN];
+
+	if (!g_group && !(g_group = avahi_s_entry_group_new(s, entry_group_callback, NULL))) {
+		fprintf(stderr, "Failed to create entry group: %s\n", avahi_strerror(avahi_server_errno(s)));
+		return -1;
+	}
+
+	snprintf(txt, sizeof(txt), "%s=%s", TXT_KEY_FORMATS, g_publish_formats);
+
+	rc = avahi_server_add_service(s, g_group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0,
+		g_publish_name, SRVC_TYPE, NULL, NULL, g_publish_port, txt, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to add service '%s': %s\n", g_publish_name, avahi_strerror(rc));
+		return rc;
+	}
+
+	rc = avahi_s_entry_group_commit(g_group);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to commit entry group: %s\n", avahi_strerror(rc));
+		return rc;
+	}
+
+	return 0;
+}
+
+
+/* Avahi thread, runs the avahi main loop until avahi_stop_discovery()/avahi_stop_publish() */
+static void *avahi_thread(void *arg)
+{
+	if (avahi_simple_poll_loop(simple_poll) < 0)
+		fprintf(stderr, "Avahi main loop terminated with error\n");
+
+	return NULL;
+}
+
+static void free_avahi(void)
+{
+	if (g_browser)
+		avahi_s_service_browser_free(g_browser);
+
+	if (g_group)
+		avahi_s_entry_group_free(g_group);
+
+	if (server)
+		avahi_server_free(server);
+
+	if (simple_poll)
+		avahi_simple_poll_free(simple_poll);
+
+	avahi_free(g_publish_name);
+
+	// the retry timeout is freed together with the simple poll object
+	g_retry = NULL;
+	g_retry_ms = BROWSE_RETRY_MIN_MS;
+	g_browse_resync = false;
+
+	g_browser = NULL;
+	g_group = NULL;
+	server = NULL;
+	simple_poll = NULL;
+	g_publish_name = NULL;
+}
+
+/**
+ * Create the main loop object and the server. Local address records are only published if
+ * a service is published, the service's SRV record points to them.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int start_server(bool publish)
+{
+    int error;
     AvahiServerConfig config;
-    AvahiSServiceBrowser *sb = NULL;
 
     // Initialize the psuedo-RNG
     srand(time(NULL));
@@ -165,22 +472,22 @@ int avahi_find_host_addr(char *srvc_name, char **ip, unsigned *port) {
     // Allocate main loop object
     if (!(simple_poll = avahi_simple_poll_new())) {
         fprintf(stderr, "Failed to create simple poll object.\n");
-        goto fail;
+        return -1;
     }
 
     avahi_server_config_init(&config);
 
-    // Do not publish any local records
+    // Do not publish any other local records
     config.publish_hinfo = 0;
-    config.publish_addresses = 0;
+    config.publish_addresses = publish;
     config.publish_workstation = 0;
     config.publish_domain = 0;
 
 	// ipv4 only
 	config.use_ipv6 = 0;
 
-    // Allocate a new server
-    server = avahi_server_new(avahi_simple_poll_get(simple_poll), &config, NULL, NULL, &error);
+    // Allocate a new server, a publishing server adds the service from its callback once it is running
+    server = avahi_server_new(avahi_simple_poll_get(simple_poll), &config, publish ? server_callback : NULL, NULL, &error);
 
     // Free the configuration data
     avahi_server_config_free(&config);
@@ -188,53 +495,135 @@ int avahi_find_host_addr(char *srvc_name, char **ip, unsigned *port) {
     // Check wether creating the server object succeeded
     if (!server) {
         fprintf(stderr, "Failed to create server: %s\n", avahi_strerror(error));
-        goto fail;
+        return -1;
     }
 
-    // Create the service browser
-    if (!(sb = avahi_s_service_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, "_protobuf._udp", NULL, 0, browse_callback, server))) {
+	return 0;
+}
+
+/**
+ * The avahi main loop runs on its own thread for the whole lifetime of the process,
+ * i.e. the caller does not wait for the service and input events are read meanwhile.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int start_thread(void)
+{
+	int error = pthread_create(&g_avahi_tid, NULL, avahi_thread, NULL);
+
+	if (error) {
+		fprintf(stderr, "Failed to create avahi thread (%s)\n", strerror(error));
+		return -1;
+	}
+	g_avahi_running = true;
+
+	return 0;
+}
+
+/* only one avahi thread per process, i.e. a process either browses or publishes */
+static bool check_running(void)
+{
+	if (g_avahi_running)
+		fprintf(stderr, "Error, avahi already running\n");
+
+	return g_avahi_running;
+}
+
+static void stop_avahi(void)
+{
+	if (!g_avahi_running)
+		return;
+
+	// wakes up the avahi thread, the avahi objects are freed once it returned
+	avahi_simple_poll_quit(simple_poll);
+	pthread_join(g_avahi_tid, NULL);
+	g_avahi_running = false;
+
+	free_avahi();
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int avahi_start_discovery(char *srvc_name, avahi_target_cb_t cb, unsigned timeout_sec)
+{
+	struct timeval tv;
+	const AvahiPoll *poll_api;
+
+	// sanity check
+	if (check_running())
+		return -1;
+
+	if (start_server(false))
+		goto fail;
+
+	// global data structures that are used by the callbacks, set before the browser may call them
+	g_target_service_name = srvc_name;
+	g_target_cb = cb;
+	memset(g_services, 0, sizeof(g_services));
+
+    // Create the service browser, it is kept alive to track removed and restarted receivers
+    if (!(g_browser = avahi_s_service_browser_new(server, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, SRVC_TYPE, NULL, 0, browse_callback, server))) {
         fprintf(stderr, "Failed to create service browser: %s\n", avahi_strerror(avahi_server_errno(server)));
         goto fail;
     }
 
-	// global data structures that can be manipulated by the callback
-	g_target_ip = ip;
-	g_target_port = port;
-	g_target_service_name = srvc_name;
-
-    /**
-	 * Main Service Resolution Loop
-	 *
-	 * Run one iteration of the main loop, it returns (-1) on error and 0 on success.
-	 * Sleep at most 500ms during one poll iteration.
-	 * Search is aborted if it takes longer than SEARCH_TO_SEC.
-	 */
-    endwait = time(NULL) + SEARCH_TO_SEC ;
-	while (!service_found) {
-		ret = avahi_simple_poll_iterate(simple_poll, 500);
-		if (ret < 0)
-			goto fail;
-
-		// check if we timed out
-		if (time(NULL) > endwait) {
-			fprintf(stderr, "Search for Service timed out!\n");
-			ret = -1;
-			goto fail;
-		}
+	// the timeout is freed together with the simple poll object
+	poll_api = avahi_simple_poll_get(simple_poll);
+	if (timeout_sec && !poll_api->timeout_new(poll_api, avahi_elapse_time(&tv, timeout_sec * 1000, 0), timeout_callback, NULL)) {
+		fprintf(stderr, "Failed to create resolution timeout\n");
+		goto fail;
 	}
 
-    ret = 0;
+    // Service Resolution Loop
+	if (start_thread())
+		goto fail;
+
+    return 0;
 
 fail:
-    // Cleanup things
-    if (sb)
-        avahi_s_service_browser_free(sb);
+    free_avahi();
+
+    return -1;
+}
+
+void avahi_stop_discovery(void)
+{
+	stop_avahi();
+}
+
+unsigned long avahi_get_browse_failures(void)
+{
+	return atomic_load(&g_browse_failures);
+}
 
-    if (server)
-        avahi_server_free(server);
+int avahi_start_publish(const char *srvc_name, unsigned port, const char *formats)
+{
+	// sanity check
+	if (check_running())
+		return -1;
+
+	// set before the server is created, its callback adds the service
+	g_publish_name = avahi_strdup(srvc_name);
+	g_publish_port = port;
+	strncpy(g_publish_formats, formats, sizeof(g_publish_formats) - 1);
+
+	if (!g_publish_name || start_server(true))
+		goto fail;
 
-    if (simple_poll)
-        avahi_simple_poll_free(simple_poll);
+	if (start_thread())
+		goto fail;
 
-    return ret;
+	return 0;
+
+fail:
+	free_avahi();
+
+	return -1;
+}
+
+void avahi_stop_publish(void)
+{
+	stop_avahi();
 }
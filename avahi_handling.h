@@ -2,16 +2,77 @@
 #define _avahi_handling
 
 
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define IP_ADDR_LEN 16
+#define TXT_KEY_FORMATS "formats"
+#define TXT_FORMATS_LEN 64
+#define SRVC_NAME_LEN 64
+#define SRVC_TYPE "_protobuf._udp"
+#define SRVC_NAME "EventSender_Zeroconf" // name (prefix) of the receiver services
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Handler that is called by the discovery thread whenever a matching service was resolved.
+ * Arguments are the service name, the ip addr, the port and the value of the service's TXT_KEY_FORMATS
+ * record (empty string if the service does not advertise its formats).
+ * All arguments but the name are NULL/0 if the service was removed from the LAN.
+ */
+typedef void (*avahi_target_cb_t)(const char *, const char *, unsigned, const char *);
+
+
 /*******************************************************************************
 * PROTOTYPES
 *******************************************************************************/
 
 /**
- * Use Avahi to find ip addr and port for a given service name
+ * Start to browse for all services whose name starts with the given prefix on a background thread,
+ * returns immediately. The handler is called for every resolution and removal of a matching service
+ * until avahi_stop_discovery(), a failing browser is recreated (see avahi_get_browse_failures()).
+ * If a timeout (in seconds, 0 for none) is given, the handler is called once with all arguments NULL/0
+ * when it expired.
+ *
+ * return: 0 on success, <0 on error
+ */
+int avahi_start_discovery(char *, avahi_target_cb_t, unsigned);
+
+/**
+ * Stop the discovery thread started by avahi_start_discovery()
+ *
+ * return: void
+ */
+void avahi_stop_discovery(void);
+
+/**
+ * Get the number of failures of the service browser. A failed browser is created again after a backoff
+ * (1 s, doubled up to 60 s), the known services are kept meanwhile. Those that are not announced again
+ * by the new browser are reported as removed.
+ *
+ * return: number of failures
+ */
+unsigned long avahi_get_browse_failures(void);
+
+/**
+ * Publish a service of type SRVC_TYPE with the given name and port on a background thread, returns
+ * immediately. The given formats string is announced as TXT_KEY_FORMATS record. The name is replaced by
+ * an alternative one ("name #2") if another host announces it already.
+ * A process can either publish or browse (see avahi_start_discovery()).
  *
  * return: 0 on success, <0 on error
  */
-int avahi_find_host_addr(char*, char **, unsigned *);
+int avahi_start_publish(const char *, unsigned, const char *);
+
+/**
+ * Withdraw the service published by avahi_start_publish() and stop its thread
+ *
+ * return: void
+ */
+void avahi_stop_publish(void);
 
 
 #endif /* _avahi_handling */
\ No newline at end of file
@@ -0,0 +1,246 @@
+#include <stdio.h> /* fprintf, fopen */
+#include <stdlib.h> /* malloc, free, strtol */
+#include <string.h> /* memset, strcmp, strerror */
+#include <errno.h> /* err codes */
+
+#include "calib_handling.h"
+
+
+/***********************************************************************************************************************
+* DATA STRUCTURES
+***********************************************************************************************************************/
+typedef struct
+{
+	int dev; // device id, CALIB_ANY_DEV for every device
+	unsigned code; // ABS_X or ABS_Y
+	int min;
+	int max;
+	int flat; // <0: the one of the device
+	int fuzz; // <0: the one of the device
+} calib_profile_t;
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+static calib_profile_t g_profiles[CALIB_MAX_PROFILES];
+static unsigned g_num_profiles = 0;
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+
+/* parse one profile line, 0 if it is empty or a comment */
+static int parse_profile(char *line, calib_profile_t *p)
+{
+	int n;
+	char *end;
+	char dev[8], axis[4];
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (!*line || *line == '\n' || *line == '#')
+		return 0;
+
+	p->flat = -1;
+	p->fuzz = -1;
+	n = sscanf(line, "%7s %3s %d %d %d %d", dev, axis, &p->min, &p->max, &p->flat, &p->fuzz);
+	if (n < 4)
+		return -EINVAL;
+
+	if (!strcmp(dev, "*")) {
+		p->dev = CALIB_ANY_DEV;
+	} else {
+		p->dev = strtol(dev, &end, 0);
+		if (*end || p->dev < 0)
+			return -EINVAL;
+	}
+
+	if (!strcmp(axis, "X") || !strcmp(axis, "x"))
+		p->code = ABS_X;
+	else if (!strcmp(axis, "Y") || !strcmp(axis, "y"))
+		p->code = ABS_Y;
+	else
+		return -EINVAL;
+
+	return 1;
+}
+
+/* apply the profiles of the device to the absinfo of one axis, later lines win */
+static void apply_profiles(calib_axis_t *axis, unsigned dev_id, unsigned code)
+{
+	unsigned i;
+
+	for (i = 0; i < g_num_profiles; i++) {
+		calib_profile_t *p = &g_profiles[i];
+
+		if (p->code != code || (p->dev != CALIB_ANY_DEV && (unsigned)p->dev != dev_id))
+			continue;
+
+		axis->abs.minimum = p->min;
+		axis->abs.maximum = p->max;
+		if (p->flat >= 0)
+			axis->abs.flat = p->flat;
+		if (p->fuzz >= 0)
+			axis->abs.fuzz = p->fuzz;
+	}
+}
+
+/**
+ * Build the table of one axis, integer math only: min -> 0, center +- flat -> CALIB_NORM_CENTER, max -> CALIB_NORM_MAX
+ *
+ * return: 0 on success, <0 on error
+ */
+static int build_lut(calib_axis_t *axis, const char *name)
+{
+	int lo = axis->abs.minimum, hi = axis->abs.maximum, flat = axis->abs.flat;
+	int center = lo + (hi - lo) / 2;
+	int64_t span_lo = center - flat - lo, span_hi = hi - center - flat;
+	unsigned i, n;
+
+	if (hi <= lo || (int64_t)hi - lo >= CALIB_MAX_RANGE || flat < 0 || span_lo <= 0 || span_hi <= 0) {
+		fprintf(stderr, "Invalid calibration of axis %s (%d..%d flat %d, at most %d values)\n", name, lo, hi, flat,
+			CALIB_MAX_RANGE);
+		return -EINVAL;
+	}
+
+	n = hi - lo + 1;
+	axis->lut = malloc(n * sizeof(*axis->lut));
+	if (!axis->lut) {
+		fprintf(stderr, "Failed to allocate the calibration table of axis %s\n", name);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		int v = lo + i;
+
+		if (v < center - flat)
+			axis->lut[i] = ((v - lo) * (int64_t)CALIB_NORM_CENTER + span_lo / 2) / span_lo;
+		else if (v > center + flat)
+			axis->lut[i] = CALIB_NORM_CENTER +
+				((v - center - flat) * (int64_t)(CALIB_NORM_MAX - CALIB_NORM_CENTER) + span_hi / 2) / span_hi;
+		else
+			axis->lut[i] = CALIB_NORM_CENTER;
+	}
+
+	return 0;
+}
+
+static int map_axis(calib_t *c, calib_axis_t *axis, int v)
+{
+	if (v == JOY_NO_CHANGE)
+		return v;
+
+	c->values++;
+
+	if (v < axis->abs.minimum) {
+		c->clamped++;
+		v = axis->abs.minimum;
+	} else if (v > axis->abs.maximum) {
+		c->clamped++;
+		v = axis->abs.maximum;
+	}
+
+	return axis->lut[v - axis->abs.minimum];
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int calib_load_profiles(const char *path)
+{
+	int rc;
+	unsigned line_nr = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -errno;
+	}
+
+	g_num_profiles = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line_nr++;
+
+		if (g_num_profiles == CALIB_MAX_PROFILES) {
+			fprintf(stderr, "%s: at most %d calibration profiles are supported\n", path, CALIB_MAX_PROFILES);
+			fclose(f);
+			return -E2BIG;
+		}
+
+		rc = parse_profile(line, &g_profiles[g_num_profiles]);
+		if (rc < 0) {
+			fprintf(stderr, "%s:%u: invalid calibration profile, expected 'dev axis min max [flat [fuzz]]'\n",
+				path, line_nr);
+			fclose(f);
+			return rc;
+		}
+		g_num_profiles += rc;
+	}
+
+	fclose(f);
+
+	return g_num_profiles;
+}
+
+int init_calib(calib_t *c, unsigned dev_id, const struct input_absinfo *x, const struct input_absinfo *y)
+{
+	int rc;
+
+	memset(c, 0, sizeof(*c));
+
+	if (!x || !y)
+		return 0;
+
+	c->x.abs = *x;
+	c->y.abs = *y;
+	apply_profiles(&c->x, dev_id, ABS_X);
+	apply_profiles(&c->y, dev_id, ABS_Y);
+
+	rc = build_lut(&c->x, "X");
+	if (!rc)
+		rc = build_lut(&c->y, "Y");
+	if (rc) {
+		teardown_calib(c);
+		return rc;
+	}
+
+	c->enabled = true;
+
+	return 0;
+}
+
+void teardown_calib(calib_t *c)
+{
+	free(c->x.lut);
+	free(c->y.lut);
+
+	c->x.lut = NULL;
+	c->y.lut = NULL;
+	c->enabled = false;
+}
+
+void calib_apply(calib_t *c, nun_stat_t *stat)
+{
+	if (!c->enabled)
+		return;
+
+	stat->joy_x = map_axis(c, &c->x, stat->joy_x);
+	stat->joy_y = map_axis(c, &c->y, stat->joy_y);
+	stat->normalized = true;
+}
+
+void calib_print_stats(calib_t *c, FILE *f)
+{
+	if (!c->enabled)
+		return;
+
+	fprintf(f, "Calibration: X %d..%d flat %d fuzz %d, Y %d..%d flat %d fuzz %d -> 0..%d: %lu axis values, %lu clamped\n",
+		c->x.abs.minimum, c->x.abs.maximum, c->x.abs.flat, c->x.abs.fuzz,
+		c->y.abs.minimum, c->y.abs.maximum, c->y.abs.flat, c->y.abs.fuzz,
+		CALIB_NORM_MAX, c->values, c->clamped);
+}
@@ -0,0 +1,92 @@
+#ifndef _calib_handling
+#define _calib_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/input.h> /* struct input_absinfo */
+
+#include "event_sender.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define CALIB_NORM_MAX 32767 // normalized axis range is 0..CALIB_NORM_MAX, fits the int16 of the compact format
+#define CALIB_NORM_CENTER 16384 // the center (and the flat zone) of the raw range
+#define CALIB_MAX_RANGE 65536 // max entries of the table of one axis, i.e. max - min + 1
+#define CALIB_MAX_PROFILES 32 // lines of a profile file
+#define CALIB_ANY_DEV -1 // profile line for every device ('*')
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+typedef struct
+{
+	struct input_absinfo abs; // minimum, maximum, flat and fuzz of the device, overridden by a profile
+	uint16_t *lut; // raw value - minimum -> normalized value
+} calib_axis_t;
+
+/**
+ * Calibration of one device: every raw axis value is clamped to the calibrated range and mapped to
+ * 0..CALIB_NORM_MAX via a table built once by init_calib(), i.e. the hot path is a clamp and a load.
+ * Values within 'flat' of the center map to CALIB_NORM_CENTER, the halves below and above are scaled
+ * linearly. Only the fuzz is set in the kernel (evdev drops changes within it), see input_set_fuzz().
+ */
+typedef struct
+{
+	bool enabled;
+	calib_axis_t x;
+	calib_axis_t y;
+
+	// statistics
+	unsigned long values; // axis values mapped
+	unsigned long clamped; // outside the calibrated range
+} calib_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Load calibration profiles from a file, every line "dev axis min max [flat [fuzz]]" overrides the absinfo
+ * of one axis ('X' or 'Y') of the device with the given id ('*': every device). Empty lines and lines
+ * starting with '#' are skipped. The profiles are used by every following init_calib().
+ *
+ * return: number of loaded profiles, <0 on error (file not found, invalid line)
+ */
+int calib_load_profiles(const char *);
+
+/**
+ * Initialize the calibration of the device with the given id from the absinfo of its X and Y axis and the
+ * loaded profiles, the tables are allocated here. Disabled (NULL absinfo) every group passes unchanged.
+ *
+ * return: 0 on success, <0 on error (invalid range)
+ */
+int init_calib(calib_t *, unsigned, const struct input_absinfo *, const struct input_absinfo *);
+
+/**
+ * Free the tables allocated by init_calib()
+ *
+ * return: void
+ */
+void teardown_calib(calib_t *);
+
+/**
+ * Map the axis values of a complete event group in place and mark it as normalized, JOY_NO_CHANGE is kept
+ *
+ * return: void
+ */
+void calib_apply(calib_t *, nun_stat_t *);
+
+/**
+ * Print the calibrated ranges and the number of clamped values
+ *
+ * return: void
+ */
+void calib_print_stats(calib_t *, FILE *);
+
+
+#endif /* _calib_handling */
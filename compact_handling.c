@@ -0,0 +1,94 @@
+#include <stdio.h> /* stderr */
+#include <errno.h> /* err codes */
+
+#include "compact_handling.h"
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static inline uint16_t get_le16(uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline void put_le48(uint8_t *p, uint64_t v)
+{
+	put_le16(&p[0], v);
+	put_le16(&p[2], v >> 16);
+	put_le16(&p[4], v >> 32);
+}
+
+static inline uint64_t get_le48(uint8_t *p)
+{
+	return get_le16(&p[0]) | ((uint64_t)get_le16(&p[2]) << 16) | ((uint64_t)get_le16(&p[4]) << 32);
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+
+/**
+ * The field conversions are plain shifts and masks, i.e. the message is encoded and decoded
+ * without any data dependent branch and without the protobuf-c runtime.
+ */
+int pack_nunchuk_compact(nun_stat_t *stat, uint8_t dev_id, uint16_t seq, uint8_t *buf, unsigned buf_len)
+{
+	uint64_t age;
+	unsigned version = stat->send_ts ? COMPACT_VERSION_TS : COMPACT_VERSION;
+
+	if (buf_len < (version == COMPACT_VERSION ? COMPACT_MSG_LEN : COMPACT_TS_MSG_LEN)) {
+		fprintf(stderr, "Buffer too small for compact message (%u)\n", buf_len);
+		return -EINVAL;
+	}
+
+	buf[0] = (version << 4) | (dev_id & COMPACT_MAX_DEV_ID);
+	buf[1] = BUT_BITS_PACK(stat->but_c, stat->but_z) | (stat->keyframe ? COMPACT_KEYFRAME_BIT : 0) |
+		(stat->normalized ? COMPACT_NORMALIZED_BIT : 0);
+	put_le16(&buf[2], (uint16_t)(int16_t)stat->joy_x);
+	put_le16(&buf[4], (uint16_t)(int16_t)stat->joy_y);
+	put_le16(&buf[6], seq);
+
+	if (version == COMPACT_VERSION)
+		return COMPACT_MSG_LEN;
+
+	age = stat->event_ts ? stat->send_ts - stat->event_ts : 0;
+	put_le48(&buf[8], stat->send_ts);
+	put_le16(&buf[14], age > 0xffff ? 0xffff : age);
+
+	return COMPACT_TS_MSG_LEN;
+}
+
+int unpack_nunchuk_compact(uint8_t *buf, unsigned len, nun_stat_t *stat, uint8_t *dev_id, uint16_t *seq)
+{
+	if (!((len == COMPACT_MSG_LEN && (buf[0] >> 4) == COMPACT_VERSION) ||
+		(len == COMPACT_TS_MSG_LEN && (buf[0] >> 4) == COMPACT_VERSION_TS)))
+		return -EINVAL;
+
+	stat->but_c = BUT_BITS_C(buf[1]);
+	stat->but_z = BUT_BITS_Z(buf[1]);
+	stat->keyframe = !!(buf[1] & COMPACT_KEYFRAME_BIT);
+	stat->normalized = !!(buf[1] & COMPACT_NORMALIZED_BIT);
+	stat->joy_x = (int16_t)get_le16(&buf[2]);
+	stat->joy_y = (int16_t)get_le16(&buf[4]);
+	*dev_id = buf[0] & COMPACT_MAX_DEV_ID;
+	*seq = get_le16(&buf[6]);
+	stat->dev_id = *dev_id;
+	stat->seq = *seq;
+
+	stat->send_ts = 0;
+	stat->event_ts = 0;
+	if (len == COMPACT_TS_MSG_LEN) {
+		stat->send_ts = get_le48(&buf[8]);
+		stat->event_ts = stat->send_ts - get_le16(&buf[14]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef _compact_handling
+#define _compact_handling
+
+#include <stdint.h>
+
+#include "event_sender.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+
+/**
+ * Compact wire format, fixed size, all multi byte fields are little endian:
+ *
+ * byte 0    header:   version (bits 7..4), device id (bits 3..0)
+ * byte 1    buttons:  but_c (bits 1..0), but_z (bits 3..2), keyframe (bit 4), normalized (bit 5), reserved (bits 7..6)
+ * byte 2-3  joy_x:    int16, JOY_NO_CHANGE (-1) if unchanged
+ * byte 4-5  joy_y:    int16, JOY_NO_CHANGE (-1) if unchanged
+ * byte 6-7  seq:      uint16, incremented per packet
+ *
+ * Button values are the but_state_t values (BUT_UP, BUT_DOWN, BUT_KEEP).
+ * Decoders must ignore reserved bits.
+ *
+ * Version 2 appends the latency timestamps (sent if the packet carries a send timestamp):
+ *
+ * byte 8-13  send_ts:    uint48, CLOCK_MONOTONIC of the sender in us when the packet was encoded
+ * byte 14-15 event_age:  uint16, send_ts minus the kernel timestamp of the event group in us, saturated at 0xffff
+ */
+#define COMPACT_VERSION 1
+#define COMPACT_MSG_LEN 8
+#define COMPACT_VERSION_TS 2
+#define COMPACT_TS_MSG_LEN 16
+#define COMPACT_MAX_DEV_ID 15
+#define COMPACT_KEYFRAME_BIT 0x10 // in the buttons byte, see nun_stat_t
+#define COMPACT_NORMALIZED_BIT 0x20 // in the buttons byte, see nun_stat_t
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Encode a nun_stat_t struct, the device id and a sequence number into a buffer of at least
+ * COMPACT_TS_MSG_LEN bytes. A version 2 message is encoded if the state carries a send timestamp.
+ *
+ * return: number of bytes written on success, <0 on error
+ */
+int pack_nunchuk_compact(nun_stat_t *, uint8_t, uint16_t, uint8_t *, unsigned);
+
+/**
+ * Decode a compact message (version 1 or 2) into a pre-allocated nun_stat_t structure, the device id
+ * and the sequence number are returned via the last two arguments.
+ *
+ * return: 0 on success, <0 on error (wrong length or version)
+ */
+int unpack_nunchuk_compact(uint8_t *, unsigned, nun_stat_t *, uint8_t *, uint16_t *);
+
+
+#endif /* _compact_handling */
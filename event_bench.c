@@ -0,0 +1,664 @@
+#define _GNU_SOURCE /* RUSAGE_THREAD, recvmmsg */
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <unistd.h> /* getopt, write */
+#include <string.h> /* strerror */
+#include <errno.h> /* err codes */
+#include <time.h> /* clock_nanosleep */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/eventfd.h> /* eventfd */
+#include <sys/socket.h> /* sendmmsg */
+#include <netinet/in.h> /* sockaddr_in */
+#include <arpa/inet.h> /* htonl */
+#include <sys/resource.h> /* getrusage */
+
+#include "event_sender.h"
+#include "protobuf_handling.h"
+#include "compact_handling.h"
+#include "network_handling.h"
+#include "update_handling.h"
+#include "receiver_handling.h"
+#include "loop_handling.h"
+#include "stats_handling.h"
+
+
+/**
+ * NOTE:
+ * Host benchmark ('make bench'), every result is written as one JSON object per line to the output
+ * file (stdout by default), a readable summary goes to stderr. Allocations are counted by interposing the glibc allocator,
+ * i.e. the heap use of libprotobuf-c is included.
+ */
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define BENCH_VERSION 2 // bumped whenever results are no longer comparable
+#define BENCH_RUNS 5 // the median of the runs is reported
+#define BENCH_MIN_RUN_NS 100000000ULL // every run takes at least 100 ms
+#define BENCH_CHUNK 1000 // operations between two clock reads
+#define BENCH_PORT 18888
+#define BENCH_E2E_SEC 2
+#define BENCH_DRAIN_MS 100 // time the receiver gets for packets still in flight
+#define BENCH_LOAD_PORT (BENCH_PORT + 1) // sink of the background load, never read
+#define BENCH_LOAD_LEN 1400 // bulk transfer sized datagrams
+#define BENCH_LOAD_BATCH 32 // datagrams per sendmmsg() of the load thread
+#define BENCH_URING_BATCH 8 // groups per submission of the io_uring backend at max rate, like one read batch
+#define BENCH_BULK_N RECV_BATCH_SIZE // packets per bulk decode, like one recvmmsg() batch of the receiver
+
+/* keeps the compiler from dropping a result */
+#define BENCH_SINK(x) __asm__ volatile("" : : "g"(x) : "memory")
+
+
+/***********************************************************************************************************************
+* DATA STRUCTURES
+***********************************************************************************************************************/
+typedef struct
+{
+	const char *name;
+	void (*fn)(void);
+	bool no_alloc; // the case fails if it touches the heap
+} micro_bench_t;
+
+typedef struct
+{
+	wire_format_t format;
+	unsigned rate_hz; // offered event groups per second, 0: as fast as possible
+	nw_profile_t profile;
+	bool load; // background UDP load on the loopback, only run with -b
+	bool uring; // sends are queued on an io_uring, only run with -u
+} e2e_case_t;
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+static atomic_ulong g_allocs;
+static FILE *g_out_file;
+
+// fixtures of the micro benchmarks
+static nun_stat_t g_stat = {100, 200, BUT_DOWN, BUT_UP, 0, 0, 0, 0, false, false};
+static nun_stat_t g_out;
+static NunchukUpdate *g_msg;
+static NunchukUpdateV2 g_msg_v2 = NUNCHUK_UPDATE_V2__INIT;
+static uint8_t g_buf[MAX_UNPACK_BUF_SIZE];
+static unsigned g_len;
+static uint8_t g_buf_v2[MAX_UNPACK_BUF_SIZE];
+static unsigned g_len_v2;
+static uint8_t g_buf_compact[COMPACT_TS_MSG_LEN];
+static unsigned g_len_compact;
+static proto_ctx_t g_bulk_ctx;
+static uint8_t *g_bulk_bufs[BENCH_BULK_N];
+static unsigned g_bulk_lens[BENCH_BULK_N];
+static nun_stat_t g_bulk_out[BENCH_BULK_N];
+
+// end-to-end receiver, runs on its own thread
+static receiver_t g_recv;
+static int g_stop_efd = -1;
+static struct rusage g_recv_usage;
+static hist_t g_recv_latency; // event->receive, sender and receiver share the clock
+
+// background load
+static atomic_bool g_load_stop;
+static unsigned long g_load_packets;
+
+
+/***********************************************************************************************************************
+* ALLOCATOR
+***********************************************************************************************************************/
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+void *malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+	return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+	__libc_free(p);
+}
+
+
+/***********************************************************************************************************************
+* MICRO BENCHMARKS
+***********************************************************************************************************************/
+static void bench_fill(void)
+{
+	fill_nunchuk_protobuf(&g_stat, g_msg);
+}
+
+static void bench_pack(void)
+{
+	uint8_t *buf;
+	unsigned len;
+
+	pack_nunchuk_protobuf(g_msg, &buf, &len);
+	BENCH_SINK(buf);
+}
+
+static void bench_unpack(void)
+{
+	unpack_nunchuk_protobuf(g_buf, g_len, &g_out);
+	BENCH_SINK(&g_out);
+}
+
+/* one op decodes BENCH_BULK_N packets from the arena of a context */
+static void bench_unpack_bulk(void)
+{
+	unsigned ok = unpack_nunchuk_protobuf_bulk(&g_bulk_ctx, g_bulk_bufs, g_bulk_lens, BENCH_BULK_N, g_bulk_out, NULL);
+
+	BENCH_SINK(ok);
+	BENCH_SINK(g_bulk_out);
+}
+
+static void bench_fill_stats(void)
+{
+	fill_stats_from_nunchuk_protobuf(g_msg, &g_out);
+	BENCH_SINK(&g_out);
+}
+
+static void bench_pack_v2(void)
+{
+	uint8_t *buf;
+	unsigned len;
+
+	fill_nunchuk_protobuf_v2(&g_stat, &g_msg_v2);
+	pack_nunchuk_protobuf_v2(&g_msg_v2, &buf, &len);
+	BENCH_SINK(buf);
+}
+
+static void bench_unpack_v2(void)
+{
+	unpack_nunchuk_protobuf_v2(g_buf_v2, g_len_v2, &g_out);
+	BENCH_SINK(&g_out);
+}
+
+static void bench_pack_compact(void)
+{
+	pack_nunchuk_compact(&g_stat, 1, 2, g_buf_compact, sizeof(g_buf_compact));
+	BENCH_SINK(g_buf_compact);
+}
+
+static void bench_unpack_compact(void)
+{
+	uint8_t dev_id;
+	uint16_t seq;
+
+	unpack_nunchuk_compact(g_buf_compact, g_len_compact, &g_out, &dev_id, &seq);
+	BENCH_SINK(&g_out);
+}
+
+static const micro_bench_t g_micro[] = {
+	{"fill_nunchuk_protobuf", bench_fill, false},
+	{"pack_nunchuk_protobuf", bench_pack, false},
+	{"unpack_nunchuk_protobuf", bench_unpack, false},
+	{"unpack_nunchuk_protobuf_bulk", bench_unpack_bulk, true},
+	{"fill_stats_from_nunchuk_protobuf", bench_fill_stats, false},
+	{"pack_nunchuk_protobuf_v2", bench_pack_v2, false},
+	{"unpack_nunchuk_protobuf_v2", bench_unpack_v2, false},
+	{"pack_nunchuk_compact", bench_pack_compact, false},
+	{"unpack_nunchuk_compact", bench_unpack_compact, false},
+};
+
+static int setup_micro(void)
+{
+	unsigned i;
+	uint8_t *buf;
+
+	g_msg = new_nunchuk_protobuf();
+	if (!g_msg)
+		return -ENOMEM;
+
+	// the unpack benchmarks decode what the pack benchmarks produce
+	fill_nunchuk_protobuf(&g_stat, g_msg);
+	if (pack_nunchuk_protobuf(g_msg, &buf, &g_len))
+		return -EINVAL;
+	memcpy(g_buf, buf, g_len);
+
+	// the bulk decode gets a batch of the same packet
+	init_proto_ctx(&g_bulk_ctx);
+	for (i = 0; i < BENCH_BULK_N; i++) {
+		g_bulk_bufs[i] = g_buf;
+		g_bulk_lens[i] = g_len;
+	}
+
+	fill_nunchuk_protobuf_v2(&g_stat, &g_msg_v2);
+	if (pack_nunchuk_protobuf_v2(&g_msg_v2, &buf, &g_len_v2))
+		return -EINVAL;
+	memcpy(g_buf_v2, buf, g_len_v2);
+
+	g_len_compact = pack_nunchuk_compact(&g_stat, 1, 2, g_buf_compact, sizeof(g_buf_compact));
+
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Median ns/op of BENCH_RUNS runs, each run repeats the operation for at least BENCH_MIN_RUN_NS
+ *
+ * return: 0 on success, -ENOMEM if a case that must not touch the heap allocated
+ */
+static int run_micro(const micro_bench_t *b)
+{
+	int r, i;
+	double ns[BENCH_RUNS];
+	unsigned long ops, allocs, total_ops = 0;
+	uint64_t start, elapsed;
+
+	allocs = atomic_load(&g_allocs);
+
+	for (r = 0; r < BENCH_RUNS; r++) {
+		ops = 0;
+		start = stats_now_ns();
+		do {
+			for (i = 0; i < BENCH_CHUNK; i++)
+				b->fn();
+			ops += BENCH_CHUNK;
+			elapsed = stats_now_ns() - start;
+		} while (elapsed < BENCH_MIN_RUN_NS);
+
+		ns[r] = (double)elapsed / ops;
+		total_ops += ops;
+	}
+
+	allocs = atomic_load(&g_allocs) - allocs;
+	qsort(ns, BENCH_RUNS, sizeof(ns[0]), cmp_double);
+
+	fprintf(g_out_file, "{\"version\": %d, \"bench\": \"%s\", \"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, \"allocs_per_op\": %.3f, \"ops\": %lu}\n",
+		BENCH_VERSION, b->name, ns[BENCH_RUNS / 2], ns[0], (double)allocs / total_ops, total_ops);
+	fprintf(stderr, "%-34s %9.1f ns/op (min %.1f) %7.3f allocs/op\n",
+		b->name, ns[BENCH_RUNS / 2], ns[0], (double)allocs / total_ops);
+
+	if (b->no_alloc && allocs) {
+		fprintf(stderr, "%s allocated %lu times, it must not touch the heap!\n", b->name, allocs);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+/***********************************************************************************************************************
+* END-TO-END BENCHMARK
+***********************************************************************************************************************/
+/* Called by the receiver for every decoded update, both sides run in this process, i.e. no clock offset */
+static void handle_update(recv_stream_t *stream, nun_stat_t *stat, void *ctx)
+{
+	if (stat->event_ts)
+		hist_add(&g_recv_latency, stats_now_us() - stat->event_ts);
+}
+
+/* Load thread, floods the loopback with bulk datagrams (default TOS) until g_load_stop is set */
+static void *load_thread(void *arg)
+{
+	int i, fd, sink;
+	static uint8_t buf[BENCH_LOAD_LEN];
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(BENCH_LOAD_PORT) };
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct mmsghdr msgs[BENCH_LOAD_BATCH];
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	sink = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0 || sink < 0 || bind(sink, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Could not create the load sockets (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < BENCH_LOAD_BATCH; i++) {
+		msgs[i].msg_hdr.msg_name = &addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+		msgs[i].msg_hdr.msg_iov = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// the sink is never read, i.e. the datagrams cost the stack everything but the copy to user space
+	while (!atomic_load_explicit(&g_load_stop, memory_order_relaxed)) {
+		i = sendmmsg(fd, msgs, BENCH_LOAD_BATCH, 0);
+		if (i > 0)
+			g_load_packets += i;
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	if (sink >= 0)
+		close(sink);
+
+	return NULL;
+}
+
+static int handle_recv(int fd, uint32_t events, void *ctx)
+{
+	return receiver_read(&g_recv);
+}
+
+static int handle_stop(int fd, uint32_t events, void *ctx)
+{
+	loop_stop();
+	return 0;
+}
+
+/* Receiver thread, drains the socket until g_stop_efd is signalled */
+static void *recv_thread(void *arg)
+{
+	int rc = init_loop();
+
+	if (!rc && (loop_add_fd(g_recv.fd, EPOLLIN, handle_recv, NULL) || loop_add_fd(g_stop_efd, EPOLLIN, handle_stop, NULL)))
+		rc = -EINVAL;
+	if (!rc)
+		rc = loop_run();
+	if (rc)
+		fprintf(stderr, "Receiver loop terminated with error (%s)\n", strerror(-rc));
+
+	// a final drain catches packets that arrived together with the stop request
+	receiver_read(&g_recv);
+	getrusage(RUSAGE_THREAD, &g_recv_usage);
+	teardown_loop();
+
+	return NULL;
+}
+
+static double cpu_sec(struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+/* the next event group, one axis changes per group, i.e. every group results in one packet */
+static void next_group(nun_stat_t *stat, unsigned long i)
+{
+	*stat = (nun_stat_t)NUN_STAT_NEUTRAL;
+	if (i & 1)
+		stat->joy_y = i % 256;
+	else
+		stat->joy_x = i % 256;
+	stat->event_ts = stats_now_us();
+}
+
+/**
+ * Feed event groups into an update context (encode, sendmmsg to the loopback receiver) for 'sec' seconds,
+ * either as fast as possible or paced at the offered rate, optionally with a background load on the loopback.
+ * The evdev read path is not part of it, use 'event_sender -s gen:...' with 'event_receiver -N' on a box
+ * with uinput for that.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int run_e2e(e2e_case_t *c, unsigned sec, bool timestamps)
+{
+	int rc;
+	unsigned long i, received, lost = 0, syscalls;
+	uint64_t start, end, t;
+	double wall, sender_cpu;
+	const char *names[] = WIRE_FORMAT_NAMES;
+	const char *profiles[] = NW_PROFILE_NAMES;
+	struct rusage ru0, ru1;
+	struct timespec ts;
+	nun_stat_t stat;
+	pthread_t tid, load_tid;
+	static update_ctx_t upd;
+
+	init_hist(&g_recv_latency);
+	g_load_packets = 0;
+	atomic_store(&g_load_stop, false);
+
+	rc = init_receiver(&g_recv, BENCH_PORT, handle_update, NULL);
+	if (rc)
+		return rc;
+
+	rc = init_update(&upd, 0, 0, c->format, timestamps, 0);
+	if (rc)
+		goto out_recv;
+
+	// the sending (this) thread owns the ring, its sends are submitted by loop_submit()
+	if (c->uring) {
+		rc = init_loop_uring();
+		if (rc)
+			goto out_upd;
+	}
+
+	rc = pthread_create(&tid, NULL, recv_thread, NULL);
+	if (rc) {
+		rc = -rc;
+		goto out_upd;
+	}
+
+	if (c->load && pthread_create(&load_tid, NULL, load_thread, NULL)) {
+		fprintf(stderr, "Failed to start the load thread\n");
+		c->load = false;
+	}
+
+	getrusage(RUSAGE_THREAD, &ru0);
+	syscalls = nw_get_syscalls();
+	start = stats_now_ns();
+	end = start + sec * 1000000000ULL;
+
+	for (i = 0; (t = stats_now_ns()) < end; i++) {
+		if (c->rate_hz) {
+			t = start + i * 1000000000ULL / c->rate_hz;
+			ts.tv_sec = t / 1000000000ULL;
+			ts.tv_nsec = t % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		next_group(&stat, i);
+		rc = update_submit(&upd, &stat);
+		if (!rc && c->uring && (c->rate_hz || !((i + 1) % BENCH_URING_BATCH)))
+			rc = loop_submit();
+		if (rc)
+			break;
+	}
+	if (!rc && c->uring)
+		rc = loop_submit();
+
+	wall = (stats_now_ns() - start) / 1e9;
+	getrusage(RUSAGE_THREAD, &ru1);
+	sender_cpu = cpu_sec(&ru1) - cpu_sec(&ru0);
+	syscalls = nw_get_syscalls() - syscalls + (c->uring ? loop_get_syscalls() : 0);
+
+	if (c->load) {
+		atomic_store(&g_load_stop, true);
+		pthread_join(load_tid, NULL);
+	}
+
+	// let the receiver drain, then stop it
+	usleep(BENCH_DRAIN_MS * 1000);
+	t = 1;
+	if (write(g_stop_efd, &t, sizeof(t)) != sizeof(t))
+		fprintf(stderr, "Failed to stop the receiver thread (%s)\n", strerror(errno));
+	pthread_join(tid, NULL);
+	if (read(g_stop_efd, &t, sizeof(t)) != sizeof(t))
+		fprintf(stderr, "Failed to reset the stop eventfd (%s)\n", strerror(errno));
+
+	// completions of the last sends
+	if (c->uring) {
+		loop_submit();
+		teardown_loop();
+	}
+
+	received = g_recv.packets;
+	for (t = 0; t < RECV_MAX_STREAMS; t++)
+		lost += g_recv.streams[t].lost;
+
+	fprintf(g_out_file, "{\"version\": %d, \"bench\": \"e2e_loopback\", \"format\": \"%s\", \"profile\": \"%s\", "
+		"\"backend\": \"%s\", \"load_packets_per_sec\": %.0f, \"timestamps\": %s, \"offered_hz\": %u, "
+		"\"groups_per_sec\": %.0f, \"packets_per_sec\": %.0f, \"received_per_sec\": %.0f, \"lost\": %lu, "
+		"\"sender_cpu\": %.3f, \"receiver_cpu\": %.3f, \"sender_ns_per_packet\": %.1f, \"sender_syscalls_per_packet\": %.2f, "
+		"\"event_to_send_p50_us\": %llu, \"event_to_send_p99_us\": %llu, "
+		"\"event_to_receive_p50_us\": %llu, \"event_to_receive_p99_us\": %llu, \"event_to_receive_max_us\": %llu}\n",
+		BENCH_VERSION, names[c->format], profiles[c->profile], c->uring ? "io_uring" : "sync", g_load_packets / wall,
+		timestamps ? "true" : "false", c->rate_hz,
+		i / wall, upd.packets / wall, received / wall, lost,
+		sender_cpu / wall, cpu_sec(&g_recv_usage) / wall,
+		upd.packets ? sender_cpu * 1e9 / upd.packets : 0.0, upd.packets ? (double)syscalls / upd.packets : 0.0,
+		(unsigned long long)hist_percentile(&upd.send_latency, 50),
+		(unsigned long long)hist_percentile(&upd.send_latency, 99),
+		(unsigned long long)hist_percentile(&g_recv_latency, 50),
+		(unsigned long long)hist_percentile(&g_recv_latency, 99),
+		(unsigned long long)g_recv_latency.max);
+	fprintf(stderr, "e2e %-9s %-7s %-8s %7u Hz offered%s: %9.0f groups/s in, %9.0f packets/s out, %9.0f received/s, "
+		"%lu lost, cpu sender %.0f%% receiver %.0f%%, %.2f sender syscalls/packet\n",
+		names[c->format], profiles[c->profile], c->uring ? "io_uring" : "sync", c->rate_hz, c->load ? " (load)" : "",
+		i / wall, upd.packets / wall, received / wall, lost, 100 * sender_cpu / wall, 100 * cpu_sec(&g_recv_usage) / wall,
+		upd.packets ? (double)syscalls / upd.packets : 0.0);
+	if (timestamps)
+		fprintf(stderr, "e2e %-9s %-7s event->receive p50 %llu p99 %llu max %llu us\n", names[c->format],
+			profiles[c->profile], (unsigned long long)hist_percentile(&g_recv_latency, 50),
+			(unsigned long long)hist_percentile(&g_recv_latency, 99), (unsigned long long)g_recv_latency.max);
+
+out_upd:
+	teardown_update(&upd);
+out_recv:
+	teardown_receiver(&g_recv);
+	return rc;
+}
+
+
+/***********************************************************************************************************************
+* MAIN
+***********************************************************************************************************************/
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-m] [-e] [-t seconds] [-l] [-b] [-u] [-o file]\n"
+		"  -m         only the micro benchmarks of the codecs\n"
+		"  -e         only the end-to-end loopback benchmark\n"
+		"  -t seconds duration of every end-to-end case, default %d\n"
+		"  -l         end-to-end packets carry the latency timestamps (like 'event_sender -l')\n"
+		"  -u         add the cases with the io_uring backend (built with CFG_USE_IO_URING=1)\n"
+		"  -b         add the cases with a background UDP load (both socket profiles, implies -l)\n"
+		"  -o file    write the results as one JSON object per line to 'file', default stdout\n"
+		"The readable summary goes to stderr.\n",
+		prog, BENCH_E2E_SEC);
+}
+
+int main(int argc, char **argv)
+{
+	int i, opt, rc = 0, micro_rc = 0;
+	int profile = -1;
+	bool micro = true, e2e = true, timestamps = false, load = false, uring = false;
+	unsigned sec = BENCH_E2E_SEC;
+	char dest[64];
+	char *dests[] = {dest};
+	e2e_case_t cases[] = {
+		{WIRE_PROTOBUF, 0, NW_PROFILE_DEFAULT, false, false},
+		{WIRE_PROTOBUF_V2, 0, NW_PROFILE_DEFAULT, false, false},
+		{WIRE_COMPACT, 0, NW_PROFILE_DEFAULT, false, false},
+		{WIRE_PROTOBUF, 1000, NW_PROFILE_DEFAULT, false, false},
+		{WIRE_PROTOBUF, 10000, NW_PROFILE_DEFAULT, false, false},
+		{WIRE_PROTOBUF, 1000, NW_PROFILE_LOWLAT, false, false},
+		{WIRE_PROTOBUF, 1000, NW_PROFILE_DEFAULT, true, false},
+		{WIRE_PROTOBUF, 1000, NW_PROFILE_LOWLAT, true, false},
+		{WIRE_PROTOBUF, 0, NW_PROFILE_DEFAULT, false, true},
+		{WIRE_COMPACT, 0, NW_PROFILE_DEFAULT, false, true},
+		{WIRE_PROTOBUF, 1000, NW_PROFILE_DEFAULT, false, true},
+	};
+
+	g_out_file = stdout;
+
+	while ((opt = getopt(argc, argv, "met:lbuo:h")) != -1) {
+		switch (opt) {
+			case 'm':
+				e2e = false;
+				break;
+			case 'e':
+				micro = false;
+				break;
+			case 't':
+				sec = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				timestamps = true;
+				break;
+			case 'u':
+				uring = true;
+				break;
+			case 'b':
+				load = true;
+				timestamps = true;
+				break;
+			case 'o':
+				g_out_file = fopen(optarg, "w");
+				if (!g_out_file) {
+					fprintf(stderr, "Failed to open %s (%s)\n", optarg, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (micro) {
+		if (setup_micro()) {
+			fprintf(stderr, "Error setting up the micro benchmarks!\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < sizeof(g_micro) / sizeof(g_micro[0]); i++)
+			if (run_micro(&g_micro[i]))
+				micro_rc = -ENOMEM;
+		free_nunchuk_protobuf(g_msg);
+	}
+
+	if (e2e) {
+		g_stop_efd = eventfd(0, EFD_CLOEXEC);
+		if (g_stop_efd < 0) {
+			fprintf(stderr, "Failed to create the stop eventfd (%s)\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && !rc; i++) {
+			if ((cases[i].load && !load) || (cases[i].uring && !uring))
+				continue;
+
+			// the socket options are applied at init, i.e. a profile change needs a new socket
+			if (cases[i].profile != profile) {
+				if (profile >= 0)
+					teardown_nw();
+				profile = cases[i].profile;
+
+				// the receiver on the loopback is the only destination (the benchmark is built without avahi),
+				// the spec is parsed in place, i.e. it is rewritten for every init
+				snprintf(dest, sizeof(dest), "127.0.0.1:%d,protobuf,compact,protobuf2", BENCH_PORT);
+				if (init_nw(dests, 1, profile)) {
+					fprintf(stderr, "Error initializing the network subsystem!\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			rc = run_e2e(&cases[i], sec, timestamps);
+		}
+		if (rc)
+			fprintf(stderr, "End-to-end benchmark failed (%s)\n", strerror(-rc));
+
+		if (profile >= 0)
+			teardown_nw();
+		close(g_stop_efd);
+	}
+
+	fclose(g_out_file);
+	return rc || micro_rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
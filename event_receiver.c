@@ -0,0 +1,275 @@
+#define _GNU_SOURCE /* recvmmsg */
+#include <stdio.h>
+#include <stdlib.h> /* exit */
+#include <unistd.h> /* close(), getopt */
+#include <signal.h> /* sigprocmask */
+#include <string.h> /* strerror */
+#include <errno.h> /* err codes */
+#include <sys/signalfd.h> /* signalfd */
+#include <sys/timerfd.h> /* timerfd */
+
+#include "event_sender.h"
+#include "avahi_handling.h"
+#include "loop_handling.h"
+#include "receiver_handling.h"
+#include "shm_handling.h"
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define DEFAULT_PORT 8888
+#define DEFAULT_FORMATS "protobuf,compact,protobuf2"
+#define SHM_POLL_MS 10 // poll period of the shared memory if the sender does not wake its readers
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+static receiver_t g_recv;
+static bool g_verbose = false;
+
+// local transport, the states are read from the shared memory of a sender on the same host
+static bool g_use_shm = false;
+static shm_reader_t g_shm;
+static unsigned g_shm_updates[SHM_MAX_DEVS]; // updates of every device seen so far
+static unsigned long g_shm_interval = 0; // updates since the last report
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p port] [-n name] [-f formats] [-N] [-L path] [-i interval] [-v]\n"
+		"  -p port     UDP port to receive on, default %d\n"
+		"  -n name     name of the published service, default " SRVC_NAME "\n"
+		"  -f formats  formats announced in the TXT record, default " DEFAULT_FORMATS "\n"
+		"  -N          do not publish the service (e.g. loopback load tests with 'event_sender -D')\n"
+		"  -L path     read the states from the shared memory of a sender on this host ('event_sender -D shm:path')\n"
+		"  -i interval print the receive rate, loss and reordering every 'interval' s, default 1 (0: off)\n"
+		"  -v          print every update\n",
+		prog, DEFAULT_PORT);
+}
+
+/* Called by the receiver for every decoded update, prints the reconstructed state of the device */
+static void handle_update(recv_stream_t *s, nun_stat_t *stat, void *ctx)
+{
+	if (!g_verbose)
+		return;
+
+	printf("Device %u seq %u%s: But-C=%d, But-Z=%d, Joy-X=%d, Joy-Y=%d%s\n",
+		stat->dev_id, stat->seq, stat->keyframe ? " (keyframe)" : "",
+		s->state.but_c, s->state.but_z, s->state.joy_x, s->state.joy_y, s->stale ? " (stale)" : "");
+}
+
+
+/***********************************************************************************************************************
+* LOOP HANDLERS
+***********************************************************************************************************************/
+/* SIGINT is delivered via a signalfd, i.e. it is handled synchronously by the main loop */
+static int handle_signal(int fd, uint32_t events, void *ctx)
+{
+	struct signalfd_siginfo si;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+
+	if (si.ssi_signo == SIGINT)
+		loop_stop();
+
+	return 0;
+}
+
+/* Called by the main loop whenever packets are pending on the socket */
+static int handle_socket(int fd, uint32_t events, void *ctx)
+{
+	return receiver_read(&g_recv);
+}
+
+/* Called by the main loop whenever the sender published a state (eventfd) or the poll period expired (timerfd) */
+static int handle_shm(int fd, uint32_t events, void *ctx)
+{
+	unsigned i, n;
+	uint64_t cnt;
+	nun_stat_t stat;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return 0;
+
+	// the latest state of every device, intermediate ones that were overwritten meanwhile are skipped
+	for (i = 0; i < SHM_MAX_DEVS; i++) {
+		n = shm_read(&g_shm, i, &stat);
+		if (n == g_shm_updates[i])
+			continue;
+		g_shm_interval += n - g_shm_updates[i];
+		g_shm_updates[i] = n;
+
+		if (g_verbose)
+			printf("Device %u seq %u (shared memory): But-C=%d, But-Z=%d, Joy-X=%d, Joy-Y=%d%s\n",
+				i, stat.seq, stat.but_c, stat.but_z, stat.joy_x, stat.joy_y,
+				stat.normalized ? " (normalized)" : "");
+	}
+
+	return 0;
+}
+
+/* Called by the main loop once per report interval */
+static int handle_report(int fd, uint32_t events, void *ctx)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	if (g_use_shm) {
+		printf("Shared memory: %lu updates, %lu read retries\n", g_shm_interval, g_shm.retries);
+		g_shm_interval = 0;
+		return 0;
+	}
+
+	receiver_print_interval(&g_recv, stdout);
+
+	// the pongs are received with the updates, the best one of the interval is used from the next report on
+	receiver_ping(&g_recv);
+
+	return 0;
+}
+
+
+/***********************************************************************************************************************
+* MAIN
+***********************************************************************************************************************/
+int main(int argc, char **argv)
+{
+	int opt, sfd, tfd = -1, pfd = -1, rc;
+	unsigned port = DEFAULT_PORT;
+	unsigned interval = 1;
+	bool publish = true;
+	char *name = SRVC_NAME;
+	char *formats = DEFAULT_FORMATS;
+	char *shm_path = NULL;
+	sigset_t mask;
+	struct itimerspec its = {0};
+
+	// parse cmdline options
+	while ((opt = getopt(argc, argv, "p:n:f:NL:i:vh")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				name = optarg;
+				break;
+			case 'f':
+				formats = optarg;
+				break;
+			case 'N':
+				publish = false;
+				break;
+			case 'L':
+				shm_path = optarg;
+				g_use_shm = true;
+				publish = false;
+				break;
+			case 'i':
+				interval = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				g_verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	rc = g_use_shm ? shm_attach(&g_shm, shm_path) : init_receiver(&g_recv, port, handle_update, NULL);
+	if (rc) {
+		fprintf(stderr, "Error initializing the receiver!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	rc = init_loop();
+	if (rc) {
+		fprintf(stderr, "Error initializing the main loop!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// signalling for interrupting main loop, SIGINT is blocked and read from a signalfd instead
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0 || loop_add_fd(sfd, EPOLLIN, handle_signal, NULL)) {
+		fprintf(stderr, "Failed to setup signal handling\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_use_shm) {
+		// woken up per update if the sender offers it, polled otherwise
+		if (g_shm.efd < 0) {
+			its.it_value.tv_nsec = SHM_POLL_MS * 1000000L;
+			its.it_interval = its.it_value;
+			pfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+			if (pfd < 0 || timerfd_settime(pfd, 0, &its, NULL)) {
+				fprintf(stderr, "Failed to setup poll timer\n");
+				exit(EXIT_FAILURE);
+			}
+			its = (struct itimerspec){0};
+		}
+		if (loop_add_fd(g_shm.efd >= 0 ? g_shm.efd : pfd, EPOLLIN, handle_shm, NULL)) {
+			fprintf(stderr, "Failed to register shared memory\n");
+			exit(EXIT_FAILURE);
+		}
+	} else if (loop_add_fd(g_recv.fd, EPOLLIN, handle_socket, NULL)) {
+		fprintf(stderr, "Failed to register socket\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// periodic report, it also drives the clock offset estimation
+	if (interval) {
+		its.it_value.tv_sec = interval;
+		its.it_interval = its.it_value;
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) || loop_add_fd(tfd, EPOLLIN, handle_report, NULL)) {
+			fprintf(stderr, "Failed to setup report timer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// the avahi thread announces the service, senders start right after they resolved it
+	if (publish && avahi_start_publish(name, port, formats)) {
+		fprintf(stderr, "Error publishing the service!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (g_use_shm)
+		printf("Reading the shared memory of %s%s\n", shm_path, g_shm.efd >= 0 ? "" : " (polled)");
+	else
+		printf("Receiving on port %u%s\n", port, publish ? "" : " (not published)");
+
+	rc = loop_run();
+	if (rc)
+		fprintf(stderr, "Main loop terminated with error (%s)\n", strerror(-rc));
+
+	// cleanup
+	printf("Graceful exit.\n");
+	if (publish)
+		avahi_stop_publish();
+	loop_print_stats(stdout);
+	teardown_loop();
+	if (g_use_shm) {
+		printf("Shared memory: %lu read retries\n", g_shm.retries);
+		shm_detach(&g_shm);
+	} else {
+		receiver_print_stats(&g_recv, stdout);
+		teardown_receiver(&g_recv);
+	}
+	if (tfd >= 0)
+		close(tfd);
+	if (pfd >= 0)
+		close(pfd);
+	close(sfd);
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,237 +1,697 @@
 #include <stdio.h>
 #include <stdlib.h> /* exit */
-#include <fcntl.h> /* open */
-#include <unistd.h> /* close() */
-#include <signal.h> /* signal */
+#include <unistd.h> /* close(), getopt */
+#include <signal.h> /* sigprocmask */
 #include <string.h> /* strerror, strcmp */
 #include <errno.h> /* err codes */
+#include <fcntl.h> /* open */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/signalfd.h> /* signalfd */
 
 #include "event_sender.h"
-#include "protobuf_handling.h"
 #include "network_handling.h"
+#include "loop_handling.h"
+#include "input_handling.h"
+#include "update_handling.h"
+#include "ring_handling.h"
+#include "source_handling.h"
+#include "metrics_handling.h"
+#include "filter_handling.h"
+#include "calib_handling.h"
+#include "rt_handling.h"
+
 
-/**
- * Compiler from buildroot toolchain automatically searches in the target's sysroot for headers and libs.
- * (include/lib path is 'buildroot/output/host/arm-buildroot-linux-uclibcgnueabihf/sysroot/usr/{include/lib}')
- */
-#include <libevdev-1.0/libevdev/libevdev.h>
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define MAX_DEVICES 8 // device ids have to fit into the compact header (COMPACT_MAX_DEV_ID)
+#define DEV_NAME "Wii Nunchuk"
+#define DEFAULT_KEYFRAME_MS 1000
 
 
 /***********************************************************************************************************************
 * GLOBAL DATA
 ***********************************************************************************************************************/
-static volatile bool keep_running = true;
+static input_dev_t g_devs[MAX_DEVICES];
+static update_ctx_t g_upds[MAX_DEVICES]; // g_upds[i] belongs to g_devs[i], i is the device id
+static filter_t g_filters[MAX_DEVICES]; // joystick filter of g_devs[i]
+static calib_t g_calibs[MAX_DEVICES]; // calibration of g_devs[i]
+static unsigned g_num_devs = 0;
+static unsigned g_num_active = 0;
+
+// pipelined mode, the input thread (main) produces into the ring, the network thread consumes
+static bool g_pipelined = false;
+static ring_t g_ring;
+static atomic_bool g_nw_stop;
+static int g_nw_rc = 0;
+
+// io_uring backend of the main loop (and of the network thread if pipelined)
+static bool g_use_uring = false;
+
+// real-time mode, its latency probe is served by the main loop
+static rt_t g_rt;
+
+// synthetic input source, its virtual device is opened like a real one
+static bool g_use_source = false;
+static source_t g_source;
 
 
 /***********************************************************************************************************************
-* HANDLERS
+* HELPER FUNC
 ***********************************************************************************************************************/
-void intHandler(int dummy) {
-	keep_running = false;
+static int parse_format(const char *name)
+{
+	int i;
+	const char *names[] = WIRE_FORMAT_NAMES;
+
+	for (i = 0; i < WIRE_NUM_FORMATS; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+
+	return -1;
+}
+
+static int parse_profile(const char *name)
+{
+	int i;
+	const char *names[] = NW_PROFILE_NAMES;
+
+	for (i = 0; i < NW_NUM_PROFILES; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+
+	return -1;
+}
+
+static int parse_policy(const char *name)
+{
+	if (!strcmp(name, "drop"))
+		return RING_DROP_OLDEST;
+	if (!strcmp(name, "coalesce"))
+		return RING_COALESCE;
+
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-r rate] [-f format] [-k ms] [-j filter] [-c] [-C file] [-t profile] [-p policy] [-u] [-R prio[:cpu]] [-l] [-d device]... [-D ip:port[,format...]]... [-s source] [-w file] [-m socket]\n"
+		"  -r rate   coalesce event groups and send at most 'rate' packets/s (e.g. 125, 250, 500)\n"
+		"            default 0: send every event group immediately\n"
+		"  -f format wire format 'protobuf' (default), 'protobuf2' or 'compact', the receiver has to support it\n"
+		"  -k ms     send a keyframe (complete state) every 'ms' milliseconds, default %d (0: only on loss)\n"
+		"  -j filter joystick filter deadband[:hysteresis[:levels]] in axis units, e.g. 8:2:64 (levels 0: no quantization)\n"
+		"  -c        calibrate the axes to 0..%d with the range, flat and fuzz reported by the device\n"
+		"  -C file   calibrate with the profiles in 'file' (lines 'dev axis min max [flat [fuzz]]', dev '*': all)\n"
+		"  -t profile socket profile 'default' or 'lowlat' (connected, DSCP EF, non-blocking, stale joystick\n"
+		"            updates are dropped if the socket buffer is full, button transitions never)\n"
+		"  -p policy pipelined mode, encode and send on a separate network thread\n"
+		"            'drop' (drop oldest) or 'coalesce' if the queue between the threads is full\n"
+		"  -u        io_uring backend, input reads and sends are submitted with the wait of the main loop\n"
+		"  -R rt     real-time mode, SCHED_FIFO priority 'prio' (1..99), optionally pinned to 'cpu', memory locked\n"
+		"  -l        packets carry the send timestamp and the age of the event group (latency measurement)\n"
+		"  -d device use the given event device (can be repeated)\n"
+		"            default: every " DEV_NAME " in " INPUT_DEV_DIR "\n"
+		"  -D dest   send to the given receiver in addition to the discovered ones (can be repeated)\n"
+		"            e.g. 10.10.0.102:8888,protobuf,compact (without formats only protobuf is assumed)\n"
+		"            shm:path[,wake] publishes into shared memory for readers on this host instead\n"
+		"  -s source add a virtual " DEV_NAME " (uinput) driven by a generator or a recorded trace\n"
+		"            gen:rate[:sweep|random|buttons[:seconds]] or replay:file[:speed|max]\n"
+		"  -w file   record the raw input events of all devices into 'file' (trace for -s replay)\n"
+		"  -m socket every client of the UNIX socket 'socket' gets a dump of the metrics (like on SIGUSR1)\n",
+		prog, DEFAULT_KEYFRAME_MS, CALIB_NORM_MAX);
+}
+
+/* Called by the input layer for every complete event group */
+static int handle_group(nun_stat_t *nun_status, void *ctx)
+{
+	ring_rec_t rec;
+	unsigned dev_id = (update_ctx_t *)ctx - g_upds;
+
+	// axis jitter is absorbed before it costs a ring slot or a packet
+	if (!filter_apply(&g_filters[dev_id], nun_status))
+		return 0;
+
+	// table lookups only, the receivers get the normalized range of every device
+	calib_apply(&g_calibs[dev_id], nun_status);
+
+	// like the network thread (see handle_ring()) an encoding or timer error stops the loop
+	if (!g_pipelined)
+		return update_submit(ctx, nun_status);
+
+	// hand the group over to the network thread, the input thread never blocks on the socket
+	rec.dev_id = dev_id;
+	rec.stat = *nun_status;
+	ring_push(&g_ring, &rec);
+
+	return 0;
 }
 
 
 /***********************************************************************************************************************
-* HELPER FUNC
+* LOOP HANDLERS
 ***********************************************************************************************************************/
-void print_nun_stat(nun_stat_t *nun_stat)
+/* SIGINT and SIGUSR1 are delivered via a signalfd, i.e. they are handled synchronously by the main loop */
+static int handle_signal(int fd, uint32_t events, void *ctx)
 {
-	printf(">>> Buttons:  But-C=%d, But-Z=%d\n", nun_stat->but_c, nun_stat->but_z);
-	printf(">>> Joystick: Joy-X=%d, Joy-Y=%d\n", nun_stat->joy_x, nun_stat->joy_y);
+	struct signalfd_siginfo si;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+
+	if (si.ssi_signo == SIGINT)
+		loop_stop();
+	else if (si.ssi_signo == SIGUSR1)
+		metrics_dump(stdout);
+
+	return 0;
 }
 
-int unpack_buffer(uint8_t *buffer, unsigned length)
+/* Called by the main loop whenever a client connected to the metrics socket */
+static int handle_metrics(int fd, uint32_t events, void *ctx)
 {
-	nun_stat_t nun_stat;
+	return metrics_handle_socket();
+}
+
+/* Called by the main loop whenever an input device has pending events */
+static int handle_input(int fd, uint32_t events, void *ctx)
+{
+	input_dev_t *dev = ctx;
+
+	// a vanished device is removed, the remaining ones keep going
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		fprintf(stderr, "Input device %ld vanished!\n", (long)(dev - g_devs));
+		loop_del_fd(dev->fd);
+		close_input_dev(dev);
+		return --g_num_active ? 0 : -ENODEV;
+	}
+
+	// drain all pending events, complete groups are sent out via handle_group()
+	return input_read(ctx);
+}
+
+/* Called by the io_uring backend of the main loop whenever a read of an input device completed */
+static int handle_input_done(int res, void *ctx)
+{
+	input_dev_t *dev = ctx;
+
+	// a vanished device is removed, the remaining ones keep going
+	if (res == -ENODEV || res == -ECANCELED) {
+		fprintf(stderr, "Input device %ld vanished!\n", (long)(dev - g_devs));
+		close_input_dev(dev);
+		return --g_num_active ? LOOP_IO_DONE : -ENODEV;
+	}
+
+	// the batch of this read, the read is re-armed afterwards
+	return input_read_done(dev, res);
+}
+
+/* Called by the main loop whenever the latency probe of the real-time mode expired */
+static int handle_rt_probe(int fd, uint32_t events, void *ctx)
+{
+	return rt_handle_probe(&g_rt);
+}
+
+/* Called by the main loop whenever the coalescing timer expired */
+static int handle_tick(int fd, uint32_t events, void *ctx)
+{
+	return update_tick(ctx);
+}
+
+/* Called whenever the receiver was found, moved or removed by the discovery */
+static int handle_nw(int fd, uint32_t events, void *ctx)
+{
+	int i, rc;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return 0;
 
-	int err = unpack_nunchuk_protobuf(buffer, length, &nun_stat);
-	if (err) {
-		fprintf(stderr, "Error unpacking protobuf!");
-		return err;
+	for (i = 0; i < g_num_devs; i++) {
+		rc = update_refresh(&g_upds[i]);
+		if (rc)
+			return rc;
 	}
 
-	print_nun_stat(&nun_stat);
+	return 0;
+}
+
+/* Called by the main loop whenever the keyframe timer expired */
+static int handle_keyframe(int fd, uint32_t events, void *ctx)
+{
+	return update_keyframe_tick(ctx);
+}
+
+/* Called whenever a receiver sent a control message (ping or nack) */
+static int handle_ctrl(int fd, uint32_t events, void *ctx)
+{
+	int i, rc;
+	unsigned reqs;
+
+	rc = nw_handle_ctrl();
+	if (rc)
+		return rc;
+
+	// a receiver lost a packet of the device, i.e. its state may be wrong until the next keyframe
+	reqs = nw_get_keyframe_requests();
+	for (i = 0; i < g_num_devs; i++) {
+		if (!(reqs & (1u << i)))
+			continue;
+		rc = update_request_keyframe(&g_upds[i]);
+		if (rc)
+			return rc;
+	}
 
 	return 0;
 }
 
-int send_update(NunchukUpdate *nun_protobuf)
+/* Input thread: the network thread freed a slot, push the staged records */
+static int handle_ring_space(int fd, uint32_t events, void *ctx)
 {
-		int err;
-		unsigned length;
-		uint8_t *buffer;
+	uint64_t cnt;
 
-		err = pack_nunchuk_protobuf(nun_protobuf, &buffer, &length);
-		if (err) {
-			fprintf(stderr, "Failed to pack protobuf (%s)\n", strerror(-err));
-			return err;
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return 0;
+
+	ring_flush_staged(&g_ring);
+
+	return 0;
+}
+
+/* Network thread: the input thread queued records (or requests to stop) */
+static int handle_ring(int fd, uint32_t events, void *ctx)
+{
+	int rc;
+	uint64_t cnt;
+	ring_rec_t rec;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return 0;
+
+	// drain the ring, then announce to sleep, the input thread only signals a sleeping consumer
+	do {
+		while (ring_pop(&g_ring, &rec)) {
+			rc = update_submit(&g_upds[rec.dev_id], &rec.stat);
+			if (rc)
+				return rc;
 		}
+	} while (!ring_prepare_sleep(&g_ring));
 
-		/* debug */
-		// unpack_buffer(buffer, length);
+	if (atomic_load(&g_nw_stop))
+		loop_stop();
 
-		// send out buf
-		return nw_send(buffer, length);
+	return 0;
+}
+
+
+/***********************************************************************************************************************
+* NETWORK THREAD
+***********************************************************************************************************************/
+/* Encodes and sends the records of the ring, runs its own loop with the ring eventfd and the coalescing timers */
+static void *nw_thread(void *arg)
+{
+	int i, rc;
+
+	rc = g_use_uring ? init_loop_uring() : init_loop();
+	if (rc)
+		goto out;
+
+	rc = loop_add_fd(g_ring.efd, EPOLLIN, handle_ring, NULL);
+	if (!rc)
+		rc = loop_add_fd(nw_get_event_fd(), EPOLLIN, handle_nw, NULL);
+	if (!rc)
+		rc = loop_add_fd(nw_get_fd(), EPOLLIN, handle_ctrl, NULL);
+	for (i = 0; !rc && i < g_num_devs; i++) {
+		if (g_upds[i].timer_fd >= 0)
+			rc = loop_add_fd(g_upds[i].timer_fd, EPOLLIN, handle_tick, &g_upds[i]);
+		if (!rc && g_upds[i].keyframe_fd >= 0)
+			rc = loop_add_fd(g_upds[i].keyframe_fd, EPOLLIN, handle_keyframe, &g_upds[i]);
+	}
+
+	// the consumer starts asleep, the first record signals the eventfd
+	ring_prepare_sleep(&g_ring);
+
+	if (!rc)
+		rc = loop_run();
+
+	printf("Network thread:\n");
+	loop_print_stats(stdout);
+	teardown_loop();
+
+out:
+	// a failing network stage terminates the input thread as well (SIGINT is read by its signalfd)
+	if (rc) {
+		fprintf(stderr, "Network thread terminated with error (%s)\n", strerror(-rc));
+		g_nw_rc = rc;
+		kill(getpid(), SIGINT);
+	}
+
+	return NULL;
 }
 
 
 /***********************************************************************************************************************
 * MAIN
 ***********************************************************************************************************************/
-#define PRINT_EV 0
-int main()
-{
-	bool event_complete;
-	int fd, rc, x_max, y_max;
-	struct libevdev *evdev = NULL;
-	NunchukUpdate *nun_protobuf;
-
-	// init the protobuf used to send nunchuk data
-	nun_protobuf = new_nunchuk_protobuf();
-	if (!nun_protobuf) {
-		fprintf(stderr, "Error allocating protobuf!\n");
+int main(int argc, char **argv)
+{
+	int i, opt, sfd, rc;
+	unsigned rate = 0;
+	unsigned keyframe_ms = DEFAULT_KEYFRAME_MS;
+	int format = WIRE_PROTOBUF;
+	int policy = RING_DROP_OLDEST;
+	int profile = NW_PROFILE_DEFAULT;
+	bool timestamps = false;
+	pthread_t nw_tid;
+	sigset_t mask;
+	void *ctxs[MAX_DEVICES];
+	char *paths[MAX_DEVICES];
+	unsigned num_paths = 0;
+	char *dests[NW_MAX_DESTS];
+	unsigned num_dests = 0;
+	char *source = NULL;
+	char *record = NULL;
+	int record_fd = -1;
+	char *metrics_path = NULL;
+	char *filter = NULL;
+	bool calibrate = false;
+	char *calib_path = NULL;
+	char *rt_spec = NULL;
+
+	// parse cmdline options
+	while ((opt = getopt(argc, argv, "r:f:k:j:cC:t:p:uR:ld:D:s:w:m:h")) != -1) {
+		switch (opt) {
+			case 'r':
+				rate = strtoul(optarg, NULL, 0);
+				break;
+			case 'f':
+				format = parse_format(optarg);
+				if (format < 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'k':
+				keyframe_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'j':
+				filter = optarg;
+				break;
+			case 'c':
+				calibrate = true;
+				break;
+			case 'C':
+				calib_path = optarg;
+				calibrate = true;
+				break;
+			case 't':
+				profile = parse_profile(optarg);
+				if (profile < 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				policy = parse_policy(optarg);
+				if (policy < 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				g_pipelined = true;
+				break;
+			case 'u':
+				g_use_uring = true;
+				break;
+			case 'R':
+				rt_spec = optarg;
+				break;
+			case 'l':
+				timestamps = true;
+				break;
+			case 'd':
+				if (num_paths == MAX_DEVICES) {
+					fprintf(stderr, "At most %d devices are supported\n", MAX_DEVICES);
+					exit(EXIT_FAILURE);
+				}
+				paths[num_paths++] = optarg;
+				break;
+			case 'D':
+				if (num_dests == NW_MAX_DESTS) {
+					fprintf(stderr, "At most %d destinations are supported\n", NW_MAX_DESTS);
+					exit(EXIT_FAILURE);
+				}
+				dests[num_dests++] = optarg;
+				break;
+			case 's':
+				source = optarg;
+				break;
+			case 'w':
+				record = optarg;
+				break;
+			case 'm':
+				metrics_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	// recording starts with the first event, the counters are reset here
+	if (init_metrics(metrics_path)) {
+		fprintf(stderr, "Error initializing the metrics!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the virtual device is served like one given by -d, without -d it is the only device
+	if (source) {
+		if (num_paths == MAX_DEVICES) {
+			fprintf(stderr, "At most %d devices are supported\n", MAX_DEVICES);
+			exit(EXIT_FAILURE);
+		}
+		if (init_source(&g_source, source, DEV_NAME)) {
+			fprintf(stderr, "Error initializing the input source!\n");
+			exit(EXIT_FAILURE);
+		}
+		g_use_source = true;
+		paths[num_paths++] = g_source.devnode;
+	}
+
+	/**
+	 * Open the input devices, the fds are non blocking so that pending events can be drained after each wakeup.
+	 * Every device gets its own update context, its index is the device id used to tag the packets.
+	 */
+	for (i = 0; i < MAX_DEVICES; i++)
+		ctxs[i] = &g_upds[i];
+
+	if (num_paths) {
+		for (i = 0; i < num_paths; i++) {
+			rc = open_input_dev(&g_devs[i], paths[i], DEV_NAME, handle_group, ctxs[i]);
+			if (rc == -ENODEV)
+				fprintf(stderr, "%s: This is not the device you are looking for ...\n", paths[i]);
+			if (rc) {
+				fprintf(stderr, "Error initializing the input device!\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		g_num_devs = num_paths;
+	} else {
+		rc = open_input_devs(g_devs, ctxs, MAX_DEVICES, DEV_NAME, handle_group);
+		if (rc <= 0) {
+			fprintf(stderr, "No %s found in %s!\n", DEV_NAME, INPUT_DEV_DIR);
+			exit(EXIT_FAILURE);
+		}
+		g_num_devs = rc;
+	}
+
+	// the filter scales to the axis range of the device
+	for (i = 0; i < g_num_devs; i++) {
+		if (init_filter(&g_filters[i], filter, g_devs[i].x_max, g_devs[i].y_max)) {
+			fprintf(stderr, "Error initializing the joystick filter!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/**
+	 * The tables are built before the real-time mode locks the memory. A fuzz of a profile is handed to the
+	 * kernel, it drops the jitter before it is queued.
+	 */
+	if (calib_path && calib_load_profiles(calib_path) < 0) {
+		fprintf(stderr, "Error loading the calibration profiles!\n");
 		exit(EXIT_FAILURE);
 	}
+	for (i = 0; calibrate && i < g_num_devs; i++) {
+		calib_t *c = &g_calibs[i];
+
+		if (init_calib(c, i, &g_devs[i].abs_x, &g_devs[i].abs_y) ||
+			(c->x.abs.fuzz != g_devs[i].abs_x.fuzz && input_set_fuzz(&g_devs[i], ABS_X, c->x.abs.fuzz)) ||
+			(c->y.abs.fuzz != g_devs[i].abs_y.fuzz && input_set_fuzz(&g_devs[i], ABS_Y, c->y.abs.fuzz))) {
+			fprintf(stderr, "Error initializing the calibration!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (record) {
+		record_fd = open(record, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+		if (record_fd < 0) {
+			fprintf(stderr, "Failed to open %s (%s)\n", record, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < g_num_devs; i++)
+			input_record(&g_devs[i], record_fd);
+	}
 
-	rc = init_nw();
+	// does not wait for the receiver, input is read (and the latest state held back) until discovery found it
+	rc = init_nw(dests, num_dests, profile);
 	if (rc) {
 		fprintf(stderr, "Error initializing the network subsystem!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// signalling for interrupting main loop
-	signal(SIGINT, intHandler);
+	rc = g_use_uring ? init_loop_uring() : init_loop();
+	if (rc) {
+		fprintf(stderr, "Error initializing the main loop!\n");
+		exit(EXIT_FAILURE);
+	}
 
-	/**
-	 * INFO:
-	 * - fopen returns a C standard FILE* which enables buffered IO, using fscanf etc
-	 * - open (syscall) returns an OS dependent fd, that enables non blocking IO using lseek/read/write etc syscalls
-	 */
+	// signalling for interrupting main loop and metrics dumps, the signals are blocked and read from a signalfd instead
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd < 0 || loop_add_fd(sfd, EPOLLIN, handle_signal, NULL)) {
+		fprintf(stderr, "Failed to setup signal handling\n");
+		exit(EXIT_FAILURE);
+	}
 
-	// init libevdev
-	fd = open("/dev/input/event0", O_RDONLY|O_NONBLOCK);
-	rc = libevdev_new_from_fd(fd, &evdev);
-	if (rc < 0) {
-		fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
+	if (metrics_get_fd() >= 0 && loop_add_fd(metrics_get_fd(), EPOLLIN, handle_metrics, NULL)) {
+		fprintf(stderr, "Failed to register metrics socket\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// display the input device
-	printf("Input device name: \"%s\"\n", libevdev_get_name(evdev));
-	printf("Input device ID: bus %#x vendor %#x product %#x\n",
-		libevdev_get_id_bustype(evdev),
-		libevdev_get_id_vendor(evdev),
-		libevdev_get_id_product(evdev));
+	for (i = 0; i < g_num_devs; i++) {
+		// init the update context (packet encoding and optional coalescing)
+		rc = init_update(&g_upds[i], i, rate, format, timestamps, keyframe_ms);
+		if (rc) {
+			fprintf(stderr, "Error initializing the update context!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// all devices are multiplexed by the main loop, it sleeps until one of them is ready
+		if (g_use_uring)
+			rc = loop_add_read(g_devs[i].fd, g_devs[i].batch, sizeof(g_devs[i].batch), handle_input_done, &g_devs[i]);
+		else
+			rc = loop_add_fd(g_devs[i].fd, EPOLLIN, handle_input, &g_devs[i]);
+		if (rc) {
+			fprintf(stderr, "Failed to register input device\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// in pipelined mode the timers are served by the network thread
+		if (!g_pipelined && g_upds[i].timer_fd >= 0 && loop_add_fd(g_upds[i].timer_fd, EPOLLIN, handle_tick, &g_upds[i])) {
+			fprintf(stderr, "Failed to register coalescing timer\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!g_pipelined && g_upds[i].keyframe_fd >= 0 &&
+			loop_add_fd(g_upds[i].keyframe_fd, EPOLLIN, handle_keyframe, &g_upds[i])) {
+			fprintf(stderr, "Failed to register keyframe timer\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	g_num_active = g_num_devs;
 
-	// check the input device
-	if (strcmp(libevdev_get_name(evdev), "Wii Nunchuk")) {
-		fprintf(stderr, "This is not the device you are looking for ...\n");
+	// the update contexts react to a found, moved or removed receiver, served by the network thread if pipelined
+	if (!g_pipelined && (loop_add_fd(nw_get_event_fd(), EPOLLIN, handle_nw, NULL) ||
+		loop_add_fd(nw_get_fd(), EPOLLIN, handle_ctrl, NULL))) {
+		fprintf(stderr, "Failed to register network notifications\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// get parameters
-	x_max = libevdev_get_abs_maximum(evdev, ABS_X);
-	y_max = libevdev_get_abs_maximum(evdev, ABS_Y);
-	if (!x_max || !y_max) {
-		fprintf(stderr, "Error getting abs max values\n");
+	/**
+	 * Real-time mode once every buffer is allocated, the network thread and the source inherit the policy and
+	 * the affinity. From now on the hot path neither faults nor prints.
+	 */
+	if (init_rt(&g_rt, rt_spec) || (g_rt.probe_fd >= 0 && loop_add_fd(g_rt.probe_fd, EPOLLIN, handle_rt_probe, NULL))) {
+		fprintf(stderr, "Error initializing the real-time mode!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// main loop
-	while (keep_running) {
-		// Event group separation
-		if (PRINT_EV) printf("--------------- EVENT ---------------\n");
-
-		// init status struct with neutral values
-		nun_stat_t nun_status = {JOY_NO_CHANGE, JOY_NO_CHANGE, BUT_KEEP, BUT_KEEP};
-
-		do {
-			struct input_event ev;
-
-			/**
-			 * libevdev_next_event() returns:
-			 * - EAGAIN if there is no new event,
-			 * - LIBEVDEV_READ_STATUS_SYNC if an event was dropped and a resync with the device is necessary
-			 * - LIBEVDEV_READ_STATUS_SUCCESS if the event was read successfully.
-			 *
-			 * Event groups are separated by an event of type EV_SYN and code SYN_REPORT.
-			 */
-			rc = libevdev_next_event(evdev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-			switch (rc) {
-				case LIBEVDEV_READ_STATUS_SUCCESS:
-					if (PRINT_EV) printf("Event: %s %s %d\n",
-						libevdev_event_type_get_name(ev.type),
-						libevdev_event_code_get_name(ev.type, ev.code),
-						ev.value);
-					event_complete = false;
-					break;
-				case LIBEVDEV_READ_STATUS_SYNC:
-					fprintf(stderr, "Dropped an event, resync required!\n");
-					event_complete = true;
-					continue;
-				case -EAGAIN:
-					/* default case: do nothing */
-					event_complete = false;
-					continue;
-				default:
-					fprintf(stderr, "Error in libevdev_next_event()!\n");
-					event_complete = true;
-					continue;
-			}
+	/**
+	 * Pipelined mode: the main thread only reads the input devices and queues the event groups,
+	 * encoding and sending is done by the network thread. SIGINT/SIGUSR1 are already blocked, i.e. they are
+	 * inherited blocked by the network thread and still read from the signalfd of the main loop.
+	 */
+	if (g_pipelined) {
+		rc = init_ring(&g_ring, policy);
+		if (rc || loop_add_fd(g_ring.space_efd, EPOLLIN, handle_ring_space, NULL)) {
+			fprintf(stderr, "Error initializing the ring!\n");
+			exit(EXIT_FAILURE);
+		}
 
-			// update nun_status
-			if (ev.type == EV_KEY) {
-				/**
-				 * Event to nun_stat mapping:
-				 * 0 <-> BUT_UP
-				 * 1 <-> BUT_DOWN
-				 * no event <-> BUT_KEEP
-				 */
-				switch (ev.code) {
-					case BTN_C:
-						nun_status.but_c = ev.value;
-						break;
-					case BTN_Z:
-						nun_status.but_z = ev.value;
-						break;
-					default:
-						fprintf(stderr, "Unexpected event code! (%d)\n", ev.code);
-						break;
-				}
-			} else if (ev.type == EV_ABS) {
-				switch (ev.code) {
-					case ABS_X:
-						nun_status.joy_x = ev.value;
-						break;
-					case ABS_Y:
-						nun_status.joy_y = ev.value;
-						break;
-					default:
-						fprintf(stderr, "Unexpected event code! (%d)\n", ev.code);
-						break;
-				}
-			} else if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
-				// indicates that input_sync() was called in the kernel, i.e. event group is complete
-				event_complete = true;
-			} else {
-				fprintf(stderr, "Unexpected event type! (%d)\n", ev.type);
-			}
+		atomic_init(&g_nw_stop, false);
+		rc = pthread_create(&nw_tid, NULL, nw_thread, NULL);
+		if (rc) {
+			fprintf(stderr, "Failed to create network thread (%s)\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("Sending updates of %u device(s)%s\n", g_num_devs, g_pipelined ? " (pipelined)" : "");
 
-		} while (!event_complete && keep_running);
+	// events are only written once the main loop is ready to read them
+	if (g_use_source && source_start(&g_source)) {
+		fprintf(stderr, "Error starting the input source!\n");
+		exit(EXIT_FAILURE);
+	}
 
-		// Event group separation
-		if (PRINT_EV) printf("\n");
+	rc = loop_run();
+	if (rc)
+		fprintf(stderr, "Main loop terminated with error (%s)\n", strerror(-rc));
 
-		// send out the protobuf with the complete event
-		fill_nunchuk_protobuf(&nun_status, nun_protobuf);
-		send_update(nun_protobuf);
+	// the network thread drains the ring before it stops
+	if (g_pipelined) {
+		uint64_t one = 1;
+
+		atomic_store(&g_nw_stop, true);
+		if (write(g_ring.efd, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "Failed to stop network thread (%s)\n", strerror(errno));
+		pthread_join(nw_tid, NULL);
+		if (!rc)
+			rc = g_nw_rc;
 	}
 
 	// cleanup
 	printf("Graceful exit.\n");
+	if (g_use_source) {
+		teardown_source(&g_source);
+		source_print_stats(&g_source, stdout);
+	}
+	loop_print_stats(stdout);
+	rt_print_stats(&g_rt, stdout);
+	teardown_rt(&g_rt);
+	nw_print_stats(stdout);
+	metrics_dump(stdout);
+	if (g_pipelined) {
+		ring_print_stats(&g_ring, stdout);
+		teardown_ring(&g_ring);
+	}
+	for (i = 0; i < g_num_devs; i++) {
+		printf("Device %d:\n", i);
+		input_print_stats(&g_devs[i], stdout);
+		filter_print_stats(&g_filters[i], stdout);
+		calib_print_stats(&g_calibs[i], stdout);
+		teardown_calib(&g_calibs[i]);
+		update_print_stats(&g_upds[i], stdout);
+		teardown_update(&g_upds[i]);
+		close_input_dev(&g_devs[i]);
+	}
+	teardown_loop();
 	teardown_nw();
-	free_nunchuk_protobuf(nun_protobuf);
-	libevdev_free(evdev);
-	close(fd);
-	return EXIT_SUCCESS;
+	teardown_metrics();
+	if (record_fd >= 0)
+		close(record_fd);
+	close(sfd);
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -2,18 +2,36 @@
 #define _event_sender
 
 #include <stdbool.h>
+#include <stdint.h>
 
 
 /*******************************************************************************
 * MACROS/DEFINES
 *******************************************************************************/
 #define JOY_NO_CHANGE -1
+#define NUN_STAT_NEUTRAL {JOY_NO_CHANGE, JOY_NO_CHANGE, BUT_KEEP, BUT_KEEP, 0, 0, 0, 0, false, false}
 typedef enum _but_state_t{
 	BUT_UP = 0,
 	BUT_DOWN,
 	BUT_KEEP
 } but_state_t;
 
+/* packed button bitfield used by the compact and the protobuf v2 format, 2 bits per button */
+#define BUT_BITS_PACK(c, z) (((c) & 0x3) | (((z) & 0x3) << 2))
+#define BUT_BITS_C(bits) ((bits) & 0x3)
+#define BUT_BITS_Z(bits) (((bits) >> 2) & 0x3)
+
+/* wire formats, the receiver advertises the supported ones in its TXT record ("formats=protobuf,compact") */
+typedef enum _wire_format_t{
+	WIRE_PROTOBUF = 0,	// NunchukUpdate protobuf, default
+	WIRE_COMPACT,		// fixed size binary format, see compact_handling.h
+	WIRE_PROTOBUF_V2,	// NunchukUpdateV2 protobuf
+	WIRE_NUM_FORMATS,
+	WIRE_LOCAL = WIRE_NUM_FORMATS	// the complete nun_stat_t itself, only for the local transport (not announced)
+} wire_format_t;
+#define WIRE_FORMAT_NAMES {"protobuf", "compact", "protobuf2"}
+#define WIRE_FORMAT_BIT(fmt) (1u << (fmt))
+
 /*******************************************************************************
 * DATA STRUCTURES
 *******************************************************************************/
@@ -23,6 +41,23 @@ typedef struct
 	int joy_y;
 	but_state_t but_c;
 	but_state_t but_z;
+
+	// CLOCK_MONOTONIC timestamps of the sender in us, 0 if unknown
+	uint64_t event_ts; // kernel timestamp of the (oldest merged) event group
+	uint64_t send_ts; // time the packet was encoded, only set if timestamps are sent
+
+	// packet header, only set by the decoders (the sender tags its packets from the update context)
+	uint8_t dev_id;
+	uint16_t seq;
+
+	/**
+	 * Keyframe: the complete state of the device, i.e. the values are absolute instead of changes.
+	 * JOY_NO_CHANGE/BUT_KEEP only remain for values that were never read from the device.
+	 */
+	bool keyframe;
+
+	// the axes are calibrated to 0..CALIB_NORM_MAX (see calib_handling.h) instead of the raw range of the device
+	bool normalized;
 } nun_stat_t;
 
 
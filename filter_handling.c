@@ -0,0 +1,157 @@
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* strtoul, abs */
+#include <string.h> /* memset */
+#include <errno.h> /* err codes */
+
+#include "filter_handling.h"
+#include "metrics_handling.h"
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static void init_axis(filter_axis_t *axis, int max)
+{
+	axis->max = max;
+	axis->center = max / 2;
+	axis->last_in = JOY_NO_CHANGE;
+	axis->last_out = JOY_NO_CHANGE;
+}
+
+/* map a value to the nearest of 'levels' evenly spaced levels of 0..max, the result is in axis units again */
+static int quantize(int v, int max, unsigned levels)
+{
+	int steps = levels - 1;
+	int q = (v * steps + max / 2) / max;
+
+	return (q * max + steps / 2) / steps;
+}
+
+/**
+ * Filter one axis value
+ *
+ * return: the value to send, JOY_NO_CHANGE if it was absorbed
+ */
+static int filter_axis(filter_t *f, filter_axis_t *axis, int v)
+{
+	if (v == JOY_NO_CHANGE)
+		return v;
+
+	f->values++;
+
+	if (v < 0)
+		v = 0;
+	if (v > axis->max)
+		v = axis->max;
+
+	// the stick at rest never sends its jitter, a return to the center always passes the hysteresis
+	if (abs(v - axis->center) <= f->deadband) {
+		if (v != axis->center)
+			f->centered++;
+		v = axis->center;
+	} else if (axis->last_in != JOY_NO_CHANGE && abs(v - axis->last_in) <= f->hysteresis) {
+		f->absorbed_hyst++;
+		return JOY_NO_CHANGE;
+	}
+	axis->last_in = v;
+
+	// the center is kept exactly, the receiver sees the stick at rest
+	if (f->levels && v != axis->center)
+		v = quantize(v, axis->max, f->levels);
+
+	if (v == axis->last_out) {
+		f->absorbed_quant++;
+		return JOY_NO_CHANGE;
+	}
+	axis->last_out = v;
+
+	return v;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_filter(filter_t *f, const char *spec, int x_max, int y_max)
+{
+	char *end;
+	unsigned long vals[3] = {0, 0, 0};
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	init_axis(&f->x, x_max);
+	init_axis(&f->y, y_max);
+
+	if (!spec)
+		return 0;
+
+	// "deadband[:hysteresis[:levels]]"
+	for (i = 0; i < 3; i++) {
+		vals[i] = strtoul(spec, &end, 0);
+		if (end == spec)
+			goto invalid;
+		if (!*end)
+			break;
+		if (*end != ':' || i == 2)
+			goto invalid;
+		spec = end + 1;
+	}
+
+	f->deadband = vals[0];
+	f->hysteresis = vals[1];
+	f->levels = vals[2];
+
+	if (f->deadband >= x_max / 2 || f->deadband >= y_max / 2 || f->hysteresis >= x_max || f->hysteresis >= y_max ||
+		f->levels == 1 || f->levels > FILTER_MAX_LEVELS) {
+		fprintf(stderr, "Joystick filter out of range (axis max %d/%d, at most %d levels)\n", x_max, y_max,
+			FILTER_MAX_LEVELS);
+		return -EINVAL;
+	}
+
+	f->enabled = true;
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid joystick filter, expected deadband[:hysteresis[:levels]]\n");
+	return -EINVAL;
+}
+
+bool filter_apply(filter_t *f, nun_stat_t *stat)
+{
+	unsigned long absorbed;
+
+	if (!f->enabled)
+		return true;
+
+	// a resync replaces the state of the receiver, i.e. its values are not compared against the old ones
+	if (stat->keyframe) {
+		f->x.last_in = f->x.last_out = JOY_NO_CHANGE;
+		f->y.last_in = f->y.last_out = JOY_NO_CHANGE;
+	}
+
+	absorbed = f->absorbed_hyst + f->absorbed_quant;
+	stat->joy_x = filter_axis(f, &f->x, stat->joy_x);
+	stat->joy_y = filter_axis(f, &f->y, stat->joy_y);
+	metrics_count(METRICS_FILTERED, f->absorbed_hyst + f->absorbed_quant - absorbed);
+
+	// e.g. a group with jitter of one axis only, the update layer would suppress it anyway
+	if (stat->joy_x == JOY_NO_CHANGE && stat->joy_y == JOY_NO_CHANGE &&
+		stat->but_c == BUT_KEEP && stat->but_z == BUT_KEEP) {
+		f->dropped++;
+		return false;
+	}
+
+	return true;
+}
+
+void filter_print_stats(filter_t *flt, FILE *f)
+{
+	if (!flt->enabled)
+		return;
+
+	fprintf(f, "Filter: deadband %u hysteresis %u levels %u: %lu axis values, %lu centered, "
+		"%lu absorbed (%lu hysteresis, %lu quantization), %lu groups dropped\n",
+		flt->deadband, flt->hysteresis, flt->levels, flt->values, flt->centered,
+		flt->absorbed_hyst + flt->absorbed_quant, flt->absorbed_hyst, flt->absorbed_quant, flt->dropped);
+}
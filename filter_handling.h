@@ -0,0 +1,78 @@
+#ifndef _filter_handling
+#define _filter_handling
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "event_sender.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define FILTER_MAX_LEVELS 1024
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+typedef struct
+{
+	int max; // axis range is 0..max (see input_dev_t)
+	int center;
+	int last_in; // last value that passed deadband and hysteresis, JOY_NO_CHANGE if none
+	int last_out; // last value handed on (quantized), JOY_NO_CHANGE if none
+} filter_axis_t;
+
+/**
+ * Joystick filter of one device, applied to every complete event group before it is encoded.
+ * Per axis: values within 'deadband' of the center snap to the center, changes of at most 'hysteresis'
+ * against the last accepted value are absorbed (the analog jitter) and the result is quantized to 'levels'
+ * levels of the axis range (0: off). Absorbed values become JOY_NO_CHANGE, buttons are never touched.
+ */
+typedef struct
+{
+	bool enabled;
+	unsigned deadband;
+	unsigned hysteresis;
+	unsigned levels;
+	filter_axis_t x;
+	filter_axis_t y;
+
+	// statistics
+	unsigned long values; // axis values seen
+	unsigned long centered; // snapped to the center by the deadband
+	unsigned long absorbed_hyst; // absorbed by the hysteresis
+	unsigned long absorbed_quant; // same value as the previous one after quantization
+	unsigned long dropped; // groups without any value left
+} filter_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Initialize the filter of a device with the given axis maxima from a spec "deadband[:hysteresis[:levels]]"
+ * (deadband and hysteresis in axis units). Without a spec (NULL) every group passes unchanged.
+ *
+ * return: 0 on success, <0 on error (invalid spec)
+ */
+int init_filter(filter_t *, const char *, int, int);
+
+/**
+ * Filter the axis values of a complete event group in place
+ *
+ * return: true if the group still carries a value, false if it can be dropped
+ */
+bool filter_apply(filter_t *, nun_stat_t *);
+
+/**
+ * Print how many axis values were centered and absorbed and how many groups were dropped
+ *
+ * return: void
+ */
+void filter_print_stats(filter_t *, FILE *);
+
+
+#endif /* _filter_handling */
@@ -0,0 +1,436 @@
+#define _GNU_SOURCE /* versionsort */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* free */
+#include <dirent.h> /* scandir */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* read, write, close */
+#include <string.h> /* strerror, strcmp */
+#include <errno.h> /* err codes */
+#include <time.h> /* CLOCK_MONOTONIC */
+#include <sys/ioctl.h> /* ioctl */
+
+#include "input_handling.h"
+#include "stats_handling.h"
+#include "metrics_handling.h"
+#include "rt_handling.h"
+
+/**
+ * Compiler from buildroot toolchain automatically searches in the target's sysroot for headers and libs.
+ * (include/lib path is 'buildroot/output/host/arm-buildroot-linux-uclibcgnueabihf/sysroot/usr/{include/lib}')
+ */
+#include <libevdev-1.0/libevdev/libevdev.h>
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define PRINT_EV 0
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+
+/* scandir() filter for the evdev character devices */
+static int is_event_node(const struct dirent *entry)
+{
+	return !strncmp(entry->d_name, "event", 5);
+}
+
+/**
+ * Hand the complete group to the user and start a new one
+ *
+ * return: 0 on success, <0 on error of the handler
+ */
+static int complete_group(input_dev_t *dev)
+{
+	int rc;
+
+	dev->groups++;
+	metrics_count(METRICS_GROUPS, 1);
+	if (dev->group_ns)
+		metrics_time(METRICS_GROUP, metrics_now() - dev->group_ns);
+
+	rc = dev->group_cb(&dev->nun_status, dev->cb_ctx);
+
+	// the next group starts after the handler, it may have encoded and sent this one
+	if (dev->group_ns)
+		dev->group_ns = metrics_now();
+
+	// init status struct with neutral values
+	dev->nun_status = (nun_stat_t)NUN_STAT_NEUTRAL;
+
+	// Event group separation
+	if (PRINT_EV) printf("--------------- EVENT ---------------\n");
+
+	return rc;
+}
+
+/**
+ * The kernel dropped events (SYN_DROPPED), so the assembled group and all queued events are stale.
+ * libevdev is forced to resync: it drains the kernel buffer and queries the device state via ioctls.
+ * The resulting state is dispatched as one keyframe group that carries absolute values for every button and axis,
+ * i.e. it is sent right away and replaces the state of the receivers.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int resync(input_dev_t *dev)
+{
+	int rc;
+	struct input_event ev;
+	uint64_t t0 = stats_now_us();
+
+	// counted, the real-time mode does not print on the hot path
+	if (!rt_quiet())
+		fprintf(stderr, "Dropped an event, resync required!\n");
+	dev->resyncs++;
+	metrics_count(METRICS_SYNC_DROPS, 1);
+
+	rc = libevdev_next_event(dev->evdev, LIBEVDEV_READ_FLAG_FORCE_SYNC, &ev);
+	if (rc != LIBEVDEV_READ_STATUS_SYNC) {
+		fprintf(stderr, "Failed to force resync (%s)\n", strerror(-rc));
+		return rc < 0 ? rc : -EIO;
+	}
+
+	// drain the sync events, afterwards libevdev's internal state matches the device
+	do {
+		rc = libevdev_next_event(dev->evdev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+	} while (rc == LIBEVDEV_READ_STATUS_SYNC);
+
+	// a status >= 0 (an event instead of the end of the sync) is an error as well
+	if (rc != -EAGAIN) {
+		fprintf(stderr, "Failed to resync (%s)\n", rc < 0 ? strerror(-rc) : "unexpected event");
+		return rc < 0 ? rc : -EIO;
+	}
+
+	dev->nun_status.but_c = libevdev_get_event_value(dev->evdev, EV_KEY, BTN_C);
+	dev->nun_status.but_z = libevdev_get_event_value(dev->evdev, EV_KEY, BTN_Z);
+	dev->nun_status.joy_x = libevdev_get_event_value(dev->evdev, EV_ABS, ABS_X);
+	dev->nun_status.joy_y = libevdev_get_event_value(dev->evdev, EV_ABS, ABS_Y);
+	dev->nun_status.event_ts = stats_now_us();
+	dev->nun_status.keyframe = true;
+	rc = complete_group(dev);
+
+	hist_add(&dev->resync_us, stats_now_us() - t0);
+
+	return rc;
+}
+
+/**
+ * Walk a batch of raw input_events and update the group status
+ *
+ * return: 0 on success, <0 on error
+ */
+static int process_events(input_dev_t *dev, struct input_event *evs, unsigned cnt)
+{
+	int rc;
+	unsigned i;
+
+	for (i = 0; i < cnt; i++) {
+		struct input_event *ev = &evs[i];
+
+		if (PRINT_EV) printf("Event: %s %s %d\n",
+			libevdev_event_type_get_name(ev->type),
+			libevdev_event_code_get_name(ev->type, ev->code),
+			ev->value);
+
+		// update nun_status
+		if (ev->type == EV_KEY) {
+			/**
+			 * Event to nun_stat mapping:
+			 * 0 <-> BUT_UP
+			 * 1 <-> BUT_DOWN
+			 * no event <-> BUT_KEEP
+			 */
+			switch (ev->code) {
+				case BTN_C:
+					dev->nun_status.but_c = ev->value;
+					break;
+				case BTN_Z:
+					dev->nun_status.but_z = ev->value;
+					break;
+				default:
+					metrics_count(METRICS_UNEXPECTED, 1);
+					if (!rt_quiet())
+						fprintf(stderr, "Unexpected event code! (%d)\n", ev->code);
+					break;
+			}
+		} else if (ev->type == EV_ABS) {
+			switch (ev->code) {
+				case ABS_X:
+					dev->nun_status.joy_x = ev->value;
+					break;
+				case ABS_Y:
+					dev->nun_status.joy_y = ev->value;
+					break;
+				default:
+					metrics_count(METRICS_UNEXPECTED, 1);
+					if (!rt_quiet())
+						fprintf(stderr, "Unexpected event code! (%d)\n", ev->code);
+					break;
+			}
+		} else if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+			// indicates that input_sync() was called in the kernel, i.e. event group is complete
+			dev->nun_status.event_ts = (uint64_t)ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+			rc = complete_group(dev);
+			if (rc)
+				return rc;
+		} else if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+			// the remainder of the batch is outdated as well
+			return resync(dev);
+		} else {
+			metrics_count(METRICS_UNEXPECTED, 1);
+			if (!rt_quiet())
+				fprintf(stderr, "Unexpected event type! (%d)\n", ev->type);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Account, record and process a batch fetched by one read, 'group_ns' is the time the read returned
+ * (0 if the batch is not sampled)
+ *
+ * return: 0 on success, <0 on error
+ */
+static int handle_batch(input_dev_t *dev, struct input_event *evs, ssize_t len, uint64_t group_ns)
+{
+	if (len == 0 || len % sizeof(evs[0])) {
+		fprintf(stderr, "Short read from input device (%zd)\n", len);
+		return -EIO;
+	}
+
+	dev->reads++;
+	dev->events += len / sizeof(evs[0]);
+	metrics_count(METRICS_EVENTS, len / sizeof(evs[0]));
+
+	// the decode of the first group of the batch starts right after the read
+	dev->group_ns = group_ns;
+
+	// the batch is recorded as is, timestamps included
+	if (dev->record_fd >= 0 && write(dev->record_fd, evs, len) != len) {
+		fprintf(stderr, "Failed to record input events (%s), recording stopped\n", strerror(errno));
+		dev->record_fd = -1;
+	}
+
+	return process_events(dev, evs, len / sizeof(evs[0]));
+}
+
+/**
+ * Write the fuzz of an axis to the kernel. EVIOCSABS replaces the whole absinfo, i.e. the current one of the
+ * kernel is written back with only the fuzz changed (libevdev's copy has a stale value, events bypass it).
+ *
+ * return: 0 on success, <0 on error
+ */
+static int write_fuzz(input_dev_t *dev, unsigned code, int fuzz)
+{
+	struct input_absinfo abs;
+
+	if (ioctl(dev->fd, EVIOCGABS(code), &abs) < 0)
+		return -errno;
+	abs.fuzz = fuzz;
+
+	return libevdev_kernel_set_abs_info(dev->evdev, code, &abs);
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int open_input_dev(input_dev_t *dev, const char *path, const char *name, input_group_cb_t cb, void *ctx)
+{
+	int rc;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->nun_status = (nun_stat_t)NUN_STAT_NEUTRAL;
+	dev->group_cb = cb;
+	dev->cb_ctx = ctx;
+	dev->record_fd = -1;
+	init_hist(&dev->resync_us);
+
+	/**
+	 * INFO:
+	 * - fopen returns a C standard FILE* which enables buffered IO, using fscanf etc
+	 * - open (syscall) returns an OS dependent fd, that enables non blocking IO using lseek/read/write etc syscalls
+	 */
+	dev->fd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if (dev->fd < 0) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -errno;
+	}
+
+	// init libevdev
+	rc = libevdev_new_from_fd(dev->fd, &dev->evdev);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
+		goto fail;
+	}
+
+	// check the input device, the caller reports a mismatch
+	if (strcmp(libevdev_get_name(dev->evdev), name)) {
+		rc = -ENODEV;
+		goto fail;
+	}
+
+	// display the input device
+	printf("Input device %s name: \"%s\"\n", path, libevdev_get_name(dev->evdev));
+	printf("Input device ID: bus %#x vendor %#x product %#x\n",
+		libevdev_get_id_bustype(dev->evdev),
+		libevdev_get_id_vendor(dev->evdev),
+		libevdev_get_id_product(dev->evdev));
+
+	// event timestamps in CLOCK_MONOTONIC (EVIOCSCLOCKID) instead of wall clock, comparable to the send time
+	rc = libevdev_set_clock_id(dev->evdev, CLOCK_MONOTONIC);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to set the event clock (%s)\n", strerror(-rc));
+		goto fail;
+	}
+
+	// get parameters
+	dev->x_max = libevdev_get_abs_maximum(dev->evdev, ABS_X);
+	dev->y_max = libevdev_get_abs_maximum(dev->evdev, ABS_Y);
+	if (!dev->x_max || !dev->y_max) {
+		fprintf(stderr, "Error getting abs max values\n");
+		rc = -EINVAL;
+		goto fail;
+	}
+	dev->abs_x = *libevdev_get_abs_info(dev->evdev, ABS_X);
+	dev->abs_y = *libevdev_get_abs_info(dev->evdev, ABS_Y);
+
+	return 0;
+
+fail:
+	close_input_dev(dev);
+	return rc;
+}
+
+int open_input_devs(input_dev_t *devs, void **ctxs, unsigned max, const char *name, input_group_cb_t cb)
+{
+	int i, n, cnt = 0;
+	char path[INPUT_PATH_LEN];
+	struct dirent **entries;
+
+	n = scandir(INPUT_DEV_DIR, &entries, is_event_node, versionsort);
+	if (n < 0) {
+		fprintf(stderr, "Failed to scan %s (%s)\n", INPUT_DEV_DIR, strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", INPUT_DEV_DIR, entries[i]->d_name);
+		if (cnt < max && !open_input_dev(&devs[cnt], path, name, cb, ctxs[cnt]))
+			cnt++;
+		free(entries[i]);
+	}
+	free(entries);
+
+	return cnt;
+}
+
+void close_input_dev(input_dev_t *dev)
+{
+	int rc;
+	unsigned code;
+
+	// the kernel keeps the fuzz until the device is re-plugged, other readers get the original one back
+	for (code = ABS_X; dev->evdev && code <= ABS_Y; code++) {
+		if (!(dev->fuzz_changed & (1u << code)))
+			continue;
+		rc = write_fuzz(dev, code, code == ABS_X ? dev->abs_x.fuzz : dev->abs_y.fuzz);
+		if (rc && rc != -ENODEV) // a vanished device took its fuzz along
+			fprintf(stderr, "Failed to restore the fuzz of axis %u (%s)\n", code, strerror(-rc));
+	}
+	dev->fuzz_changed = 0;
+
+	if (dev->evdev)
+		libevdev_free(dev->evdev);
+	if (dev->fd >= 0)
+		close(dev->fd);
+
+	dev->evdev = NULL;
+	dev->fd = -1;
+}
+
+int input_read(input_dev_t *dev)
+{
+	int rc;
+	ssize_t len;
+	bool sampled;
+	uint64_t t0, t1;
+	struct input_event evs[INPUT_BATCH_SIZE];
+
+	while (1) {
+		sampled = METRICS_SAMPLED(dev->reads);
+		t0 = sampled ? metrics_now() : 0;
+
+		// one syscall fetches all pending events (up to the batch size)
+		len = read(dev->fd, evs, sizeof(evs));
+		if (len < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read input events (%s)\n", strerror(errno));
+			return -errno;
+		}
+
+		t1 = sampled ? metrics_now() : 0;
+		if (sampled)
+			metrics_time(METRICS_READ, t1 - t0);
+
+		rc = handle_batch(dev, evs, len, t1);
+		if (rc)
+			return rc;
+
+		// a partially filled batch means the kernel buffer is drained, saves the final -EAGAIN read
+		if (len < sizeof(evs))
+			return 0;
+	}
+}
+
+int input_read_done(input_dev_t *dev, int res)
+{
+	// the read was issued by the ring, i.e. there is no read latency, the group latency starts at its completion
+	uint64_t t = METRICS_SAMPLED(dev->reads) ? metrics_now() : 0;
+
+	if (res < 0) {
+		fprintf(stderr, "Failed to read input events (%s)\n", strerror(-res));
+		return res;
+	}
+
+	return handle_batch(dev, dev->batch, res, t);
+}
+
+void input_record(input_dev_t *dev, int fd)
+{
+	dev->record_fd = fd;
+}
+
+int input_set_fuzz(input_dev_t *dev, unsigned code, int fuzz)
+{
+	int rc;
+
+	if (code != ABS_X && code != ABS_Y)
+		return -EINVAL;
+
+	rc = write_fuzz(dev, code, fuzz);
+	if (rc) {
+		fprintf(stderr, "Failed to set the fuzz of axis %u (%s)\n", code, strerror(-rc));
+		return rc;
+	}
+
+	// set back to the one of the device (abs_x/abs_y) by close_input_dev()
+	dev->fuzz_changed |= 1u << code;
+
+	return 0;
+}
+
+void input_print_stats(input_dev_t *dev, FILE *f)
+{
+	fprintf(f, "Input: %lu events in %lu reads (%.1f events/read), %lu groups, %lu resyncs\n",
+		dev->events, dev->reads, dev->reads ? (double)dev->events / dev->reads : 0.0,
+		dev->groups, dev->resyncs);
+	if (dev->resyncs)
+		hist_print(&dev->resync_us, "Input: resync time", "us", f);
+}
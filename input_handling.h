@@ -0,0 +1,126 @@
+#ifndef _input_handling
+#define _input_handling
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <linux/input.h> /* struct input_event */
+
+#include "event_sender.h"
+#include "stats_handling.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define INPUT_BATCH_SIZE 64 // max number of input_events fetched by one read()
+#define INPUT_DEV_DIR "/dev/input"
+#define INPUT_PATH_LEN 64
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Handler that is called for every complete event group (SYN_REPORT) of a device.
+ * Arguments are the assembled nunchuk status and the registered context. An error (<0) stops the processing
+ * of the batch and is returned by the read functions.
+ */
+typedef int (*input_group_cb_t)(nun_stat_t *, void *);
+
+typedef struct
+{
+	int fd;
+	struct libevdev *evdev; // only used for probing and resync
+	int x_max;
+	int y_max;
+	struct input_absinfo abs_x; // range, flat and fuzz of the axes as reported by the device
+	struct input_absinfo abs_y;
+	unsigned fuzz_changed; // bit per axis (1 << ABS_X/ABS_Y) whose fuzz was changed in the kernel
+
+	nun_stat_t nun_status; // event group that is currently assembled
+	input_group_cb_t group_cb;
+	void *cb_ctx;
+	int record_fd; // raw events are appended to it if >= 0, see input_record()
+	uint64_t group_ns; // decode start of the current group (see METRICS_GROUP), 0 if the batch is not sampled
+	struct input_event batch[INPUT_BATCH_SIZE]; // target of the reads of the io_uring backend, see input_read_done()
+
+	// statistics
+	unsigned long reads;
+	unsigned long events;
+	unsigned long groups;
+	unsigned long resyncs;
+	hist_t resync_us; // SYN_DROPPED until the rebuilt state was handed to the group handler
+} input_dev_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Open the input device at the given path (non-blocking) and verify its name.
+ * The given handler is called for every complete event group read from the device.
+ *
+ * return: 0 on success, -ENODEV if the name does not match, <0 on other errors
+ */
+int open_input_dev(input_dev_t *, const char *, const char *, input_group_cb_t, void *);
+
+/**
+ * Open every event device in INPUT_DEV_DIR with the given name, at most 'max' devices.
+ * The handler of the i-th opened device is called with the i-th context of the given array.
+ *
+ * return: number of opened devices, <0 on error
+ */
+int open_input_devs(input_dev_t *, void **, unsigned, const char *, input_group_cb_t);
+
+/**
+ * Close an input device opened by open_input_dev()
+ *
+ * return: void
+ */
+void close_input_dev(input_dev_t *);
+
+/**
+ * Read all pending events of the device in batches and dispatch complete event groups.
+ * Returns once the kernel buffer of the device is drained.
+ *
+ * return: 0 on success, <0 on error
+ */
+int input_read(input_dev_t *);
+
+/**
+ * Dispatch the events of a read into the batch buffer of the device that was issued by the io_uring backend
+ * of the main loop (see loop_add_read()), given is the result of the read
+ *
+ * return: 0 on success, <0 on error
+ */
+int input_read_done(input_dev_t *, int);
+
+/**
+ * Record every event read from the device into the given fd (-1 stops recording). The raw struct input_event
+ * records (native layout, like 'cat /dev/input/eventX') are the trace format of the replay source.
+ * Several devices may share one fd opened with O_APPEND.
+ *
+ * return: void
+ */
+void input_record(input_dev_t *, int);
+
+/**
+ * Set the fuzz of an axis (ABS_X or ABS_Y) in the kernel, i.e. evdev drops changes within it before they are
+ * queued. The rest of the absinfo is left as it is, other readers see the fuzz as well until close_input_dev()
+ * restores the one of the device.
+ *
+ * return: 0 on success, <0 on error
+ */
+int input_set_fuzz(input_dev_t *, unsigned, int);
+
+/**
+ * Print read/event/group statistics of the device
+ *
+ * return: void
+ */
+void input_print_stats(input_dev_t *, FILE *);
+
+
+#endif /* _input_handling */
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE /* RUSAGE_THREAD */
+#include <stdio.h> /* fprintf */
+#include <stdbool.h>
+#include <string.h> /* strerror */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* close */
+#include <time.h> /* clock_gettime */
+#include <poll.h> /* POLLIN */
+#include <sys/resource.h> /* getrusage */
+
+#include "loop_handling.h"
+
+#if CFG_USE_IO_URING
+#include <liburing.h>
+#endif
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define MAX_LOOP_FDS 32
+#define MAX_LOOP_EVENTS 16
+#define LOOP_URING_ENTRIES 256 // submission queue, the completion queue is twice as large
+#define MAX_LOOP_OPS 128 // registered reads and sends in flight
+
+
+/***********************************************************************************************************************
+* DATA STRUCTURES
+***********************************************************************************************************************/
+typedef struct
+{
+	int fd;
+	loop_cb_t cb;
+	void *ctx;
+} loop_handler_t;
+
+typedef enum _loop_op_type_t{
+	LOOP_OP_FREE = 0,
+	LOOP_OP_EPOLL,	// poll of the epoll instance, i.e. one of the fds of loop_add_fd() is ready
+	LOOP_OP_READ,	// linked poll and read, re-armed after every completion
+	LOOP_OP_SEND	// one shot sendmsg()
+} loop_op_type_t;
+
+/* an operation on the ring, its address is the user data of the submission */
+typedef struct
+{
+	loop_op_type_t type;
+	int fd;
+	void *buf;
+	unsigned len;
+	loop_io_cb_t cb;
+	void *ctx;
+} loop_op_t;
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+// every thread runs its own loop, i.e. the loop state is thread local
+static __thread int g_epfd = -1;
+static __thread volatile bool g_loop_running = false;
+static __thread loop_handler_t g_handlers[MAX_LOOP_FDS];
+
+#if CFG_USE_IO_URING
+static __thread bool g_use_uring = false;
+static __thread struct io_uring g_uring;
+static __thread loop_op_t g_ops[MAX_LOOP_OPS];
+static __thread loop_op_t g_epoll_op;
+#endif
+
+// statistics
+static __thread unsigned long g_wakeups = 0;
+static __thread unsigned long g_dispatched = 0;
+static __thread unsigned long g_syscalls = 0;
+static __thread unsigned long g_completions = 0;
+static __thread struct timespec g_start_ts;
+static __thread double g_start_cpu;
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static double ts_to_sec(struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double tv_to_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double cpu_time_sec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+
+	return tv_to_sec(&ru.ru_utime) + tv_to_sec(&ru.ru_stime);
+}
+
+static loop_handler_t *find_handler(int fd)
+{
+	int i;
+
+	for (i = 0; i < MAX_LOOP_FDS; i++)
+		if (g_handlers[i].cb && g_handlers[i].fd == fd)
+			return &g_handlers[i];
+
+	return NULL;
+}
+
+/**
+ * Wait up to 'timeout' ms for ready fds and call their handlers
+ *
+ * return: number of ready fds, <0 on error
+ */
+static int dispatch_fds(int timeout)
+{
+	int i, n, rc;
+	struct epoll_event events[MAX_LOOP_EVENTS];
+
+	n = epoll_wait(g_epfd, events, MAX_LOOP_EVENTS, timeout);
+	g_syscalls++;
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "epoll_wait failed (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < n; i++) {
+		loop_handler_t *h = events[i].data.ptr;
+
+		// handler may have been removed by a previous handler of this iteration
+		if (!h->cb)
+			continue;
+
+		g_dispatched++;
+		rc = h->cb(h->fd, events[i].events, h->ctx);
+		if (rc < 0)
+			return rc;
+	}
+
+	return n;
+}
+
+#if CFG_USE_IO_URING
+static loop_op_t *alloc_op(loop_op_type_t type, int fd, loop_io_cb_t cb, void *ctx)
+{
+	loop_op_t *op;
+
+	for (op = g_ops; op < g_ops + MAX_LOOP_OPS && op->type != LOOP_OP_FREE; op++);
+	if (op == g_ops + MAX_LOOP_OPS)
+		return NULL;
+
+	op->type = type;
+	op->fd = fd;
+	op->cb = cb;
+	op->ctx = ctx;
+
+	return op;
+}
+
+/* get 'n' consecutive submission entries, a full queue is submitted first (a link must not be split) */
+static struct io_uring_sqe *get_sqes(unsigned n)
+{
+	if (io_uring_sq_space_left(&g_uring) < n) {
+		io_uring_submit(&g_uring);
+		g_syscalls++;
+	}
+
+	return io_uring_get_sqe(&g_uring);
+}
+
+/* single shot, a new poll reports a still non-empty ready list right away (level triggered) */
+static int arm_epoll(void)
+{
+	struct io_uring_sqe *sqe = get_sqes(1);
+
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_poll_add(sqe, g_epfd, POLLIN);
+	io_uring_sqe_set_data(sqe, &g_epoll_op);
+
+	return 0;
+}
+
+static int arm_read(loop_op_t *op)
+{
+	struct io_uring_sqe *sqe = get_sqes(2);
+
+	if (!sqe)
+		return -EBUSY;
+
+	// the poll only posts a completion on error (without an op), the read is cancelled then and reports it
+	io_uring_prep_poll_add(sqe, op->fd, POLLIN);
+	io_uring_sqe_set_data(sqe, NULL);
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+
+	// -1: current file position, the event devices are streams
+	sqe = io_uring_get_sqe(&g_uring);
+	io_uring_prep_read(sqe, op->fd, op->buf, op->len, -1);
+	io_uring_sqe_set_data(sqe, op);
+
+	return 0;
+}
+
+static int dispatch_op(loop_op_t *op, int res)
+{
+	int rc;
+
+	g_dispatched++;
+
+	switch (op->type) {
+		case LOOP_OP_EPOLL:
+			rc = dispatch_fds(0);
+			if (rc < 0)
+				return rc;
+			return arm_epoll();
+		case LOOP_OP_READ:
+			// the events were consumed meanwhile (e.g. by a resync)
+			if (res == -EAGAIN)
+				return arm_read(op);
+
+			rc = op->cb(res, op->ctx);
+			if (!rc)
+				return arm_read(op);
+			op->type = LOOP_OP_FREE;
+			return rc < 0 ? rc : 0;
+		case LOOP_OP_SEND:
+			op->type = LOOP_OP_FREE;
+			return op->cb(res, op->ctx);
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Call the handlers of all available completions, every entry is consumed before its handler runs,
+ * i.e. a handler may queue new operations
+ *
+ * return: 0 on success, <0 on handler error
+ */
+static int reap_completions(void)
+{
+	int rc, res;
+	loop_op_t *op;
+	struct io_uring_cqe *cqe;
+
+	while (!io_uring_peek_cqe(&g_uring, &cqe)) {
+		op = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&g_uring, cqe);
+
+		if (!op)
+			continue;
+
+		g_completions++;
+		rc = dispatch_op(op, res);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+#endif /* CFG_USE_IO_URING */
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_loop(void)
+{
+	// sanity check
+	if (g_epfd >= 0) {
+		fprintf(stderr, "Error, loop already initialized\n");
+		return -1;
+	}
+
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epfd < 0) {
+		fprintf(stderr, "Could not create epoll instance (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	memset(g_handlers, 0, sizeof(g_handlers));
+	g_wakeups = 0;
+	g_dispatched = 0;
+	g_syscalls = 0;
+	g_completions = 0;
+	clock_gettime(CLOCK_MONOTONIC, &g_start_ts);
+	g_start_cpu = cpu_time_sec();
+
+	return 0;
+}
+
+int init_loop_uring(void)
+{
+#if CFG_USE_IO_URING
+	int rc;
+
+	rc = init_loop();
+	if (rc)
+		return rc;
+
+	// only this thread submits, the kernel skips the synchronization of the submission queue
+	rc = io_uring_queue_init(LOOP_URING_ENTRIES, &g_uring, IORING_SETUP_SINGLE_ISSUER);
+	if (rc == -EINVAL)
+		rc = io_uring_queue_init(LOOP_URING_ENTRIES, &g_uring, 0);
+	if (rc) {
+		fprintf(stderr, "Could not create io_uring (%s)\n", strerror(-rc));
+		teardown_loop();
+		return rc;
+	}
+
+	memset(g_ops, 0, sizeof(g_ops));
+	g_epoll_op.type = LOOP_OP_EPOLL;
+	g_use_uring = true;
+
+	return arm_epoll();
+#else
+	fprintf(stderr, "Built without io_uring support (CFG_USE_IO_URING=0)\n");
+	return -ENOTSUP;
+#endif
+}
+
+bool loop_uring(void)
+{
+#if CFG_USE_IO_URING
+	return g_use_uring;
+#else
+	return false;
+#endif
+}
+
+void teardown_loop(void)
+{
+#if CFG_USE_IO_URING
+	// operations still in flight are cancelled
+	if (g_use_uring)
+		io_uring_queue_exit(&g_uring);
+	g_use_uring = false;
+#endif
+
+	if (g_epfd >= 0)
+		close(g_epfd);
+
+	g_epfd = -1;
+}
+
+int loop_add_fd(int fd, uint32_t events, loop_cb_t cb, void *ctx)
+{
+	struct epoll_event ev = {0};
+	loop_handler_t *h;
+
+	// find a free handler slot
+	for (h = g_handlers; h < g_handlers + MAX_LOOP_FDS && h->cb; h++);
+	if (h == g_handlers + MAX_LOOP_FDS) {
+		fprintf(stderr, "Too many fds registered with the main loop\n");
+		return -ENOSPC;
+	}
+
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		fprintf(stderr, "Could not register fd %d (%s)\n", fd, strerror(errno));
+		return -errno;
+	}
+
+	h->fd = fd;
+	h->ctx = ctx;
+	h->cb = cb;
+
+	return 0;
+}
+
+int loop_del_fd(int fd)
+{
+	loop_handler_t *h = find_handler(fd);
+
+	if (!h)
+		return -ENOENT;
+
+	if (epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, NULL))
+		fprintf(stderr, "Could not unregister fd %d (%s)\n", fd, strerror(errno));
+
+	h->cb = NULL;
+
+	return 0;
+}
+
+int loop_add_read(int fd, void *buf, unsigned len, loop_io_cb_t cb, void *ctx)
+{
+#if CFG_USE_IO_URING
+	loop_op_t *op;
+
+	if (!g_use_uring)
+		return -ENOTSUP;
+
+	op = alloc_op(LOOP_OP_READ, fd, cb, ctx);
+	if (!op) {
+		fprintf(stderr, "Too many operations registered with the main loop\n");
+		return -ENOSPC;
+	}
+	op->buf = buf;
+	op->len = len;
+
+	return arm_read(op);
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int loop_queue_sendmsg(int fd, struct msghdr *msg, int flags, loop_io_cb_t cb, void *ctx)
+{
+#if CFG_USE_IO_URING
+	loop_op_t *op;
+	struct io_uring_sqe *sqe;
+
+	if (!g_use_uring)
+		return -ENOTSUP;
+
+	op = alloc_op(LOOP_OP_SEND, fd, cb, ctx);
+	if (!op)
+		return -ENOBUFS;
+
+	sqe = get_sqes(1);
+	if (!sqe) {
+		op->type = LOOP_OP_FREE;
+		return -EBUSY;
+	}
+	io_uring_prep_sendmsg(sqe, fd, msg, flags);
+	io_uring_sqe_set_data(sqe, op);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int loop_submit(void)
+{
+#if CFG_USE_IO_URING
+	int rc;
+
+	if (!g_use_uring)
+		return -ENOTSUP;
+
+	rc = io_uring_submit(&g_uring);
+	g_syscalls++;
+	if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+		fprintf(stderr, "io_uring_submit failed (%s)\n", strerror(-rc));
+		return rc;
+	}
+
+	return reap_completions();
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int loop_run(void)
+{
+	int rc;
+
+	g_loop_running = true;
+	while (g_loop_running) {
+#if CFG_USE_IO_URING
+		if (g_use_uring) {
+			/**
+			 * One syscall submits everything the handlers queued (sends, re-armed reads) and sleeps until
+			 * the next completion.
+			 */
+			rc = io_uring_submit_and_wait(&g_uring, 1);
+			g_syscalls++;
+			if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+				fprintf(stderr, "io_uring_submit_and_wait failed (%s)\n", strerror(-rc));
+				return rc;
+			}
+
+			g_wakeups++;
+
+			rc = reap_completions();
+			if (rc < 0) {
+				g_loop_running = false;
+				return rc;
+			}
+			continue;
+		}
+#endif
+		/**
+		 * Sleep until at least one fd is ready, i.e. the process does not consume
+		 * any cpu time while the input device is idle.
+		 */
+		rc = dispatch_fds(-1);
+		if (rc < 0) {
+			g_loop_running = false;
+			return rc;
+		}
+
+		g_wakeups++;
+	}
+
+#if CFG_USE_IO_URING
+	// the handlers of the last iteration may have queued sends
+	if (g_use_uring) {
+		io_uring_submit(&g_uring);
+		g_syscalls++;
+	}
+#endif
+
+	return 0;
+}
+
+void loop_stop(void)
+{
+	g_loop_running = false;
+}
+
+unsigned long loop_get_syscalls(void)
+{
+	return g_syscalls;
+}
+
+void loop_print_stats(FILE *f)
+{
+	double wall, cpu;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// cpu time consumed by the calling thread since init_loop()
+	wall = ts_to_sec(&now) - ts_to_sec(&g_start_ts);
+	cpu = cpu_time_sec() - g_start_cpu;
+	if (wall <= 0)
+		return;
+
+	fprintf(f, "Loop: %lu wakeups, %lu dispatches in %.1fs (%.1f wakeups/s)\n",
+		g_wakeups, g_dispatched, wall, g_wakeups / wall);
+	if (loop_uring())
+		fprintf(f, "Loop: io_uring, %lu completions in %lu syscalls (%.1f completions/syscall)\n",
+			g_completions, g_syscalls, g_syscalls ? (double)g_completions / g_syscalls : 0.0);
+	fprintf(f, "Loop: cpu time %.3fs (%.2f%% busy, %.2f%% idle)\n",
+		cpu, 100.0 * cpu / wall, 100.0 - 100.0 * cpu / wall);
+}
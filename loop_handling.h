@@ -0,0 +1,148 @@
+#ifndef _loop_handling
+#define _loop_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/socket.h> /* struct msghdr */
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#ifndef CFG_USE_IO_URING
+#define CFG_USE_IO_URING 0 // 1: io_uring backend (liburing, kernel >= 5.17), selected at runtime by init_loop_uring()
+#endif
+
+#define LOOP_IO_DONE 1 // returned by a loop_io_cb_t, the read is not re-armed
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Handler that is called by the main loop whenever a registered fd is ready.
+ * Arguments are the ready fd, the epoll event mask and the registered context.
+ *
+ * return: 0 on success, <0 on error (terminates the main loop)
+ */
+typedef int (*loop_cb_t)(int, uint32_t, void *);
+
+/**
+ * Handler that is called by the main loop whenever an operation queued on its io_uring completed.
+ * Arguments are the result of the operation (like the return value of the syscall, but -errno on error)
+ * and the registered context.
+ *
+ * return: 0 on success (a read is re-armed), LOOP_IO_DONE to stop a read, <0 on error (terminates the main loop)
+ */
+typedef int (*loop_io_cb_t)(int, void *);
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Initialize the main loop (epoll instance and statistics)
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_loop(void);
+
+/**
+ * Initialize the main loop with the io_uring backend: reads registered with loop_add_read() and sends queued
+ * with loop_queue_sendmsg() are submitted together with the wait for the next completion, i.e. one
+ * io_uring_enter() per wakeup. The fds registered with loop_add_fd() are still served by epoll, the epoll
+ * instance itself is polled through the ring.
+ *
+ * return: 0 on success, -ENOTSUP if built without CFG_USE_IO_URING, <0 on other errors
+ */
+int init_loop_uring(void);
+
+/**
+ * Check if the main loop of the calling thread uses the io_uring backend
+ *
+ * return: true if it does
+ */
+bool loop_uring(void);
+
+/**
+ * Teardown the main loop, registered fds are not closed
+ *
+ * return: void
+ */
+void teardown_loop(void);
+
+/**
+ * Register a fd with the main loop. The handler is called with the given context
+ * whenever one of the requested epoll events (e.g. EPOLLIN) occurs.
+ *
+ * return: 0 on success, <0 on error
+ */
+int loop_add_fd(int, uint32_t, loop_cb_t, void *);
+
+/**
+ * Remove a previously registered fd from the main loop
+ *
+ * return: 0 on success, <0 on error
+ */
+int loop_del_fd(int);
+
+/**
+ * Register a read of the fd into the given buffer of given length (io_uring backend only). The read is only
+ * issued once the fd is readable (linked poll), i.e. the fd stays non-blocking. The handler is called with the
+ * result of every read, the read is re-armed until the handler returns LOOP_IO_DONE.
+ *
+ * return: 0 on success, <0 on error
+ */
+int loop_add_read(int, void *, unsigned, loop_io_cb_t, void *);
+
+/**
+ * Queue a sendmsg() with the given flags on the fd (io_uring backend only). It is submitted with the next wait
+ * of the main loop (or by loop_submit()), the message has to stay valid until the handler was called.
+ *
+ * return: 0 on success, -ENOBUFS if too many operations are in flight, <0 on other errors
+ */
+int loop_queue_sendmsg(int, struct msghdr *, int, loop_io_cb_t, void *);
+
+/**
+ * Submit the queued operations and call the handlers of the available completions without sleeping,
+ * for callers that do not run the main loop (io_uring backend only)
+ *
+ * return: 0 on success, <0 on handler error
+ */
+int loop_submit(void);
+
+/**
+ * Run the main loop. The calling thread sleeps until a registered fd is ready.
+ * Returns after loop_stop() was called or a handler returned an error.
+ *
+ * return: 0 on regular stop, <0 on handler error
+ */
+int loop_run(void);
+
+/**
+ * Request the main loop to return after the current iteration
+ *
+ * return: void
+ */
+void loop_stop(void);
+
+/**
+ * Get the number of syscalls the main loop issued since init_loop() (epoll_wait() or io_uring_enter())
+ *
+ * return: number of syscalls
+ */
+unsigned long loop_get_syscalls(void);
+
+/**
+ * Print wakeup rate and cpu utilization of the main loop since init_loop()
+ *
+ * return: void
+ */
+void loop_print_stats(FILE *);
+
+
+#endif /* _loop_handling */
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE /* accept4 */
+#include <stdio.h> /* fprintf, fdopen */
+#include <string.h> /* strerror, strncpy */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* close, unlink */
+#include <stdatomic.h>
+#include <sys/socket.h> /* socket, accept4 */
+#include <sys/un.h> /* sockaddr_un */
+
+#include "metrics_handling.h"
+#include "stats_handling.h"
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define METRICS_CACHE_LINE 64 // stages/counters of the input and the network thread do not share a line
+
+
+/***********************************************************************************************************************
+* DATA STRUCTURES
+***********************************************************************************************************************/
+typedef struct
+{
+	_Alignas(METRICS_CACHE_LINE) atomic_ulong buckets[METRICS_BUCKETS];
+	atomic_ullong sum;
+	atomic_ullong max;
+} metrics_hist_t;
+
+typedef struct
+{
+	_Alignas(METRICS_CACHE_LINE) atomic_ulong val;
+} metrics_cnt_t;
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+#if CFG_METRICS
+static metrics_hist_t g_stages[METRICS_NUM_STAGES];
+static metrics_cnt_t g_counters[METRICS_NUM_COUNTERS];
+static uint64_t g_start_ns;
+#endif
+
+static int g_metrics_sock = -1;
+static char g_sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+#if CFG_METRICS
+/* single writer, i.e. no atomic read-modify-write (a plain load/store on ARM), readers see a consistent value */
+static void add_ulong(atomic_ulong *v, unsigned long n)
+{
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void add_ullong(atomic_ullong *v, uint64_t n)
+{
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned bucket_index(uint64_t ns)
+{
+	unsigned i = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	return i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1;
+}
+
+/* upper bound of the bucket that holds the given percentile of a snapshot */
+static uint64_t bucket_percentile(unsigned long *buckets, unsigned long count, double p)
+{
+	unsigned i;
+	unsigned long seen = 0, rank = (unsigned long)(p / 100.0 * count + 0.5);
+
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return i ? (1ULL << i) - 1 : 0;
+}
+
+static void dump_stage(metrics_stage_t stage, const char *name, FILE *f)
+{
+	unsigned i;
+	unsigned long count = 0, buckets[METRICS_BUCKETS];
+	uint64_t p50, p99, max = atomic_load_explicit(&g_stages[stage].max, memory_order_relaxed);
+	uint64_t sum = atomic_load_explicit(&g_stages[stage].sum, memory_order_relaxed);
+
+	// the writer keeps going, count and percentiles are taken from the same snapshot of the buckets
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		buckets[i] = atomic_load_explicit(&g_stages[stage].buckets[i], memory_order_relaxed);
+		count += buckets[i];
+	}
+
+	if (!count) {
+		fprintf(f, "Metrics: %-5s no samples\n", name);
+		return;
+	}
+
+	p50 = bucket_percentile(buckets, count, 50);
+	p99 = bucket_percentile(buckets, count, 99);
+	fprintf(f, "Metrics: %-5s n=%lu avg %.0f p50 <%llu p99 <%llu max %llu ns\n", name, count, (double)sum / count,
+		(unsigned long long)(p50 < max ? p50 : max), (unsigned long long)(p99 < max ? p99 : max),
+		(unsigned long long)max);
+}
+#endif /* CFG_METRICS */
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_metrics(const char *path)
+{
+	int rc;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+#if CFG_METRICS
+	int i;
+
+	for (i = 0; i < METRICS_NUM_STAGES; i++) {
+		int j;
+
+		for (j = 0; j < METRICS_BUCKETS; j++)
+			atomic_init(&g_stages[i].buckets[j], 0);
+		atomic_init(&g_stages[i].sum, 0);
+		atomic_init(&g_stages[i].max, 0);
+	}
+	for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+		atomic_init(&g_counters[i].val, 0);
+	g_start_ns = stats_now_ns();
+#endif
+
+	if (!path)
+		return 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	g_metrics_sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (g_metrics_sock < 0) {
+		fprintf(stderr, "Could not create metrics socket (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	// a stale socket of a previous run would make bind() fail
+	unlink(path);
+	if (bind(g_metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(g_metrics_sock, METRICS_SOCK_BACKLOG)) {
+		rc = -errno;
+		fprintf(stderr, "Could not bind metrics socket to %s (%s)\n", path, strerror(errno));
+		close(g_metrics_sock);
+		g_metrics_sock = -1;
+		return rc;
+	}
+	strcpy(g_sock_path, path);
+
+	return 0;
+}
+
+void teardown_metrics(void)
+{
+	if (g_metrics_sock < 0)
+		return;
+
+	close(g_metrics_sock);
+	unlink(g_sock_path);
+	g_metrics_sock = -1;
+}
+
+int metrics_get_fd(void)
+{
+	return g_metrics_sock;
+}
+
+int metrics_handle_socket(void)
+{
+	int fd;
+	FILE *f;
+
+	while (1) {
+		fd = accept4(g_metrics_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Could not accept metrics client (%s)\n", strerror(errno));
+			return -errno;
+		}
+
+		// the dump is a few hundred bytes, i.e. it fits into the socket buffer and never blocks the loop
+		f = fdopen(fd, "w");
+		if (!f) {
+			close(fd);
+			continue;
+		}
+		metrics_dump(f);
+		fclose(f);
+	}
+}
+
+#if CFG_METRICS
+void metrics_dump(FILE *f)
+{
+	int i;
+	const char *stages[] = METRICS_STAGE_NAMES;
+	const char *counters[] = METRICS_COUNTER_NAMES;
+
+	fprintf(f, "Metrics: %.1f s since start\n", (stats_now_ns() - g_start_ns) / 1e9);
+
+	fprintf(f, "Metrics:");
+	for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+		fprintf(f, " %s %lu", counters[i], atomic_load_explicit(&g_counters[i].val, memory_order_relaxed));
+	fprintf(f, "\n");
+
+	for (i = 0; i < METRICS_NUM_STAGES; i++)
+		dump_stage(i, stages[i], f);
+
+	fflush(f);
+}
+
+uint64_t metrics_now(void)
+{
+	return stats_now_ns();
+}
+
+void metrics_time(metrics_stage_t stage, uint64_t ns)
+{
+	metrics_hist_t *h = &g_stages[stage];
+
+	add_ulong(&h->buckets[bucket_index(ns)], 1);
+	add_ullong(&h->sum, ns);
+	if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+void metrics_count(metrics_counter_t counter, unsigned long n)
+{
+	add_ulong(&g_counters[counter].val, n);
+}
+#else
+void metrics_dump(FILE *f)
+{
+	fprintf(f, "Metrics: disabled (CFG_METRICS=0)\n");
+	fflush(f);
+}
+#endif /* CFG_METRICS */
@@ -0,0 +1,124 @@
+#ifndef _metrics_handling
+#define _metrics_handling
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#ifndef CFG_METRICS
+#define CFG_METRICS 1 // 0: recording compiles to nothing, a dump only prints a note
+#endif
+#ifndef CFG_METRICS_SAMPLE_SHIFT
+#define CFG_METRICS_SAMPLE_SHIFT 0 // stage latencies of every 2^n-th read batch/packet are recorded
+#endif
+
+#define METRICS_BUCKETS 32 // bucket i holds values below 2^i ns (and at least 2^(i-1)), i.e. up to ~2 s
+#define METRICS_SOCK_BACKLOG 4
+
+/* latency of a hot path stage, in ns */
+typedef enum _metrics_stage_t{
+	METRICS_READ = 0,	// read() of one batch of input events
+	METRICS_GROUP,		// decode of the events of a group, from the end of its read until it is dispatched
+	METRICS_FILL,		// nun_stat_t -> protobuf message (not recorded for compact, it is encoded in one step)
+	METRICS_PACK,		// serialization into the wire buffer
+	METRICS_SEND,		// sendmmsg() to every destination
+	METRICS_NUM_STAGES
+} metrics_stage_t;
+#define METRICS_STAGE_NAMES {"read", "group", "fill", "pack", "send"}
+
+typedef enum _metrics_counter_t{
+	METRICS_EVENTS = 0,
+	METRICS_GROUPS,
+	METRICS_PACKETS,
+	METRICS_SYNC_DROPS,	// SYN_DROPPED, i.e. the kernel buffer of a device overflowed
+	METRICS_UNEXPECTED,	// events of an unexpected type or code
+	METRICS_FILTERED,	// axis values absorbed by the joystick filter
+	METRICS_SEND_ERRORS,
+	METRICS_SEND_DROPS,	// socket buffer full
+	METRICS_NUM_COUNTERS
+} metrics_counter_t;
+#define METRICS_COUNTER_NAMES {"events", "groups", "packets", "sync_drops", "unexpected", "filtered", "send_errors", "send_drops"}
+
+/**
+ * Every stage and counter has a single writer thread (input or network thread), i.e. recording is a
+ * relaxed load and store without any lock or read-modify-write. The latency of a stage costs two clock reads,
+ * it is only taken for every 2^CFG_METRICS_SAMPLE_SHIFT-th batch/packet (see METRICS_SAMPLED()).
+ */
+#if CFG_METRICS
+#define METRICS_SAMPLED(n) (!((n) & ((1UL << CFG_METRICS_SAMPLE_SHIFT) - 1)))
+#else
+#define METRICS_SAMPLED(n) 0
+#define metrics_now() 0
+#define metrics_time(stage, ns) ((void)(stage), (void)(ns))
+#define metrics_count(counter, n) ((void)(counter), (void)(n))
+#endif
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Reset all metrics. If a path is given a UNIX stream socket is created there, every client that connects
+ * gets a dump (e.g. 'socat - UNIX-CONNECT:path'), see metrics_handle_socket().
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_metrics(const char *);
+
+/**
+ * Close and remove the socket created by init_metrics()
+ *
+ * return: void
+ */
+void teardown_metrics(void);
+
+/**
+ * Get the fd of the listening socket, it becomes readable if a client connected
+ *
+ * return: fd, -1 if there is no socket
+ */
+int metrics_get_fd(void);
+
+/**
+ * Accept all pending clients, every one gets a dump and is disconnected
+ *
+ * return: 0 on success, <0 on error
+ */
+int metrics_handle_socket(void);
+
+/**
+ * Print the counters and count, avg, p50, p99 and max of every stage, can be called at any time from any thread
+ *
+ * return: void
+ */
+void metrics_dump(FILE *);
+
+#if CFG_METRICS
+/**
+ * Get the current time for a stage latency (CLOCK_MONOTONIC)
+ *
+ * return: time in ns
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Record the latency of a stage in ns
+ *
+ * return: void
+ */
+void metrics_time(metrics_stage_t, uint64_t);
+
+/**
+ * Add n to a counter
+ *
+ * return: void
+ */
+void metrics_count(metrics_counter_t, unsigned long);
+#endif /* CFG_METRICS */
+
+
+#endif /* _metrics_handling */
@@ -1,61 +1,708 @@
+#define _GNU_SOURCE /* sendmmsg */
 #include <arpa/inet.h>
-#include <stdio.h> /* fprintf */
+#include <stdio.h> /* fprintf, fopen */
+#include <stdlib.h> /* strtoul, getenv */
+#include <limits.h> /* PATH_MAX */
 #include <string.h> /* strerror */
-#include <unistd.h> /* close */
+#include <time.h> /* time, clock_gettime */
+#include <unistd.h> /* close, write */
+#include <errno.h> /* err codes */
+#include <stdatomic.h>
+#include <poll.h> /* poll */
+#include <sys/socket.h> /* sendmmsg */
+#include <sys/eventfd.h> /* eventfd */
+#include <sys/stat.h> /* mkdir */
 
+#include "event_sender.h"
 #include "network_handling.h"
 #include "avahi_handling.h"
+#include "stats_handling.h"
+#include "metrics_handling.h"
+#include "loop_handling.h"
+#include "protobuf_handling.h"
+#include "rt_handling.h"
+#include "shm_handling.h"
 
 
 /***********************************************************************************************************************
-* GLOBAL DATA
+* MACROS/DEFINES
 ***********************************************************************************************************************/
-int g_sock = 0;
-struct sockaddr_in g_si_other = {0};
+#ifndef CFG_USE_AVAHI
+#define CFG_USE_AVAHI 1 // 0: static destinations only, e.g. for the benchmark
+#endif
+#define AVAHI_SERVC_NAME SRVC_NAME // every service whose name starts with it is a destination
+#define IP_TP "10.10.0.102"
+#define PORT_TP 8888
+#define FORMATS_TP "protobuf,compact"
+
+// the resolved services are cached, a restarted sender can use them before discovery finished
+#define CACHE_NAME "event_sender" // file in $XDG_CACHE_HOME, $HOME/.cache or CACHE_DIR_FALLBACK
+#define CACHE_DIR_FALLBACK "/var/cache"
+#define CACHE_MAX_AGE_SEC (7 * 24 * 3600)
+#define CACHE_VERIFY_SEC 30 // cached destinations are dropped if discovery does not confirm them in time
+
+/**
+ * Every destination is packed into one 64 bit word, i.e. the discovery thread swaps it atomically
+ * while the sending thread reads it without a lock:
+ * bits 0..31 ip addr (network byte order), bits 32..47 port, bits 48..51 formats supported by the server.
+ * A port of 0 means that the slot is free.
+ */
+#define DST_PACK(addr, port, fmts) ((uint64_t)(addr) | (uint64_t)(port) << 32 | (uint64_t)((fmts) & 0xf) << 48)
+#define DST_ADDR(dst) ((uint32_t)(dst))
+#define DST_PORT(dst) ((uint16_t)((dst) >> 32))
+#define DST_FORMATS(dst) ((unsigned)((dst) >> 48) & 0xf)
+
+/**
+ * Summary of the destination set, packed into one word as well:
+ * bits 0..3 formats supported by every destination, bits 4..7 number of destinations,
+ * bits 8..31 generation (incremented per change of the set, never 0 once set).
+ */
+#define SET_PACK(fmts, num, gen) (((fmts) & 0xf) | ((num) & 0xf) << 4 | (gen) << 8)
+#define SET_FORMATS(set) ((set) & 0xf)
+#define SET_NUM(set) (((set) >> 4) & 0xf)
+#define SET_GEN(set) ((set) >> 8)
+#define SET_GEN_MAX 0xffffff
+
+// sends queued on the io_uring of the sending thread, the packet is copied (the encoder reuses its buffer)
+#define NW_URING_SLOTS 64
+#define NW_URING_BUF_LEN MAX_UNPACK_BUF_SIZE
 
 
 /***********************************************************************************************************************
-* MACROS/DEFINES
+* DATA STRUCTURES
 ***********************************************************************************************************************/
-#define CFG_USE_AVAHI 1
-#define AVAHI_SERVC_NAME "EventSender_Zeroconf"
-#define IP_TP "10.10.0.102"
-#define PORT_TP 8888
+typedef struct
+{
+	// owned by the discovery thread (static entries are set before it is started)
+	atomic_ullong dst; // see DST_PACK()
+	char name[SRVC_NAME_LEN];
+	bool is_static;
+	bool cached; // loaded from the cache and not confirmed by the discovery yet
+
+	// owned by the sending thread
+	uint64_t stats_dst; // destination the counters belong to, they are reset if the slot is reused
+	unsigned long sent;
+	unsigned long errors;
+	unsigned long drops; // socket buffer full
+	unsigned lost; // device ids (bits) with a packet that did not reach it, see nw_take_losses()
+	unsigned dropped; // device ids (bits) with a joystick update dropped by the low latency profile
+} nw_dest_t;
+
+/* a send in flight on the io_uring, see loop_queue_sendmsg() */
+typedef struct
+{
+	bool busy;
+	nw_dest_t *dest;
+	uint64_t dst; // the counters of the destination are only updated if it still serves the same receiver
+	bool droppable;
+	uint8_t dev_id;
+	struct sockaddr_in addr;
+	struct iovec iov;
+	struct msghdr msg;
+	uint8_t buf[NW_URING_BUF_LEN];
+} nw_slot_t;
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+int g_sock = 0;
+int g_nw_efd = -1; // signalled whenever the destination set changed
+nw_dest_t g_dests[NW_MAX_DESTS];
+atomic_uint g_dst_set; // see SET_PACK()
+
+// startup latency in ms since process start, <0 if not reached yet
+static struct timespec g_start_ts;
+static double g_ready_ms = -1; // first destination known
+static double g_first_pkt_ms = -1; // first packet sent
+static const char *g_ready_src = "";
+
+// control messages
+static unsigned long g_pings = 0;
+static unsigned long g_nacks = 0;
+static unsigned long g_ctrl_invalid = 0;
+static unsigned g_keyframe_reqs = 0; // bitmask of device ids
+
+#if CFG_USE_AVAHI
+// discovery cache, see set_cache_path()
+static char g_cache_path[PATH_MAX];
+#endif
+
+// transport profile, the connection is owned by the sending thread
+static nw_profile_t g_profile = NW_PROFILE_DEFAULT;
+static uint64_t g_conn_dst = 0; // destination the socket is connected to, 0 if unconnected
+static unsigned long g_joy_drops = 0; // joystick-only packets dropped because the socket buffer was full
+static unsigned long g_button_waits = 0; // packets that had to wait for space in the socket buffer
+static unsigned long g_syscalls = 0; // send/sendmmsg/poll
+
+// local transport (shared memory), replaces the socket
+static bool g_shm = false;
+
+// io_uring backend, owned by the sending thread
+static nw_slot_t g_slots[NW_URING_SLOTS];
+static unsigned g_slot_next = 0;
+static unsigned long g_uring_queued = 0;
 
 
 /***********************************************************************************************************************
 * HELPER FUNC
 ***********************************************************************************************************************/
-static int get_address(char **ip, unsigned *port)
+/* convert a comma separated list of format names into a bitmask of wire_format_t */
+static unsigned parse_formats(const char *formats)
 {
-#if CFG_USE_AVAHI
-	// use avahi to find server ip addr
-	return avahi_find_host_addr(AVAHI_SERVC_NAME, ip, port);
-#else
-	// use a static cfg
-	*ip = IP_TP;
-	*port = PORT_TP;
+	int i;
+	char *tok, *save, list[TXT_FORMATS_LEN];
+	const char *names[] = WIRE_FORMAT_NAMES;
+	unsigned mask = WIRE_FORMAT_BIT(WIRE_PROTOBUF); // always supported
+
+	strncpy(list, formats, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+		for (i = 0; i < WIRE_NUM_FORMATS; i++)
+			if (!strcmp(tok, names[i]))
+				mask |= WIRE_FORMAT_BIT(i);
+
+	return mask;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+/* taken before main(), i.e. the startup latency includes opening the input devices */
+__attribute__((constructor)) static void mark_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &g_start_ts);
+}
+
+static double ms_since_start(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - g_start_ts.tv_sec) * 1e3 + (now.tv_nsec - g_start_ts.tv_nsec) / 1e6;
+}
+
+static int setup_lowlat(int fd)
+{
+	int tos = NW_DSCP_EF << 2, prio = NW_SO_PRIORITY, sndbuf = NW_SNDBUF;
+
+	if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) ||
+		setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio)) ||
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
+		fprintf(stderr, "Could not set the low latency socket options (%s)\n", strerror(errno));
+		return -errno;
+	}
+
 	return 0;
+}
+
+/**
+ * Low latency profile: the socket is connected while there is a single destination, i.e. the kernel skips the
+ * route lookup per packet. With several destinations it is unconnected again (pings of all of them are answered).
+ */
+static void connect_dest(uint64_t dst)
+{
+	struct sockaddr_in addr;
+
+	if (dst == g_conn_dst)
+		return;
+
+	// AF_UNSPEC dissolves the association
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = dst ? AF_INET : AF_UNSPEC;
+	addr.sin_port = htons(DST_PORT(dst));
+	addr.sin_addr.s_addr = DST_ADDR(dst);
+
+	if (connect(g_sock, (struct sockaddr *)&addr, sizeof(addr)) && dst) {
+		fprintf(stderr, "Could not connect socket (%s)\n", strerror(errno));
+		dst = 0;
+	}
+
+	g_conn_dst = dst;
+}
+
+/**
+ * Account a send of the device that did not reach its destination. A dropped joystick update is only stale,
+ * every other failure may have lost a change, i.e. the state of the device at that receiver may be wrong.
+ *
+ * return: true if the packet was dropped by the drop policy, i.e. on purpose
+ */
+static bool account_failure(nw_dest_t *dest, uint8_t dev_id, int err, bool droppable)
+{
+	unsigned bit = 1u << (dev_id & 0x1f);
+	bool policy = false;
+
+	if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS) {
+		if (droppable) {
+			g_joy_drops++;
+			dest->dropped |= bit;
+			policy = true;
+		} else {
+			dest->lost |= bit;
+		}
+		dest->drops++;
+		metrics_count(METRICS_SEND_DROPS, 1);
+	} else {
+		dest->lost |= bit;
+		dest->errors++;
+		metrics_count(METRICS_SEND_ERRORS, 1);
+	}
+
+	return policy;
+}
+
+/**
+ * The connected socket of the low latency profile reports an ICMP port unreachable of its destination with the
+ * next send() or recvfrom() (ECONNREFUSED), e.g. the receiver was restarted. It is an error of that destination,
+ * discovery follows the receiver.
+ */
+static void account_refused(void)
+{
+	int i;
+
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		if (!g_conn_dst || g_dests[i].stats_dst != g_conn_dst)
+			continue;
+		g_dests[i].errors++;
+		metrics_count(METRICS_SEND_ERRORS, 1);
+		return;
+	}
+}
+
+/* Called by the main loop whenever a send queued on the io_uring completed */
+static int handle_send_done(int res, void *ctx)
+{
+	nw_slot_t *slot = ctx;
+
+	slot->busy = false;
+	if (slot->dest->stats_dst != slot->dst)
+		return 0;
+
+	if (res < 0)
+		account_failure(slot->dest, slot->dev_id, -res, slot->droppable);
+	else
+		slot->dest->sent++;
+
+	// a failing destination never stops the loop, like the synchronous path
+	return 0;
+}
+
+/**
+ * io_uring backend: queue one sendmsg() per destination, they are submitted with the next wait of the main loop.
+ * Errors are accounted once the sends completed. With the low latency profile a droppable packet is sent
+ * with MSG_DONTWAIT, every other one waits (in the kernel) for space in the socket buffer.
+ * 'dropped' is set to the number of sends dropped by the drop policy (no free slot), 'err' to the error of the
+ * last send that could not be queued (ENOBUFS: no free slot).
+ *
+ * return: number of queued sends, <0 on error (packet too large)
+ */
+static int queue_sends(uint8_t dev_id, uint8_t *buffer, unsigned buf_len, bool droppable, nw_dest_t **dests,
+	struct sockaddr_in *addrs, int n, int *dropped, int *err)
+{
+	int i, j, rc, queued = 0;
+	int flags = g_profile == NW_PROFILE_LOWLAT && droppable ? MSG_DONTWAIT : 0;
+	nw_slot_t *slot;
+
+	if (buf_len > NW_URING_BUF_LEN)
+		return -EMSGSIZE;
+
+	for (i = 0; i < n; i++) {
+		// the slots are used round robin, i.e. the next one is free unless the socket is stuck
+		for (j = 0, slot = NULL; j < NW_URING_SLOTS && !slot; j++) {
+			slot = &g_slots[(g_slot_next + j) % NW_URING_SLOTS];
+			if (slot->busy)
+				slot = NULL;
+		}
+		if (!slot) {
+			if (account_failure(dests[i], dev_id, ENOBUFS, droppable))
+				(*dropped)++;
+			*err = ENOBUFS;
+			continue;
+		}
+		g_slot_next = (slot - g_slots + 1) % NW_URING_SLOTS;
+
+		memcpy(slot->buf, buffer, buf_len);
+		slot->dest = dests[i];
+		slot->dst = dests[i]->stats_dst;
+		slot->droppable = droppable;
+		slot->dev_id = dev_id;
+		slot->addr = addrs[i];
+		slot->iov.iov_base = slot->buf;
+		slot->iov.iov_len = buf_len;
+		memset(&slot->msg, 0, sizeof(slot->msg));
+		slot->msg.msg_name = g_conn_dst ? NULL : &slot->addr;
+		slot->msg.msg_namelen = g_conn_dst ? 0 : sizeof(slot->addr);
+		slot->msg.msg_iov = &slot->iov;
+		slot->msg.msg_iovlen = 1;
+
+		rc = loop_queue_sendmsg(g_sock, &slot->msg, flags, handle_send_done, slot);
+		if (rc) {
+			account_failure(dests[i], dev_id, -rc, droppable);
+			*err = -rc;
+			continue;
+		}
+		slot->busy = true;
+		queued++;
+	}
+
+	g_uring_queued += queued;
+
+	return queued;
+}
+
+/* wait for space in the socket buffer */
+static bool wait_writable(void)
+{
+	struct pollfd pfd = { .fd = g_sock, .events = POLLOUT };
+
+	g_button_waits++;
+	g_syscalls++;
+
+	return poll(&pfd, 1, NW_BUTTON_WAIT_MS) > 0;
+}
+
+static int find_dest(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NW_MAX_DESTS; i++)
+		if (DST_PORT(atomic_load(&g_dests[i].dst)) && !strcmp(g_dests[i].name, name))
+			return i;
+
+	return -1;
+}
+
+/**
+ * Add or replace the destination with the given name
+ *
+ * return: true if the destination set changed
+ */
+static bool set_dest(const char *name, const char *ip, unsigned port, const char *formats, const char *src)
+{
+	int i = find_dest(name);
+	uint64_t dst;
+	struct in_addr addr = {0};
+
+	// convert string into binary addr representation, returns 0 on error
+	if (!inet_aton(ip, &addr) || !port) {
+		fprintf(stderr, "Could not convert IP (inet_aton)\n");
+		return false;
+	}
+	dst = DST_PACK(addr.s_addr, port, parse_formats(formats));
+
+	if (i < 0) {
+		for (i = 0; i < NW_MAX_DESTS && DST_PORT(atomic_load(&g_dests[i].dst)); i++);
+		if (i == NW_MAX_DESTS) {
+			fprintf(stderr, "Too many destinations, ignoring %s\n", name);
+			return false;
+		}
+		strncpy(g_dests[i].name, name, SRVC_NAME_LEN - 1);
+		g_dests[i].name[SRVC_NAME_LEN - 1] = '\0';
+	}
+
+	// e.g. a cached destination that was confirmed by the discovery
+	g_dests[i].cached = false;
+	if (atomic_load(&g_dests[i].dst) == dst)
+		return false;
+
+	printf("Found service '%s' on %s:%u (formats: %s, %s)!\n", name, ip, port, formats[0] ? formats : "protobuf", src);
+	atomic_store(&g_dests[i].dst, dst);
+
+	if (g_ready_ms < 0) {
+		g_ready_src = src;
+		g_ready_ms = ms_since_start();
+	}
+
+	return true;
+}
+
+#if CFG_USE_AVAHI
+static void clear_dest(int i)
+{
+	printf("Service '%s' vanished\n", g_dests[i].name);
+	atomic_store(&g_dests[i].dst, 0);
+	g_dests[i].cached = false;
+}
 #endif
+
+/**
+ * Publish the changed destination set: the packets have to be encoded in a format that every destination
+ * supports and a new destination has to receive the complete state. The sending thread is notified via g_nw_efd.
+ */
+static void publish_dests(void)
+{
+	int i;
+	uint64_t one = 1, dst;
+	unsigned set = atomic_load(&g_dst_set), num = 0, formats = WIRE_FORMAT_BIT(WIRE_PROTOBUF);
+
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		dst = atomic_load(&g_dests[i].dst);
+		if (DST_PORT(dst)) {
+			formats = num ? formats & DST_FORMATS(dst) : DST_FORMATS(dst);
+			num++;
+		}
+	}
+
+	atomic_store(&g_dst_set, SET_PACK(formats, num, SET_GEN(set) % SET_GEN_MAX + 1));
+
+	if (!num)
+		printf("No receiver left, waiting for discovery\n");
+
+	if (write(g_nw_efd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "Failed to signal destination change (%s)\n", strerror(errno));
 }
 
+/* parse a static destination "ip:port[,format...]", without formats the destination only knows protobuf */
+static int add_static_dest(char *spec)
+{
+	int i;
+	char ip[IP_ADDR_LEN], *port, *formats;
+
+	port = strchr(spec, ':');
+	if (!port || port - spec >= IP_ADDR_LEN) {
+		fprintf(stderr, "Invalid destination %s (ip:port[,format...])\n", spec);
+		return -EINVAL;
+	}
+	memcpy(ip, spec, port - spec);
+	ip[port - spec] = '\0';
+
+	// the name of a static destination is "ip:port"
+	formats = strchr(port, ',');
+	if (formats)
+		*formats++ = '\0';
+	else
+		formats = "";
+
+	if (!set_dest(spec, ip, strtoul(port + 1, NULL, 10), formats, "static"))
+		return -EINVAL;
+
+	i = find_dest(spec);
+	g_dests[i].is_static = true;
+
+	return 0;
+}
+
+/**
+ * Switch to the local transport for a destination "shm:path[,wake]", it is the only destination then
+ *
+ * return: 0 on success, <0 on error
+ */
+static int init_local(char *spec)
+{
+	int rc;
+	char *path = spec + strlen(NW_SHM_PREFIX), *opt = strchr(path, ',');
+	bool wake = false;
+
+	if (opt) {
+		if (strcmp(opt, NW_SHM_WAKE)) {
+			fprintf(stderr, "Invalid destination %s (shm:path[,wake])\n", spec);
+			return -EINVAL;
+		}
+		*opt = '\0';
+		wake = true;
+	}
+
+	rc = init_shm(path, wake);
+	if (rc)
+		return rc;
+	g_shm = true;
+
+	// always connected, the update contexts switch to the local format with their first update
+	g_ready_ms = ms_since_start();
+	g_ready_src = "shared memory";
+	atomic_store(&g_dst_set, SET_PACK(WIRE_FORMAT_BIT(WIRE_LOCAL), 1, 1));
+	printf("Publishing the states in shared memory, readers attach at %s%s\n", path, wake ? " (woken up per update)" : "");
+
+	return 0;
+}
+
+#if CFG_USE_AVAHI
+/**
+ * Select the cache file of the user like the XDG base directories: $XDG_CACHE_HOME/event_sender,
+ * $HOME/.cache/event_sender (the directory is created) or CACHE_DIR_FALLBACK/event_sender without a home.
+ *
+ * return: void
+ */
+static void set_cache_path(void)
+{
+	char dir[PATH_MAX];
+	const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+	if (xdg && *xdg == '/') {
+		snprintf(dir, sizeof(dir), "%s", xdg);
+	} else if (home && *home) {
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+		if (mkdir(dir, 0700) && errno != EEXIST)
+			fprintf(stderr, "Could not create %s (%s)\n", dir, strerror(errno));
+	} else {
+		snprintf(dir, sizeof(dir), "%s", CACHE_DIR_FALLBACK);
+	}
+
+	if (snprintf(g_cache_path, sizeof(g_cache_path), "%s/%s", dir, CACHE_NAME) >= (int)sizeof(g_cache_path) - 4)
+		g_cache_path[0] = '\0'; // no room for the temporary file, the cache is not used
+}
+
+/**
+ * Read the cached services, they are only used if they belong to the requested service and are not too old.
+ * The cache file consists of blocks of "key=value" lines: name, ip, port, formats (TXT record) and time (unix time).
+ *
+ * return: number of cached destinations
+ */
+static int load_cache(void)
+{
+	FILE *f;
+	long ts, age;
+	int cnt = 0;
+	unsigned port;
+	char name[SRVC_NAME_LEN], ip[IP_ADDR_LEN], formats[TXT_FORMATS_LEN];
+
+	if (!g_cache_path[0])
+		return 0;
+
+	f = fopen(g_cache_path, "r");
+	if (!f)
+		return 0;
+
+	while (fscanf(f, " name=%63[^\n] ip=%15s port=%u formats=%63s time=%ld", name, ip, &port, formats, &ts) == 5) {
+		if (strncmp(name, AVAHI_SERVC_NAME, strlen(AVAHI_SERVC_NAME)))
+			continue;
+
+		// without RTC the clock may start in the past, such an entry is used and verified like any other one
+		age = time(NULL) - ts;
+		if (age > CACHE_MAX_AGE_SEC) {
+			printf("Cached service '%s' is outdated (%ld s old)\n", name, age);
+			continue;
+		}
+
+		if (set_dest(name, ip, port, formats, "cache")) {
+			g_dests[find_dest(name)].cached = true;
+			cnt++;
+		}
+	}
+	fclose(f);
+
+	return cnt;
+}
+
+/* write the discovered services to a temporary file that replaces the cache, i.e. the cache is never incomplete */
+static void save_cache(void)
+{
+	int i;
+	FILE *f;
+	uint64_t dst;
+	struct in_addr addr;
+	char ip[IP_ADDR_LEN];
+	char tmp[PATH_MAX];
+	const char *names[] = WIRE_FORMAT_NAMES;
+
+	if (!g_cache_path[0])
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_cache_path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Could not write discovery cache (%s)\n", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		unsigned fmt, formats;
+
+		dst = atomic_load(&g_dests[i].dst);
+		if (!DST_PORT(dst) || g_dests[i].is_static)
+			continue;
+
+		addr.s_addr = DST_ADDR(dst);
+		inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+		fprintf(f, "name=%s\nip=%s\nport=%u\nformats=", g_dests[i].name, ip, DST_PORT(dst));
+		for (fmt = 0, formats = DST_FORMATS(dst); fmt < WIRE_NUM_FORMATS; fmt++)
+			if (formats & WIRE_FORMAT_BIT(fmt))
+				fprintf(f, "%s%s", names[fmt], formats & ~(WIRE_FORMAT_BIT(fmt + 1) - 1) ? "," : "");
+		fprintf(f, "\ntime=%ld\n", (long)time(NULL));
+	}
+
+	if (fclose(f) || rename(tmp, g_cache_path))
+		fprintf(stderr, "Could not write discovery cache (%s)\n", strerror(errno));
+}
+
+/**
+ * Called by the discovery thread whenever a service was found, moved or removed. A NULL name indicates that
+ * the verification timeout expired, every cached destination that was not confirmed until then is dropped.
+ * The cache follows the discovery.
+ */
+static void discovery_callback(const char *name, const char *ip, unsigned port, const char *formats)
+{
+	int i;
+	bool changed = false;
+
+	if (!name) {
+		for (i = 0; i < NW_MAX_DESTS; i++) {
+			if (DST_PORT(atomic_load(&g_dests[i].dst)) && g_dests[i].cached) {
+				printf("Cached service '%s' not confirmed, dropped\n", g_dests[i].name);
+				clear_dest(i);
+				changed = true;
+			}
+		}
+	} else if (!ip) {
+		i = find_dest(name);
+		if (i >= 0 && !g_dests[i].is_static) {
+			clear_dest(i);
+			changed = true;
+		}
+	} else {
+		changed = set_dest(name, ip, port, formats, "discovery");
+	}
+
+	if (changed)
+		publish_dests();
+
+	// a confirmation refreshes the time stamp of the cache
+	if (changed || ip)
+		save_cache();
+}
+#endif /* CFG_USE_AVAHI */
+
 
 /***********************************************************************************************************************
 * IMPLEMENTATION OF EXPORTED FUNCTIONS
 ***********************************************************************************************************************/
-int init_nw()
+int init_nw(char **static_dests, unsigned num_static, nw_profile_t profile)
 {
-	int err;
-	char *dst_ip;
-	unsigned dst_port;
-	struct sockaddr_in si_other = {0};
+	int i;
 
 	// sanity check
-	if (g_sock) {
+	if (g_sock || g_shm) {
 		fprintf(stderr, "Error, already initialized\n");
 		return -1;
 	}
 
+	g_nw_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (g_nw_efd < 0) {
+		fprintf(stderr, "Could not create eventfd (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	memset(g_dests, 0, sizeof(g_dests));
+	atomic_init(&g_dst_set, 0);
+
+	// local consumers only, neither a socket nor the discovery
+	for (i = 0; i < num_static; i++) {
+		if (strncmp(static_dests[i], NW_SHM_PREFIX, strlen(NW_SHM_PREFIX)))
+			continue;
+		if (num_static > 1) {
+			fprintf(stderr, "The shared memory transport can not be combined with other destinations\n");
+			return -1;
+		}
+		return init_local(static_dests[i]) ? -1 : 0;
+	}
+
 	// create udp socket
 	g_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (g_sock < 0) {
@@ -63,49 +710,317 @@ int init_nw()
 		return -1;
     }
 
-	// retrieve the dst ip addr
-	err = get_address(&dst_ip, &dst_port);
-	if (err < 0) {
-        fprintf(stderr, "Could not retrieve destination address\n");
+	g_profile = profile;
+	g_conn_dst = 0;
+	if (profile == NW_PROFILE_LOWLAT && setup_lowlat(g_sock))
 		return -1;
-    }
 
-	// dbg
-	printf("Found requested service on %s:%u!\n", dst_ip, dst_port);
+	// static destinations are always served, in addition to the discovered ones
+	for (i = 0; i < num_static; i++)
+		if (add_static_dest(static_dests[i]))
+			return -1;
+
+#if CFG_USE_AVAHI
+	{
+		int cached;
 
-	// setup dst address
-	si_other.sin_family = AF_INET;
-    si_other.sin_port = htons(dst_port);
+		// the cached services are used right away, discovery verifies them in the background
+		set_cache_path();
+		cached = load_cache();
 
-	// convert string into binary addr representation, returns 0 on error
-    err = inet_aton(dst_ip, &si_other.sin_addr);
-	if (err == 0) {
-        fprintf(stderr, "Could not convert IP (inet_aton)\n");
-		return -1;
-    }
+		if (num_static || cached)
+			publish_dests();
 
-	// save addr in global var for use in sendto()
-	memcpy(&g_si_other, &si_other, sizeof(g_si_other));
+		// use avahi to find the servers, sending is switched on once the first one is resolved
+		if (avahi_start_discovery(AVAHI_SERVC_NAME, discovery_callback, cached ? CACHE_VERIFY_SEC : 0)) {
+			fprintf(stderr, "Could not start service discovery\n");
+			return -1;
+		}
+		printf("Searching for services %s* ...\n", AVAHI_SERVC_NAME);
+	}
+#else
+	// use a static cfg if no destination is given
+	if (!num_static)
+		set_dest(AVAHI_SERVC_NAME, IP_TP, PORT_TP, FORMATS_TP, "static cfg");
+	publish_dests();
+#endif
 
 	return 0;
 }
 
 void teardown_nw()
 {
+	if (g_shm) {
+		teardown_shm();
+		g_shm = false;
+	}
+#if CFG_USE_AVAHI
+	else
+		avahi_stop_discovery();
+#endif
+
+	if (g_nw_efd >= 0)
+		close(g_nw_efd);
 	if (g_sock)
 		close(g_sock);
+
+	g_nw_efd = -1;
+	g_sock = 0;
 }
 
-int nw_send(uint8_t *buffer, unsigned buf_len)
+int nw_get_event_fd(void)
 {
-    int err;
+	return g_nw_efd;
+}
 
-	// send buffer to specified address
-	err = sendto(g_sock, buffer, buf_len , 0 /*flags*/, (struct sockaddr *) &g_si_other, sizeof(g_si_other));
-	if (err < 0) {
-        fprintf(stderr, "Could not send packet %d (%s)\n", err, strerror(-err));
-		return -1;
+int nw_get_fd(void)
+{
+	return g_shm ? shm_get_fd() : g_sock;
+}
+
+int nw_handle_ctrl(void)
+{
+	ssize_t len;
+	uint64_t t2;
+	uint8_t buf[NW_PONG_LEN];
+	struct sockaddr_in src;
+	socklen_t src_len;
+
+	// readers of the local transport fetch the shared memory
+	if (g_shm)
+		return shm_handle_socket();
+
+	while (1) {
+		src_len = sizeof(src);
+		len = recvfrom(g_sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&src, &src_len);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == ECONNREFUSED) {
+				account_refused();
+				continue;
+			}
+			fprintf(stderr, "Could not receive control message (%s)\n", strerror(errno));
+			return -errno;
+		}
+		t2 = stats_now_us();
+
+		// answered by the owner of the update contexts
+		if (len == NW_NACK_LEN && buf[0] == NW_CTRL_NACK) {
+			g_nacks++;
+			g_keyframe_reqs |= 1u << (buf[1] & 0x1f);
+			continue;
+		}
+
+		if (len != NW_PING_LEN || buf[0] != NW_CTRL_PING) {
+			g_ctrl_invalid++;
+			continue;
+		}
+
+		// t1 stays in place, the timestamps of the sender are appended
+		buf[0] = NW_CTRL_PONG;
+		put_le64(&buf[9], t2);
+		put_le64(&buf[17], stats_now_us());
+		if (sendto(g_sock, buf, NW_PONG_LEN, MSG_DONTWAIT, (struct sockaddr *)&src, src_len) == NW_PONG_LEN)
+			g_pings++;
+	}
+}
+
+unsigned nw_get_keyframe_requests(void)
+{
+	unsigned reqs = g_keyframe_reqs;
+
+	g_keyframe_reqs = 0;
+
+	return reqs;
+}
+
+unsigned nw_take_losses(uint8_t dev_id, bool *dropped)
+{
+	int i;
+	unsigned bit = 1u << (dev_id & 0x1f), lost = 0;
+
+	*dropped = false;
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		if (g_dests[i].lost & bit)
+			lost++;
+		if (g_dests[i].dropped & bit)
+			*dropped = true;
+		g_dests[i].lost &= ~bit;
+		g_dests[i].dropped &= ~bit;
+	}
+
+	return lost;
+}
+
+unsigned long nw_get_syscalls(void)
+{
+	return g_syscalls;
+}
+
+bool nw_get_destination(unsigned *gen, unsigned *formats)
+{
+	unsigned set = atomic_load_explicit(&g_dst_set, memory_order_relaxed);
+
+	*gen = SET_GEN(set);
+	*formats = SET_NUM(set) ? SET_FORMATS(set) : WIRE_FORMAT_BIT(WIRE_PROTOBUF);
+
+	return SET_NUM(set) != 0;
+}
+
+int nw_send(uint8_t dev_id, uint8_t *buffer, unsigned buf_len, bool droppable)
+{
+	int i, rc, n = 0, done = 0, ok = 0, dropped = 0, err = EIO;
+	int flags = g_profile == NW_PROFILE_LOWLAT ? MSG_DONTWAIT : 0;
+	bool waited = false;
+	uint64_t dst;
+	struct iovec iov = { .iov_base = buffer, .iov_len = buf_len };
+	struct sockaddr_in si_other[NW_MAX_DESTS];
+	struct mmsghdr msgs[NW_MAX_DESTS];
+	nw_dest_t *dests[NW_MAX_DESTS];
+
+	// the packet is the state itself, see WIRE_LOCAL
+	if (g_shm) {
+		if (buf_len != sizeof(nun_stat_t))
+			return -EINVAL;
+		rc = shm_publish((nun_stat_t *)buffer);
+		if (!rc && g_first_pkt_ms < 0)
+			g_first_pkt_ms = ms_since_start();
+		return rc;
+	}
+
+	// the packet is encoded once, every destination gets the same buffer
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		dst = atomic_load_explicit(&g_dests[i].dst, memory_order_relaxed);
+		if (!DST_PORT(dst))
+			continue;
+
+		// the slot was reused for another destination
+		if (g_dests[i].stats_dst != dst) {
+			g_dests[i].stats_dst = dst;
+			g_dests[i].sent = g_dests[i].errors = g_dests[i].drops = 0;
+			g_dests[i].lost = g_dests[i].dropped = 0;
+		}
+
+		memset(&si_other[n], 0, sizeof(si_other[n]));
+		si_other[n].sin_family = AF_INET;
+		si_other[n].sin_port = htons(DST_PORT(dst));
+		si_other[n].sin_addr.s_addr = DST_ADDR(dst);
+
+		memset(&msgs[n], 0, sizeof(msgs[n]));
+		msgs[n].msg_hdr.msg_name = &si_other[n];
+		msgs[n].msg_hdr.msg_namelen = sizeof(si_other[n]);
+		msgs[n].msg_hdr.msg_iov = &iov;
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		dests[n++] = &g_dests[i];
+	}
+
+	// no server known (yet)
+	if (!n)
+		return -ENOTCONN;
+
+	if (g_profile == NW_PROFILE_LOWLAT)
+		connect_dest(n == 1 ? dests[0]->stats_dst : 0);
+
+	if (loop_uring()) {
+		ok = queue_sends(dev_id, buffer, buf_len, droppable, dests, si_other, n, &dropped, &err);
+		if (ok < 0)
+			return ok;
+		goto sent;
+	}
+
+	/**
+	 * One syscall sends the packet to all destinations. It stops at the first failing destination,
+	 * that one is accounted and skipped, the remaining ones are sent by the next call.
+	 */
+	while (done < n) {
+		if (g_conn_dst)
+			rc = send(g_sock, buffer, buf_len, flags) < 0 ? -1 : 1;
+		else
+			rc = sendmmsg(g_sock, msgs + done, n - done, flags);
+		g_syscalls++;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				// socket buffer full (non-blocking): a button transition waits for space, a joystick update is dropped
+				if (!droppable && !waited && wait_writable()) {
+					waited = true;
+					continue;
+				}
+			}
+			err = errno;
+			if (account_failure(dests[done], dev_id, err, droppable))
+				dropped++;
+			done++;
+			waited = false;
+			continue;
+		}
+
+		for (i = done; i < done + rc; i++)
+			dests[i]->sent++;
+		done += rc;
+		ok += rc;
+		waited = false;
+	}
+
+sent:
+	// a single unreachable destination must not stop the others, the caller counts and logs a complete failure
+	if (!ok)
+		return dropped == n ? 0 : -err;
+
+	// the real-time mode only prints it with the statistics
+	if (g_first_pkt_ms < 0) {
+		g_first_pkt_ms = ms_since_start();
+		if (!rt_quiet())
+			printf("First packet sent %.1f ms after start\n", g_first_pkt_ms);
 	}
 
 	return 0;
 }
+
+void nw_print_stats(FILE *f)
+{
+	int i;
+	struct in_addr addr;
+	char ip[IP_ADDR_LEN];
+
+	if (g_ready_ms >= 0)
+		fprintf(f, "Network: receiver known %.1f ms after start (%s)\n", g_ready_ms, g_ready_src);
+	else
+		fprintf(f, "Network: receiver never found\n");
+
+	if (g_first_pkt_ms >= 0)
+		fprintf(f, "Network: first packet sent %.1f ms after start\n", g_first_pkt_ms);
+
+	if (g_shm) {
+		shm_print_stats(f);
+		return;
+	}
+
+	for (i = 0; i < NW_MAX_DESTS; i++) {
+		if (!DST_PORT(g_dests[i].stats_dst))
+			continue;
+
+		addr.s_addr = DST_ADDR(g_dests[i].stats_dst);
+		inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+		fprintf(f, "Network: '%s' %s:%u %lu packets sent, %lu errors, %lu drops\n", g_dests[i].name,
+			ip, DST_PORT(g_dests[i].stats_dst), g_dests[i].sent, g_dests[i].errors, g_dests[i].drops);
+	}
+
+	if (g_uring_queued)
+		fprintf(f, "Network: %lu sends queued on the io_uring\n", g_uring_queued);
+
+#if CFG_USE_AVAHI
+	if (avahi_get_browse_failures())
+		fprintf(f, "Network: service browser failed %lu times (recreated)\n", avahi_get_browse_failures());
+#endif
+
+	if (g_profile == NW_PROFILE_LOWLAT)
+		fprintf(f, "Network: low latency profile, %lu joystick updates dropped, %lu waits for the socket buffer\n",
+			g_joy_drops, g_button_waits);
+
+	fprintf(f, "Network: %lu pings answered, %lu nacks, %lu invalid control messages\n", g_pings, g_nacks, g_ctrl_invalid);
+}
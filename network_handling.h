@@ -1,7 +1,54 @@
 #ifndef _network_handling
 #define _network_handling
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define NW_MAX_DESTS 8
+
+/* transport profile of the socket */
+typedef enum _nw_profile_t{
+	NW_PROFILE_DEFAULT = 0,	// blocking socket, every packet is sent with the addresses of the destinations
+	NW_PROFILE_LOWLAT,		// connected if there is a single destination, DSCP EF, SO_PRIORITY, small SO_SNDBUF,
+							// non-blocking sends, joystick-only packets are dropped if the socket buffer is full
+	NW_NUM_PROFILES
+} nw_profile_t;
+#define NW_PROFILE_NAMES {"default", "lowlat"}
+#define NW_DSCP_EF 46 // expedited forwarding, mapped to the voice access category by WMM
+#define NW_SO_PRIORITY 6 // TC_PRIO_INTERACTIVE, the highest one without CAP_NET_ADMIN
+#define NW_SNDBUF 16384 // a short queue, stale joystick updates are dropped instead of delaying the next ones
+#define NW_BUTTON_WAIT_MS 5 // max time a button transition waits for space in the socket buffer
+
+/**
+ * Destination "shm:path[,wake]": the local transport replaces the socket, see shm_handling.h. The packets are the
+ * complete states themselves (WIRE_LOCAL), published into shared memory that readers get from the UNIX socket
+ * at 'path'. With 'wake' the readers are woken up per update via an eventfd, otherwise they poll.
+ */
+#define NW_SHM_PREFIX "shm:"
+#define NW_SHM_WAKE ",wake"
+
+/**
+ * Control messages for the clock offset estimation of the receiver, distinguished from updates by the
+ * first byte (no update format starts with 0xf). All timestamps are uint64 LE in us of CLOCK_MONOTONIC.
+ *
+ * ping (receiver -> sender): type, t1 (receiver clock when sent)
+ * pong (sender -> receiver): type, t1 (echoed), t2 (sender clock when the ping arrived), t3 (sender clock when sent)
+ *
+ * The receiver gets t4 when the pong arrives: offset = ((t2 - t1) + (t3 - t4)) / 2, rtt = (t4 - t1) - (t3 - t2)
+ *
+ * nack (receiver -> sender): type, device id. A packet of the device was lost, the sender answers with a keyframe.
+ */
+#define NW_CTRL_PING 0xf1
+#define NW_CTRL_PONG 0xf2
+#define NW_CTRL_NACK 0xf3
+#define NW_PING_LEN 9
+#define NW_PONG_LEN 25
+#define NW_NACK_LEN 2
 
 
 /*******************************************************************************
@@ -9,11 +56,14 @@
 *******************************************************************************/
 
 /**
- * Initialize the network subsystem
+ * Initialize the network subsystem with the given transport profile and start the discovery of the servers,
+ * returns immediately. The destination set consists of the given static destinations ("ip:port[,format...]")
+ * and every discovered server. Sending is switched on once the set is not empty.
+ * A single static destination "shm:path[,wake]" selects the local transport instead (see NW_SHM_PREFIX).
  *
- * return: void
+ * return: 0 on success, <0 on error
  */
-int init_nw();
+int init_nw(char **, unsigned, nw_profile_t);
 
 /**
  * Teardown the network subsystem
@@ -23,11 +73,83 @@ int init_nw();
 void teardown_nw();
 
 /**
- * Send a given buffer of given length over the network to a server
+ * Get a fd that becomes readable (eventfd) whenever a server was found, moved or removed.
+ * The owner of the update contexts has to read it and check nw_get_destination().
+ *
+ * return: fd
+ */
+int nw_get_event_fd(void);
+
+/**
+ * Get the fd of the socket, it becomes readable if a control message (ping) arrived (or a reader of the local
+ * transport connected), see nw_handle_ctrl()
+ *
+ * return: fd
+ */
+int nw_get_fd(void);
+
+/**
+ * Answer all pending pings of the receivers and collect their keyframe requests (see nw_get_keyframe_requests())
  *
  * return: 0 on success, <0 on error
  */
-int nw_send(uint8_t *, unsigned);
+int nw_handle_ctrl(void);
+
+/**
+ * Get and clear the devices a receiver requested a keyframe for (nack) since the last call
+ *
+ * return: bitmask of device ids
+ */
+unsigned nw_get_keyframe_requests(void);
+
+/**
+ * Collect and reset the send failures of the device with the given id, tracked per destination since the last
+ * call. A lost packet (error, or socket buffer full for a packet that must not be dropped) means that the state
+ * of the device at that receiver may be wrong. 'dropped' is set if a joystick-only packet was dropped by the
+ * low latency profile, only its axes are stale. With the io_uring backend a failure is only known once the
+ * send completed. Has to be called by the sending thread.
+ *
+ * return: number of destinations that lost a packet of the device
+ */
+unsigned nw_take_losses(uint8_t, bool *);
+
+/**
+ * Get the number of send syscalls (sendmmsg(), send(), poll()) issued by nw_send(), the sends of the
+ * io_uring backend are submitted by the main loop (see loop_get_syscalls())
+ *
+ * return: number of syscalls
+ */
+unsigned long nw_get_syscalls(void);
+
+/**
+ * Get the generation of the destination set (changes whenever a server was found, moved or removed)
+ * and the wire formats supported by every server (bitmask of WIRE_FORMAT_BIT(), protobuf is always included)
+ *
+ * return: true if at least one server is known, false while discovery is pending
+ */
+bool nw_get_destination(unsigned *, unsigned *);
+
+/**
+ * Send a given buffer of given length of the device with the given id over the network to every server of the
+ * destination set (one sendmmsg(),
+ * send() on the connected socket of the low latency profile). If the main loop of the calling thread uses the
+ * io_uring backend the packet is copied and queued instead, it is submitted with the next wait of the loop.
+ * With the low latency profile a packet that is droppable (e.g. joystick only) is dropped if the socket buffer
+ * is full, otherwise the send waits up to NW_BUTTON_WAIT_MS for space.
+ *
+ * Nothing is logged, every failed destination is accounted in the statistics.
+ *
+ * return: 0 if sent, queued or dropped by the drop policy, -ENOTCONN without a server, else -errno of the last failure
+ */
+int nw_send(uint8_t, uint8_t *, unsigned, bool);
+
+/**
+ * Print the startup latency (process start until the receiver is known and until the first packet was sent),
+ * the packet/error/drop counters of every destination, the drop policy counters and the number of answered pings and nacks
+ *
+ * return: void
+ */
+void nw_print_stats(FILE *);
 
 
 #endif /* _network_handling */
\ No newline at end of file
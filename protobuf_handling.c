@@ -2,6 +2,8 @@
 #include <stdio.h> /* stderr */
 #include <errno.h> /* err codes */
 #include <string.h> /* strcpy */
+#include <stdbool.h>
+#include <stdint.h> /* uintptr_t */
 
 #include "event_sender.h"
 #include "protobuf_handling.h"
@@ -11,13 +13,9 @@
 * GLOBAL DATA
 ***********************************************************************************************************************/
 
-// global buffer used to pack protobuf into
-uint8_t g_proto_pack_buff[MAX_UNPACK_BUF_SIZE];
-
-	//TODO: new_nunchuk_protobuf can only be called once, i.e.
-	// there can only be one active protobuf at once.
-	// Also concurrent unpacks will suffer from synchronization issues.
-	// Maybe make unpack buffers associated to a given protobuf.
+// global codec context (pack buffer and unpack arena) used by the functions without a ctx argument
+static proto_ctx_t g_proto_ctx;
+static bool g_proto_ctx_init = false;
 
 
 /***********************************************************************************************************************
@@ -53,6 +51,53 @@ static int __pack_nunchuk_protobuf(NunchukUpdate *msg, uint8_t *buf, unsigned bu
 }
 
 
+/**
+ * ProtobufCAllocator callbacks, bump allocation from the arena of the decode context.
+ * Everything is released at once by resetting the arena after a message was copied out.
+ */
+static void *arena_alloc(void *allocator_data, size_t size)
+{
+	proto_ctx_t *ctx = allocator_data;
+	size_t off = (ctx->arena_used + 15) & ~(size_t)15;
+
+	if (off + size > PROTO_ARENA_SIZE) {
+		ctx->heap_fallbacks++;
+		return malloc(size);
+	}
+
+	ctx->arena_used = off + size;
+
+	return ctx->arena + off;
+}
+
+static void arena_free(void *allocator_data, void *ptr)
+{
+	proto_ctx_t *ctx = allocator_data;
+	uintptr_t p = (uintptr_t)ptr;
+
+	// arena memory is released by arena_reset()
+	if (p >= (uintptr_t)ctx->arena && p < (uintptr_t)(ctx->arena + PROTO_ARENA_SIZE))
+		return;
+
+	free(ptr);
+}
+
+static inline void arena_reset(proto_ctx_t *ctx)
+{
+	ctx->arena_used = 0;
+}
+
+static proto_ctx_t *default_proto_ctx(void)
+{
+	if (!g_proto_ctx_init) {
+		init_proto_ctx(&g_proto_ctx);
+		g_proto_ctx_init = true;
+	}
+
+	return &g_proto_ctx;
+}
+
+
 /***********************************************************************************************************************
 * IMPLEMENTATION OF EXPORTED FUNCTIONS
 ***********************************************************************************************************************/
@@ -122,6 +167,12 @@ void fill_nunchuk_protobuf(nun_stat_t *stat, NunchukUpdate *msg)
 
 	msg->joystick->joy_x = stat->joy_x;
 	msg->joystick->joy_y = stat->joy_y;
+
+	// both stay 0 without timestamps, i.e. they are not encoded at all
+	msg->send_ts_us = stat->send_ts;
+	msg->event_age_us = (stat->send_ts && stat->event_ts) ? stat->send_ts - stat->event_ts : 0;
+	msg->keyframe = stat->keyframe;
+	msg->normalized = stat->normalized;
 }
 
 void fill_stats_from_nunchuk_protobuf(NunchukUpdate *msg, nun_stat_t *stat)
@@ -140,40 +191,180 @@ void fill_stats_from_nunchuk_protobuf(NunchukUpdate *msg, nun_stat_t *stat)
 
 	stat->joy_x = msg->joystick->joy_x;
 	stat->joy_y = msg->joystick->joy_y;
+	stat->send_ts = msg->send_ts_us;
+	stat->event_ts = msg->send_ts_us ? msg->send_ts_us - msg->event_age_us : 0;
+	stat->dev_id = msg->device_id;
+	stat->seq = msg->seq;
+	stat->keyframe = msg->keyframe;
+	stat->normalized = msg->normalized;
+}
+
+int pack_nunchuk_protobuf(NunchukUpdate *msg, uint8_t **buf, unsigned *buflen)
+{
+	return pack_nunchuk_protobuf_ctx(default_proto_ctx(), msg, buf, buflen);
 }
 
 /**
- * wrapper for __pack_nunchuk_protobuf, uses a global unpack buffer that is returned.
+ * wrapper for __pack_nunchuk_protobuf, uses the pack buffer of the context that is returned.
  * By this, the user does not need to determine the size of the buffer and preallocate it himself.
  */
-int pack_nunchuk_protobuf(NunchukUpdate *msg, uint8_t **buf, unsigned *buflen)
+int pack_nunchuk_protobuf_ctx(proto_ctx_t *ctx, NunchukUpdate *msg, uint8_t **buf, unsigned *buflen)
 {
 	int len = nunchuk_update__get_packed_size(msg);
 
+	if (len > MAX_UNPACK_BUF_SIZE) {
+		fprintf(stderr, "Buffer has wrong length (is %d, should be %d)!\n", MAX_UNPACK_BUF_SIZE, len);
+		return -EINVAL;
+	}
+
 	// return buffer and its current length via argument ptrs
 	*buflen = len;
-	*buf = g_proto_pack_buff;
+	*buf = ctx->pack_buf;
 
 	/* dbg */
 	// printf("Packing probuf, size %d\n", len);
 
-	return __pack_nunchuk_protobuf(msg, g_proto_pack_buff, len);
+	return __pack_nunchuk_protobuf(msg, ctx->pack_buf, len);
+}
+
+void init_proto_ctx(proto_ctx_t *ctx)
+{
+	ctx->arena_used = 0;
+	ctx->heap_fallbacks = 0;
+	ctx->allocator.alloc = arena_alloc;
+	ctx->allocator.free = arena_free;
+	ctx->allocator.allocator_data = ctx;
 }
 
 int unpack_nunchuk_protobuf(uint8_t *buf, unsigned len, nun_stat_t *stat)
 {
-	// de-serialize the buffer again, protobuf is allocated by unpack func
-	NunchukUpdate *new_msg = nunchuk_update__unpack(NULL, len, buf); // use default allocator
+	return unpack_nunchuk_protobuf_ctx(default_proto_ctx(), buf, len, stat);
+}
+
+int unpack_nunchuk_protobuf_ctx(proto_ctx_t *ctx, uint8_t *buf, unsigned len, nun_stat_t *stat)
+{
+	// de-serialize the buffer again, protobuf is allocated from the arena by the unpack func
+	NunchukUpdate *new_msg = nunchuk_update__unpack(&ctx->allocator, len, buf);
 	if (!new_msg) {
+		arena_reset(ctx);
 		fprintf(stderr, "Failed to unpack protobuf\n");
 		return -EINVAL;
 	}
 
+	// sub-messages are optional on the wire
+	if (!new_msg->buttons || !new_msg->joystick) {
+		nunchuk_update__free_unpacked(new_msg, &ctx->allocator);
+		arena_reset(ctx);
+		return -EINVAL;
+	}
+
 	// copy content to 'stat' struct
 	fill_stats_from_nunchuk_protobuf(new_msg, stat);
 
-	// free the allocated protobuf
-	nunchuk_update__free_unpacked(new_msg, NULL); // use default allocator
+	// only heap fallbacks are actually freed, then the whole arena is released
+	nunchuk_update__free_unpacked(new_msg, &ctx->allocator);
+	arena_reset(ctx);
+
+	return 0;
+}
+
+unsigned unpack_nunchuk_protobuf_bulk(proto_ctx_t *ctx, uint8_t **bufs, unsigned *lens, unsigned n, nun_stat_t *stats,
+	int *rcs)
+{
+	int rc;
+	unsigned i, ok = 0;
+
+	for (i = 0; i < n; i++) {
+		rc = unpack_nunchuk_protobuf_ctx(ctx, bufs[i], lens[i], &stats[i]);
+		if (rc)
+			stats[i] = (nun_stat_t)NUN_STAT_NEUTRAL;
+		else
+			ok++;
+		if (rcs)
+			rcs[i] = rc;
+	}
+
+	return ok;
+}
+
+void fill_nunchuk_protobuf_v2(nun_stat_t *stat, NunchukUpdateV2 *msg)
+{
+	msg->version = NUNCHUK_UPDATE_V2_VERSION;
+	msg->buttons = BUT_BITS_PACK(stat->but_c, stat->but_z);
+	msg->joy_x = stat->joy_x;
+	msg->joy_y = stat->joy_y;
+	msg->send_ts_us = stat->send_ts;
+	msg->event_age_us = (stat->send_ts && stat->event_ts) ? stat->send_ts - stat->event_ts : 0;
+	msg->keyframe = stat->keyframe;
+	msg->normalized = stat->normalized;
+}
+
+void fill_stats_from_nunchuk_protobuf_v2(NunchukUpdateV2 *msg, nun_stat_t *stat)
+{
+	stat->but_c = BUT_BITS_C(msg->buttons);
+	stat->but_z = BUT_BITS_Z(msg->buttons);
+	stat->joy_x = msg->joy_x;
+	stat->joy_y = msg->joy_y;
+	stat->send_ts = msg->send_ts_us;
+	stat->event_ts = msg->send_ts_us ? msg->send_ts_us - msg->event_age_us : 0;
+	stat->dev_id = msg->device_id;
+	stat->seq = msg->seq;
+	stat->keyframe = msg->keyframe;
+	stat->normalized = msg->normalized;
+}
+
+int pack_nunchuk_protobuf_v2(NunchukUpdateV2 *msg, uint8_t **buf, unsigned *buflen)
+{
+	return pack_nunchuk_protobuf_v2_ctx(default_proto_ctx(), msg, buf, buflen);
+}
+
+int pack_nunchuk_protobuf_v2_ctx(proto_ctx_t *ctx, NunchukUpdateV2 *msg, uint8_t **buf, unsigned *buflen)
+{
+	unsigned len = nunchuk_update_v2__get_packed_size(msg);
+
+	if (len > MAX_UNPACK_BUF_SIZE) {
+		fprintf(stderr, "Buffer has wrong length (is %d, should be %d)!\n", MAX_UNPACK_BUF_SIZE, len);
+		return -EINVAL;
+	}
+
+	// return buffer and its current length via argument ptrs
+	*buflen = len;
+	*buf = ctx->pack_buf;
+
+	// serialize the protobuf
+	if (nunchuk_update_v2__pack(msg, ctx->pack_buf) != len) {
+		fprintf(stderr, "Failed to pack protobuf\n");
+		return -EINVAL;
+	}
 
 	return 0;
 }
+
+int unpack_nunchuk_protobuf_v2(uint8_t *buf, unsigned len, nun_stat_t *stat)
+{
+	return unpack_nunchuk_protobuf_v2_ctx(default_proto_ctx(), buf, len, stat);
+}
+
+int unpack_nunchuk_protobuf_v2_ctx(proto_ctx_t *ctx, uint8_t *buf, unsigned len, nun_stat_t *stat)
+{
+	int rc = 0;
+
+	// de-serialize the buffer, a v1 message fails here because of the different type of field 1
+	NunchukUpdateV2 *new_msg = nunchuk_update_v2__unpack(&ctx->allocator, len, buf);
+	if (!new_msg) {
+		arena_reset(ctx);
+		fprintf(stderr, "Failed to unpack protobuf\n");
+		return -EINVAL;
+	}
+
+	if (new_msg->version == NUNCHUK_UPDATE_V2_VERSION)
+		fill_stats_from_nunchuk_protobuf_v2(new_msg, stat);
+	else
+		rc = -EPROTO;
+
+	// free the allocated protobuf
+	nunchuk_update_v2__free_unpacked(new_msg, &ctx->allocator);
+	arena_reset(ctx);
+
+	return rc;
+}
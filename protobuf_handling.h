@@ -10,6 +10,29 @@
 *******************************************************************************/
 #define MAX_STR_LEN 512
 #define MAX_UNPACK_BUF_SIZE 128
+#define NUNCHUK_UPDATE_V2_VERSION 2
+#define PROTO_ARENA_SIZE 512 // enough for every sub-message and the query string of one NunchukUpdate
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Codec context, holds the buffer messages are packed into and a bump arena for unpacked messages
+ * that is reset after each message. Allocations that do not fit into the arena fall back to the heap
+ * and are counted. Every user (device, thread) that packs or unpacks concurrently needs its own context.
+ */
+typedef struct
+{
+	uint8_t pack_buf[MAX_UNPACK_BUF_SIZE];
+	_Alignas(16) uint8_t arena[PROTO_ARENA_SIZE];
+	size_t arena_used;
+	ProtobufCAllocator allocator;
+
+	// statistics
+	unsigned long heap_fallbacks;
+} proto_ctx_t;
 
 
 /*******************************************************************************
@@ -34,18 +57,53 @@ void free_nunchuk_protobuf(NunchukUpdate *);
  * Pack a given nunchuk_update protobuf into a buffer.
  * The function takes a pointer to a buffer and pointer to the buffer length as parameters,
  * they are set to the resulting buffer and its length respectively.
+ * Uses a global codec context, see pack_nunchuk_protobuf_ctx() for concurrent use.
  *
  * return: 0 on success, <0 on error
  */
 int pack_nunchuk_protobuf(NunchukUpdate *msg, uint8_t **buf, unsigned *buflen);
 
 /**
- * Unpack a given nunchuk_update protobuf into a pre-allocated nun_stat_t structure
+ * Pack a given nunchuk_update protobuf into the pack buffer of the given codec context,
+ * see pack_nunchuk_protobuf().
+ *
+ * return: 0 on success, <0 on error
+ */
+int pack_nunchuk_protobuf_ctx(proto_ctx_t *, NunchukUpdate *msg, uint8_t **buf, unsigned *buflen);
+
+/**
+ * Unpack a given nunchuk_update protobuf into a pre-allocated nun_stat_t structure.
+ * Uses a global decode context, see unpack_nunchuk_protobuf_ctx() for concurrent use.
  *
  * return: 0 on success, <0 on error
  */
 int unpack_nunchuk_protobuf(uint8_t *, unsigned, nun_stat_t *);
 
+/**
+ * Initialize a codec context, i.e. its arena and the protobuf-c allocator using it
+ *
+ * return: void
+ */
+void init_proto_ctx(proto_ctx_t *);
+
+/**
+ * Unpack a given nunchuk_update protobuf into a pre-allocated nun_stat_t structure
+ * without touching the heap (memory is taken from the arena of the given context)
+ *
+ * return: 0 on success, <0 on error
+ */
+int unpack_nunchuk_protobuf_ctx(proto_ctx_t *, uint8_t *, unsigned, nun_stat_t *);
+
+/**
+ * Unpack N nunchuk_update protobufs (buffers and their lengths given as arrays) into an array
+ * of N pre-allocated nun_stat_t structures, see unpack_nunchuk_protobuf_ctx().
+ * Entries that fail to decode are set to neutral values, the result of every entry is stored
+ * in the optional array 'rcs' (0 or <0, may be NULL).
+ *
+ * return: number of successfully decoded buffers
+ */
+unsigned unpack_nunchuk_protobuf_bulk(proto_ctx_t *, uint8_t **, unsigned *, unsigned, nun_stat_t *, int *);
+
 /**
  * Copy the content of a given nun_stat_t struct into a given (allocated and initialized)
  * nunchuk_update protobuf.
@@ -61,5 +119,51 @@ void fill_nunchuk_protobuf(nun_stat_t *, NunchukUpdate *);
  */
 void fill_stats_from_nunchuk_protobuf(NunchukUpdate *, nun_stat_t *);
 
+/**
+ * Copy the content of a given nun_stat_t struct into a given (initialized) nunchuk_update_v2 protobuf.
+ *
+ * return: void
+ */
+void fill_nunchuk_protobuf_v2(nun_stat_t *, NunchukUpdateV2 *);
+
+/**
+ * Copy the content of a given nunchuk_update_v2 protobuf into a given nun_stat_t struct.
+ *
+ * return: void
+ */
+void fill_stats_from_nunchuk_protobuf_v2(NunchukUpdateV2 *, nun_stat_t *);
+
+/**
+ * Pack a given nunchuk_update_v2 protobuf into a buffer, see pack_nunchuk_protobuf().
+ *
+ * return: 0 on success, <0 on error
+ */
+int pack_nunchuk_protobuf_v2(NunchukUpdateV2 *msg, uint8_t **buf, unsigned *buflen);
+
+/**
+ * Pack a given nunchuk_update_v2 protobuf into the pack buffer of the given codec context,
+ * see pack_nunchuk_protobuf().
+ *
+ * return: 0 on success, <0 on error
+ */
+int pack_nunchuk_protobuf_v2_ctx(proto_ctx_t *, NunchukUpdateV2 *msg, uint8_t **buf, unsigned *buflen);
+
+/**
+ * Unpack a given nunchuk_update_v2 protobuf into a pre-allocated nun_stat_t structure.
+ * Messages of a different version are rejected.
+ * Uses a global decode context, see unpack_nunchuk_protobuf_v2_ctx() for concurrent use.
+ *
+ * return: 0 on success, <0 on error
+ */
+int unpack_nunchuk_protobuf_v2(uint8_t *, unsigned, nun_stat_t *);
+
+/**
+ * Unpack a given nunchuk_update_v2 protobuf without touching the heap (memory is taken from the arena
+ * of the given context), see unpack_nunchuk_protobuf_v2().
+ *
+ * return: 0 on success, <0 on error
+ */
+int unpack_nunchuk_protobuf_v2_ctx(proto_ctx_t *, uint8_t *, unsigned, nun_stat_t *);
+
 
 #endif /* _protobuf_handling */
\ No newline at end of file
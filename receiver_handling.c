@@ -0,0 +1,525 @@
+#define _GNU_SOURCE /* recvmmsg */
+#include <arpa/inet.h>
+#include <stdio.h> /* fprintf */
+#include <string.h> /* strerror, memset */
+#include <unistd.h> /* close */
+#include <errno.h> /* err codes */
+#include <sys/socket.h> /* recvmmsg */
+
+#include "receiver_handling.h"
+#include "network_handling.h"
+#include "compact_handling.h"
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+
+/* first byte of a protobuf: tag of field 1, a varint in NunchukUpdateV2 and a string in NunchukUpdate */
+#define PB_V2_FIRST_BYTE 0x08
+
+/* position of a packet in its stream, see track_seq() */
+typedef enum _seq_order_t{
+	SEQ_NEXT = 0,	// the expected one
+	SEQ_GAP,		// newer than expected, packets in between are missing
+	SEQ_LATE,		// older than expected (late or duplicated)
+	SEQ_START		// first packet of the stream or the sender restarted
+} seq_order_t;
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	int i;
+	uint64_t v = 0;
+
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+
+	return v;
+}
+
+static recv_sender_t *find_sender(receiver_t *r, struct sockaddr_in *addr)
+{
+	unsigned i;
+	recv_sender_t *snd;
+
+	for (i = 0; i < r->num_senders; i++) {
+		snd = &r->senders[i];
+		if (snd->addr.sin_addr.s_addr == addr->sin_addr.s_addr && snd->addr.sin_port == addr->sin_port)
+			return snd;
+	}
+
+	if (r->num_senders == RECV_MAX_SENDERS)
+		return NULL;
+
+	snd = &r->senders[r->num_senders++];
+	memset(snd, 0, sizeof(*snd));
+	snd->addr = *addr;
+	snd->win_rtt_us = UINT64_MAX;
+
+	return snd;
+}
+
+static recv_stream_t *find_stream(receiver_t *r, recv_sender_t *snd, uint8_t dev_id)
+{
+	int i;
+	recv_stream_t *free_stream = NULL;
+
+	for (i = 0; i < RECV_MAX_STREAMS; i++) {
+		if (r->streams[i].sender == snd && r->streams[i].dev_id == dev_id)
+			return &r->streams[i];
+		if (!r->streams[i].sender && !free_stream)
+			free_stream = &r->streams[i];
+	}
+
+	if (free_stream) {
+		memset(free_stream, 0, sizeof(*free_stream));
+		free_stream->sender = snd;
+		free_stream->dev_id = dev_id;
+		free_stream->state = (nun_stat_t)NUN_STAT_NEUTRAL;
+	}
+
+	return free_stream;
+}
+
+/**
+ * Account the sequence number of a packet. A gap counts its packets as lost, a packet that arrives
+ * after a newer one is counted as reordered and no longer as lost. Sequence numbers are 16 bit and wrap.
+ *
+ * return: position of the packet in the stream
+ */
+static seq_order_t track_seq(recv_stream_t *s, uint16_t seq)
+{
+	int16_t d = seq - s->next_seq;
+	seq_order_t order = SEQ_NEXT;
+
+	if (!s->packets++) {
+		order = SEQ_START;
+	} else if (d) {
+		if (d < -RECV_SEQ_RESTART) {
+			s->restarts++;
+			order = SEQ_START;
+		} else if (d < 0) {
+			// the expected sequence number is kept
+			s->reordered++;
+			if (s->lost)
+				s->lost--;
+			return SEQ_LATE;
+		} else {
+			s->lost += d;
+			order = SEQ_GAP;
+		}
+	}
+
+	s->next_seq = seq + 1;
+
+	return order;
+}
+
+/**
+ * Apply an update to the reconstructed state of its stream. A keyframe replaces the state, a change is
+ * merged into it. A late packet is ignored, the state already contains newer values.
+ */
+static void apply_update(receiver_t *r, recv_stream_t *s, nun_stat_t *stat, seq_order_t order, uint64_t now)
+{
+	if (order == SEQ_LATE)
+		return;
+
+	if (stat->keyframe) {
+		s->keyframes++;
+		s->state = *stat;
+		if (s->stale)
+			hist_add(&r->recover_us, now - s->stale_since_us);
+		s->stale = false;
+		return;
+	}
+
+	if (stat->joy_x != JOY_NO_CHANGE)
+		s->state.joy_x = stat->joy_x;
+	if (stat->joy_y != JOY_NO_CHANGE)
+		s->state.joy_y = stat->joy_y;
+	if (stat->but_c != BUT_KEEP)
+		s->state.but_c = stat->but_c;
+	if (stat->but_z != BUT_KEEP)
+		s->state.but_z = stat->but_z;
+	s->state.event_ts = stat->event_ts;
+	s->state.send_ts = stat->send_ts;
+	s->state.seq = stat->seq;
+	s->state.keyframe = false;
+	s->state.normalized = stat->normalized;
+
+	// the changes of the missing packets are unknown, e.g. a lost button release
+	if (order != SEQ_NEXT && !s->stale) {
+		s->stale = true;
+		s->stale_since_us = now;
+		s->stale_periods++;
+	}
+}
+
+/* request a keyframe for a stale stream, repeated until it arrives (the nack or the keyframe may be lost) */
+static void request_keyframe(receiver_t *r, recv_stream_t *s, uint64_t now)
+{
+	uint8_t buf[NW_NACK_LEN];
+
+	if (!s->stale || now - s->last_nack_us < RECV_NACK_INTERVAL_MS * 1000)
+		return;
+
+	buf[0] = NW_CTRL_NACK;
+	buf[1] = s->dev_id;
+	if (sendto(r->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&s->sender->addr,
+		sizeof(s->sender->addr)) == sizeof(buf))
+		s->nacks++;
+	s->last_nack_us = now;
+}
+
+/* offset and rtt of a pong, see NW_CTRL_PING. The sample with the smallest rtt is the most accurate one */
+static void handle_pong(recv_sender_t *snd, uint8_t *buf, uint64_t t4)
+{
+	uint64_t t1 = get_le64(&buf[1]);
+	uint64_t t2 = get_le64(&buf[9]);
+	uint64_t t3 = get_le64(&buf[17]);
+	int64_t offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+	uint64_t rtt = (t4 - t1) - (t3 - t2);
+
+	snd->pongs++;
+
+	if (rtt < snd->win_rtt_us) {
+		snd->win_rtt_us = rtt;
+		snd->win_offset_us = offset;
+	}
+
+	// the first sample is used right away, later ones once per report interval
+	if (!snd->synced) {
+		snd->synced = true;
+		snd->offset_us = offset;
+		snd->rtt_us = rtt;
+	}
+}
+
+/**
+ * Detect the wire format of a packet. Compact messages are recognized by their version nibble and
+ * length, protobufs by the type of their first field (the sender always sets the query string of v1).
+ *
+ * return: wire format
+ */
+static wire_format_t detect_format(uint8_t *buf, unsigned len)
+{
+	if ((len == COMPACT_MSG_LEN && (buf[0] >> 4) == COMPACT_VERSION) ||
+		(len == COMPACT_TS_MSG_LEN && (buf[0] >> 4) == COMPACT_VERSION_TS))
+		return WIRE_COMPACT;
+
+	return buf[0] == PB_V2_FIRST_BYTE ? WIRE_PROTOBUF_V2 : WIRE_PROTOBUF;
+}
+
+/**
+ * Decode the first 'n' packets of the recvmmsg() batch into r->stats/rcs/fmts. Compact and v2 packets are
+ * decoded one by one, the protobuf (v1) packets are collected and decoded by one unpack_nunchuk_protobuf_bulk()
+ * call from the arena of the receiver, i.e. without touching the heap. Pongs are left to handle_packet().
+ *
+ * return: void
+ */
+static void decode_batch(receiver_t *r, unsigned n)
+{
+	unsigned i, num_pb = 0, num_dec = 0;
+	uint8_t dev_id;
+	uint16_t seq;
+	uint64_t t0 = stats_now_ns(), avg;
+	uint8_t *pb_bufs[RECV_BATCH_SIZE];
+	unsigned pb_lens[RECV_BATCH_SIZE], pb_idx[RECV_BATCH_SIZE];
+	nun_stat_t pb_stats[RECV_BATCH_SIZE];
+	int pb_rcs[RECV_BATCH_SIZE];
+
+	for (i = 0; i < n; i++) {
+		uint8_t *buf = r->bufs[i];
+		unsigned len = r->msgs[i].msg_len;
+
+		r->rcs[i] = -EINVAL;
+		if (!len || (len == NW_PONG_LEN && buf[0] == NW_CTRL_PONG))
+			continue;
+		num_dec++;
+
+		// fields that are not on the wire keep their default (proto3), e.g. the timestamps
+		r->stats[i] = (nun_stat_t)NUN_STAT_NEUTRAL;
+		r->fmts[i] = detect_format(buf, len);
+		switch (r->fmts[i]) {
+			case WIRE_COMPACT:
+				r->rcs[i] = unpack_nunchuk_compact(buf, len, &r->stats[i], &dev_id, &seq);
+				break;
+			case WIRE_PROTOBUF_V2:
+				r->rcs[i] = unpack_nunchuk_protobuf_v2_ctx(&r->proto_ctx, buf, len, &r->stats[i]);
+				break;
+			default:
+				pb_bufs[num_pb] = buf;
+				pb_lens[num_pb] = len;
+				pb_idx[num_pb++] = i;
+				break;
+		}
+	}
+
+	if (num_pb) {
+		unpack_nunchuk_protobuf_bulk(&r->proto_ctx, pb_bufs, pb_lens, num_pb, pb_stats, pb_rcs);
+		for (i = 0; i < num_pb; i++) {
+			r->stats[pb_idx[i]] = pb_stats[i];
+			r->rcs[pb_idx[i]] = pb_rcs[i];
+		}
+	}
+
+	// the packets of a batch are decoded together, each one is accounted with the average
+	if (!num_dec)
+		return;
+	avg = (stats_now_ns() - t0) / num_dec;
+	for (i = 0; i < num_dec; i++)
+		hist_add(&r->decode_ns, avg);
+}
+
+/* handle the packet with index 'i' of the decoded batch, see decode_batch() */
+static void handle_packet(receiver_t *r, unsigned i, uint64_t t_recv)
+{
+	uint8_t *buf = r->bufs[i];
+	unsigned len = r->msgs[i].msg_len;
+	uint64_t t_sender;
+	nun_stat_t stat = r->stats[i];
+	seq_order_t order;
+	recv_sender_t *snd;
+	recv_stream_t *s;
+
+	snd = find_sender(r, &r->addrs[i]);
+
+	if (len == NW_PONG_LEN && buf[0] == NW_CTRL_PONG) {
+		if (snd)
+			handle_pong(snd, buf, t_recv);
+		return;
+	}
+
+	r->packets++;
+	r->bytes += len;
+
+	if (r->rcs[i]) {
+		r->invalid++;
+		return;
+	}
+	r->formats[r->fmts[i]]++;
+
+	s = snd ? find_stream(r, snd, stat.dev_id) : NULL;
+	if (!s) {
+		r->untracked++;
+		return;
+	}
+	order = track_seq(s, stat.seq);
+	apply_update(r, s, &stat, order, t_recv);
+	request_keyframe(r, s, t_recv);
+
+	// receive time in the clock of the sender, i.e. comparable to its timestamps
+	if (snd->synced && stat.send_ts) {
+		t_sender = t_recv + snd->offset_us;
+		if (t_sender >= stat.event_ts)
+			hist_add(&r->latency_us, t_sender - stat.event_ts);
+		if (t_sender >= stat.send_ts)
+			hist_add(&r->transit_us, t_sender - stat.send_ts);
+	}
+
+	if (r->update_cb)
+		r->update_cb(s, &stat, r->cb_ctx);
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_receiver(receiver_t *r, unsigned port, recv_update_cb_t cb, void *ctx)
+{
+	int i, buf_size = RECV_SOCK_BUF;
+	struct sockaddr_in addr;
+
+	memset(r, 0, sizeof(*r));
+	init_proto_ctx(&r->proto_ctx);
+	init_hist(&r->decode_ns);
+	init_hist(&r->latency_us);
+	init_hist(&r->transit_us);
+	init_hist(&r->recover_us);
+	r->update_cb = cb;
+	r->cb_ctx = ctx;
+	r->last_report_us = stats_now_us();
+
+	// the headers of the batch are set up once, recvmmsg() only updates the lengths
+	for (i = 0; i < RECV_BATCH_SIZE; i++) {
+		r->iovs[i].iov_base = r->bufs[i];
+		r->iovs[i].iov_len = RECV_BUF_LEN;
+		r->msgs[i].msg_hdr.msg_iov = &r->iovs[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+		r->msgs[i].msg_hdr.msg_name = &r->addrs[i];
+	}
+
+	r->fd = socket(AF_INET, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (r->fd < 0) {
+		fprintf(stderr, "Could not create socket (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	// not fatal, the kernel limit (rmem_max) may be lower
+	if (setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size)))
+		fprintf(stderr, "Could not set the receive buffer size (%s)\n", strerror(errno));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(r->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Could not bind to port %u (%s)\n", port, strerror(errno));
+		close(r->fd);
+		r->fd = -1;
+		return -errno;
+	}
+
+	return 0;
+}
+
+void teardown_receiver(receiver_t *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+
+	r->fd = -1;
+}
+
+int receiver_read(receiver_t *r)
+{
+	int i, n;
+	uint64_t t_recv;
+
+	while (1) {
+		for (i = 0; i < RECV_BATCH_SIZE; i++)
+			r->msgs[i].msg_hdr.msg_namelen = sizeof(r->addrs[i]);
+
+		// one syscall fetches all pending packets (up to the batch size)
+		n = recvmmsg(r->fd, r->msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Could not receive packets (%s)\n", strerror(errno));
+			return -errno;
+		}
+
+		// one receive time for the whole batch, the packets were queued by the kernel meanwhile anyway
+		t_recv = stats_now_us();
+		r->batches++;
+		if (n > r->max_batch)
+			r->max_batch = n;
+
+		decode_batch(r, n);
+		for (i = 0; i < n; i++)
+			handle_packet(r, i, t_recv);
+
+		// a partially filled batch means the socket buffer is drained, saves the final -EAGAIN call
+		if (n < RECV_BATCH_SIZE)
+			return 0;
+	}
+}
+
+void receiver_ping(receiver_t *r)
+{
+	unsigned i;
+	uint8_t buf[NW_PING_LEN];
+
+	for (i = 0; i < r->num_senders; i++) {
+		buf[0] = NW_CTRL_PING;
+		put_le64(&buf[1], stats_now_us());
+
+		// a lost ping or pong only costs one sample
+		sendto(r->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&r->senders[i].addr, sizeof(r->senders[i].addr));
+	}
+}
+
+void receiver_print_interval(receiver_t *r, FILE *f)
+{
+	unsigned i;
+	uint64_t now = stats_now_us();
+	double sec = (now - r->last_report_us) / 1e6;
+	unsigned long lost = 0, reordered = 0;
+	recv_sender_t *snd;
+
+	for (i = 0; i < RECV_MAX_STREAMS; i++) {
+		lost += r->streams[i].lost;
+		reordered += r->streams[i].reordered;
+	}
+
+	if (sec > 0)
+		fprintf(f, "Receiver: %.0f packets/s, %.1f kB/s, %lu lost, %lu reordered\n",
+			(r->packets - r->last_packets) / sec, (r->bytes - r->last_bytes) / sec / 1e3,
+			lost - r->last_lost, reordered - r->last_reordered);
+
+	r->last_report_us = now;
+	r->last_packets = r->packets;
+	r->last_bytes = r->bytes;
+	r->last_lost = lost;
+	r->last_reordered = reordered;
+
+	// the clocks drift, i.e. the offset follows the best sample of every interval
+	for (i = 0; i < r->num_senders; i++) {
+		snd = &r->senders[i];
+		if (snd->win_rtt_us == UINT64_MAX)
+			continue;
+		snd->offset_us = snd->win_offset_us;
+		snd->rtt_us = snd->win_rtt_us;
+		snd->win_rtt_us = UINT64_MAX;
+	}
+}
+
+void receiver_print_stats(receiver_t *r, FILE *f)
+{
+	unsigned i;
+	char ip[INET_ADDRSTRLEN];
+	recv_stream_t *s;
+	recv_sender_t *snd;
+
+	fprintf(f, "Receiver: %lu packets (%lu bytes) in %lu batches (%.1f packets/batch, max %lu), %lu invalid, %lu untracked\n",
+		r->packets, r->bytes, r->batches, r->batches ? (double)r->packets / r->batches : 0.0,
+		r->max_batch, r->invalid, r->untracked);
+	fprintf(f, "Receiver: formats protobuf %lu, compact %lu, protobuf2 %lu, %lu protobuf heap fallbacks\n",
+		r->formats[WIRE_PROTOBUF], r->formats[WIRE_COMPACT], r->formats[WIRE_PROTOBUF_V2],
+		r->proto_ctx.heap_fallbacks);
+
+	for (i = 0; i < r->num_senders; i++) {
+		snd = &r->senders[i];
+		inet_ntop(AF_INET, &snd->addr.sin_addr, ip, sizeof(ip));
+		if (snd->synced)
+			fprintf(f, "Sender %s:%u: clock offset %lld us (rtt %llu us, %lu pongs)\n",
+				ip, ntohs(snd->addr.sin_port), (long long)snd->offset_us,
+				(unsigned long long)snd->rtt_us, snd->pongs);
+		else
+			fprintf(f, "Sender %s:%u: clock offset unknown\n", ip, ntohs(snd->addr.sin_port));
+	}
+
+	for (i = 0; i < RECV_MAX_STREAMS; i++) {
+		s = &r->streams[i];
+		if (!s->sender)
+			continue;
+		inet_ntop(AF_INET, &s->sender->addr.sin_addr, ip, sizeof(ip));
+		fprintf(f, "Stream %s:%u device %u: %lu packets, %lu lost (%.3f%%), %lu reordered, %lu restarts\n",
+			ip, ntohs(s->sender->addr.sin_port), s->dev_id, s->packets, s->lost,
+			s->packets + s->lost ? 100.0 * s->lost / (s->packets + s->lost) : 0.0,
+			s->reordered, s->restarts);
+		fprintf(f, "Stream %s:%u device %u: %lu keyframes, %lu times stale, %lu nacks, state %s\n",
+			ip, ntohs(s->sender->addr.sin_port), s->dev_id, s->keyframes, s->stale_periods, s->nacks,
+			s->stale ? "stale" : "valid");
+	}
+
+	hist_print(&r->decode_ns, "Receiver: decode time", "ns", f);
+	hist_print(&r->latency_us, "Receiver: event->receive latency", "us", f);
+	hist_print(&r->transit_us, "Receiver: send->receive latency", "us", f);
+	hist_print(&r->recover_us, "Receiver: stale->keyframe recovery", "us", f);
+}
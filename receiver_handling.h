@@ -0,0 +1,175 @@
+#ifndef _receiver_handling
+#define _receiver_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <sys/socket.h> /* struct mmsghdr, needs _GNU_SOURCE in the including file */
+
+#include "event_sender.h"
+#include "protobuf_handling.h"
+#include "stats_handling.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define RECV_BATCH_SIZE 32 // max number of packets fetched by one recvmmsg()
+#define RECV_BUF_LEN MAX_UNPACK_BUF_SIZE
+#define RECV_SOCK_BUF (1 << 20) // socket receive buffer, absorbs bursts of a load test
+#define RECV_MAX_SENDERS 8
+#define RECV_MAX_STREAMS 32 // one per sender and device id
+#define RECV_SEQ_RESTART 1024 // a sequence number that far behind means the sender restarted
+#define RECV_NACK_INTERVAL_MS 20 // min time between two keyframe requests of a stream with a stale state
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/* a sender address, updates are received from it and its clock offset is tracked via ping/pong */
+typedef struct
+{
+	struct sockaddr_in addr;
+
+	// clock offset (sender minus receiver clock) of the sample with the smallest rtt
+	bool synced;
+	int64_t offset_us;
+	uint64_t rtt_us;
+	int64_t win_offset_us; // best sample of the current report interval
+	uint64_t win_rtt_us; // UINT64_MAX if there is none
+	unsigned long pongs;
+} recv_sender_t;
+
+/**
+ * The packets of one device of a sender, loss and reordering are derived from the sequence numbers.
+ * The state of the device is reconstructed from the packets: keyframes set it, the changes in between
+ * are applied in order. After a gap (or if the stream started with a change) the state is stale, a nack
+ * requests a keyframe from the sender (at most every RECV_NACK_INTERVAL_MS until it arrives).
+ */
+typedef struct
+{
+	recv_sender_t *sender; // NULL if unused
+	uint8_t dev_id;
+	uint16_t next_seq;
+
+	nun_stat_t state; // JOY_NO_CHANGE/BUT_KEEP for values that are not known yet
+	bool stale; // a change may be missing, the state is valid again with the next keyframe
+	uint64_t stale_since_us;
+	uint64_t last_nack_us;
+
+	// statistics
+	unsigned long packets;
+	unsigned long lost; // gaps in the sequence, late packets are subtracted again
+	unsigned long reordered; // packets older than the expected one (late or duplicated)
+	unsigned long restarts;
+	unsigned long keyframes;
+	unsigned long stale_periods;
+	unsigned long nacks;
+} recv_stream_t;
+
+/**
+ * Handler that is called for every decoded update. Arguments are the stream of the update (with the
+ * reconstructed state), the update (sender timestamps, device id, sequence number and keyframe flag included)
+ * and the registered context.
+ */
+typedef void (*recv_update_cb_t)(recv_stream_t *, nun_stat_t *, void *);
+
+typedef struct
+{
+	int fd;
+	proto_ctx_t proto_ctx;
+	recv_update_cb_t update_cb;
+	void *cb_ctx;
+
+	// recvmmsg() batch, the headers point to the buffers and addresses below
+	struct mmsghdr msgs[RECV_BATCH_SIZE];
+	struct iovec iovs[RECV_BATCH_SIZE];
+	struct sockaddr_in addrs[RECV_BATCH_SIZE];
+	uint8_t bufs[RECV_BATCH_SIZE][RECV_BUF_LEN];
+
+	// decoded batch, see decode_batch()
+	nun_stat_t stats[RECV_BATCH_SIZE];
+	int rcs[RECV_BATCH_SIZE]; // result of the decode, <0 if the packet is invalid
+	wire_format_t fmts[RECV_BATCH_SIZE];
+
+	recv_sender_t senders[RECV_MAX_SENDERS];
+	unsigned num_senders;
+	recv_stream_t streams[RECV_MAX_STREAMS];
+
+	// statistics
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long batches;
+	unsigned long max_batch;
+	unsigned long invalid; // undecodable packets
+	unsigned long untracked; // packets of senders/devices beyond the table sizes
+	unsigned long formats[WIRE_NUM_FORMATS];
+	hist_t decode_ns; // decode time per packet in ns (average of its batch)
+	hist_t latency_us; // kernel timestamp of the event group until the packet was received (sender clock)
+	hist_t transit_us; // send timestamp until the packet was received (sender clock)
+	hist_t recover_us; // a stream became stale until its next keyframe arrived
+
+	// totals at the last report, for the rates of the interval
+	uint64_t last_report_us;
+	unsigned long last_packets;
+	unsigned long last_bytes;
+	unsigned long last_lost;
+	unsigned long last_reordered;
+} receiver_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Initialize the receiver and bind its (non-blocking) UDP socket to the given port on all interfaces.
+ * The given handler (may be NULL) is called for every decoded update.
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_receiver(receiver_t *, unsigned, recv_update_cb_t, void *);
+
+/**
+ * Close the socket of a receiver initialized by init_receiver()
+ *
+ * return: void
+ */
+void teardown_receiver(receiver_t *);
+
+/**
+ * Receive all pending packets in batches of RECV_BATCH_SIZE and decode them, the wire format is
+ * detected per packet and the protobuf (v1) packets of a batch are decoded together by
+ * unpack_nunchuk_protobuf_bulk(). Returns once the socket buffer is drained.
+ *
+ * return: 0 on success, <0 on error
+ */
+int receiver_read(receiver_t *);
+
+/**
+ * Send a ping to every known sender, its pong updates the clock offset of the sender (see NW_CTRL_PING).
+ * Event->receive latency is only recorded for senders with a known offset.
+ *
+ * return: void
+ */
+void receiver_ping(receiver_t *);
+
+/**
+ * Print packets/s, throughput, loss and reordering since the last call in one line and
+ * switch to the best clock offset sample of the interval
+ *
+ * return: void
+ */
+void receiver_print_interval(receiver_t *, FILE *);
+
+/**
+ * Print the totals, the statistics of every stream and the decode time, latency and recovery distributions
+ *
+ * return: void
+ */
+void receiver_print_stats(receiver_t *, FILE *);
+
+
+#endif /* _receiver_handling */
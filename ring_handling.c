@@ -0,0 +1,306 @@
+#include <stdio.h> /* fprintf */
+#include <string.h> /* strerror, memset */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* write, close */
+#include <sys/eventfd.h> /* eventfd */
+
+#include "ring_handling.h"
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define RING_MASK (RING_SIZE - 1)
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static void signal_efd(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "Failed to signal eventfd (%s)\n", strerror(errno));
+}
+
+/* merge a newer record into an older one of the same device, newer values win */
+static void merge_rec(ring_t *ring, ring_rec_t *old, ring_rec_t *new)
+{
+	if (new->stat.but_c != BUT_KEEP) {
+		if (old->stat.but_c != BUT_KEEP && old->stat.but_c != new->stat.but_c)
+			ring->lost_transitions++;
+		old->stat.but_c = new->stat.but_c;
+	}
+	if (new->stat.but_z != BUT_KEEP) {
+		if (old->stat.but_z != BUT_KEEP && old->stat.but_z != new->stat.but_z)
+			ring->lost_transitions++;
+		old->stat.but_z = new->stat.but_z;
+	}
+	if (new->stat.joy_x != JOY_NO_CHANGE)
+		old->stat.joy_x = new->stat.joy_x;
+	if (new->stat.joy_y != JOY_NO_CHANGE)
+		old->stat.joy_y = new->stat.joy_y;
+	// the merged record holds the complete state as well
+	old->stat.keyframe |= new->stat.keyframe;
+
+	ring->coalesced++;
+}
+
+/* hold a record of the device back until a slot is free, see ring_flush_staged() */
+static void stage_rec(ring_t *ring, unsigned dev, ring_rec_t *rec)
+{
+	ring->staged[dev] = *rec;
+	ring->staged_valid[dev] = true;
+	ring->num_staged++;
+}
+
+/* true if a queued record of the device that is newer than the slot 'from' carries the field */
+static bool superseded(ring_t *ring, unsigned long from, uint8_t dev_id, bool (*has)(nun_stat_t *))
+{
+	unsigned long i, t = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	for (i = from + 1; i != t; i++)
+		if (ring->recs[i & RING_MASK].dev_id == dev_id && has(&ring->recs[i & RING_MASK].stat))
+			return true;
+
+	return false;
+}
+
+static bool has_but_c(nun_stat_t *s) { return s->but_c != BUT_KEEP; }
+static bool has_but_z(nun_stat_t *s) { return s->but_z != BUT_KEEP; }
+static bool has_joy_x(nun_stat_t *s) { return s->joy_x != JOY_NO_CHANGE; }
+static bool has_joy_y(nun_stat_t *s) { return s->joy_y != JOY_NO_CHANGE; }
+
+/**
+ * Fold a record that was dropped from slot 'h' (RING_DROP_OLDEST) into the staged record of its device.
+ * The dropped record is older than every queued and staged record of the device, i.e. a value only survives
+ * if none of them carries the field: a stale axis value is simply gone, an overwritten button transition is
+ * counted as lost. The keyframe flag always survives, the consumer then sends the complete state.
+ */
+static void fold_dropped(ring_t *ring, unsigned long h, ring_rec_t *old)
+{
+	unsigned dev = old->dev_id % RING_MAX_DEVS;
+	ring_rec_t rec = *old;
+	nun_stat_t *s = &ring->staged[dev].stat, *o = &old->stat, *r = &rec.stat;
+	bool valid = ring->staged_valid[dev];
+
+	ring->dropped++;
+
+	// the values that survive, the staged record (if any) is newer
+	if (has_but_c(o) && ((valid && has_but_c(s)) || superseded(ring, h, old->dev_id, has_but_c))) {
+		r->but_c = BUT_KEEP;
+		ring->lost_transitions++;
+	}
+	if (has_but_z(o) && ((valid && has_but_z(s)) || superseded(ring, h, old->dev_id, has_but_z))) {
+		r->but_z = BUT_KEEP;
+		ring->lost_transitions++;
+	}
+	if (has_joy_x(o) && ((valid && has_joy_x(s)) || superseded(ring, h, old->dev_id, has_joy_x)))
+		r->joy_x = JOY_NO_CHANGE;
+	if (has_joy_y(o) && ((valid && has_joy_y(s)) || superseded(ring, h, old->dev_id, has_joy_y)))
+		r->joy_y = JOY_NO_CHANGE;
+
+	if (!has_but_c(r) && !has_but_z(r) && !has_joy_x(r) && !has_joy_y(r) && !r->keyframe)
+		return;
+
+	if (!valid) {
+		stage_rec(ring, dev, &rec);
+		return;
+	}
+
+	if (has_but_c(r))
+		s->but_c = r->but_c;
+	if (has_but_z(r))
+		s->but_z = r->but_z;
+	if (has_joy_x(r))
+		s->joy_x = r->joy_x;
+	if (has_joy_y(r))
+		s->joy_y = r->joy_y;
+	s->keyframe |= r->keyframe;
+}
+
+/**
+ * Drop oldest: the producer claims the oldest record by advancing head, exactly like a pop.
+ * If the CAS fails the consumer popped it meanwhile, in both cases there is a free slot now.
+ * The slot is only overwritten after the claim, i.e. a consumer that copied it concurrently
+ * fails its own CAS and discards the copy. A claimed record is folded into the staged record of its device.
+ */
+static void drop_oldest(ring_t *ring)
+{
+	unsigned long h = atomic_load(&ring->head);
+	ring_rec_t old = ring->recs[h & RING_MASK];
+
+	if (atomic_compare_exchange_strong(&ring->head, &h, h + 1))
+		fold_dropped(ring, h, &old);
+}
+
+/**
+ * Put a record into a free slot and publish it to the consumer
+ *
+ * return: true if the record was queued, false if the ring is full
+ */
+static bool enqueue(ring_t *ring, ring_rec_t *rec)
+{
+	unsigned long t = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned long h = atomic_load_explicit(&ring->head, memory_order_acquire);
+	unsigned long depth = t - h;
+
+	if (depth == RING_SIZE)
+		return false;
+
+	ring->recs[t & RING_MASK] = *rec;
+	atomic_store_explicit(&ring->tail, t + 1, memory_order_release);
+
+	ring->pushed++;
+	ring->depth_sum += depth + 1;
+	if (depth + 1 > ring->max_depth)
+		ring->max_depth = depth + 1;
+
+	// wake the consumer only if it announced to sleep, saves a syscall per record otherwise
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&ring->consumer_waiting, false))
+		signal_efd(ring->efd);
+
+	return true;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_ring(ring_t *ring, ring_policy_t policy)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->policy = policy;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->consumer_waiting, false);
+	atomic_init(&ring->producer_waiting, false);
+
+	ring->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ring->space_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ring->efd < 0 || ring->space_efd < 0) {
+		fprintf(stderr, "Failed to create ring eventfds (%s)\n", strerror(errno));
+		teardown_ring(ring);
+		return -errno;
+	}
+
+	return 0;
+}
+
+void teardown_ring(ring_t *ring)
+{
+	if (ring->efd >= 0)
+		close(ring->efd);
+	if (ring->space_efd >= 0)
+		close(ring->space_efd);
+
+	ring->efd = -1;
+	ring->space_efd = -1;
+}
+
+void ring_push(ring_t *ring, ring_rec_t *rec)
+{
+	unsigned dev = rec->dev_id % RING_MAX_DEVS;
+
+	// staged records are older than the new one, keep the order per device
+	ring_flush_staged(ring);
+
+	if (ring->staged_valid[dev])
+		merge_rec(ring, &ring->staged[dev], rec);
+	else if (enqueue(ring, rec))
+		return;
+	else
+		stage_rec(ring, dev, rec);
+
+	/**
+	 * The ring is full. Drop oldest: the oldest record gives up its slot to the (staged) new one, the values
+	 * of the dropped record that are still the latest ones of its device stay staged (see fold_dropped()).
+	 */
+	if (ring->policy == RING_DROP_OLDEST) {
+		drop_oldest(ring);
+		if (ring->staged_valid[dev] && enqueue(ring, &ring->staged[dev])) {
+			ring->staged_valid[dev] = false;
+			ring->num_staged--;
+		}
+	}
+
+	// announces the staged records, the consumer may have freed a slot meanwhile
+	ring_flush_staged(ring);
+}
+
+void ring_flush_staged(ring_t *ring)
+{
+	unsigned i;
+
+	if (!ring->num_staged)
+		return;
+
+	// announce first, a slot freed after a failed enqueue below then triggers a wakeup
+	atomic_store(&ring->producer_waiting, true);
+
+	for (i = 0; i < RING_MAX_DEVS; i++) {
+		if (!ring->staged_valid[i])
+			continue;
+		if (!enqueue(ring, &ring->staged[i]))
+			break;
+		ring->staged_valid[i] = false;
+		ring->num_staged--;
+	}
+
+	if (!ring->num_staged)
+		atomic_store(&ring->producer_waiting, false);
+}
+
+bool ring_pop(ring_t *ring, ring_rec_t *rec)
+{
+	unsigned long t, h = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	do {
+		t = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (h == t)
+			return false;
+
+		*rec = ring->recs[h & RING_MASK];
+
+		// claim the record, fails if the producer dropped it meanwhile (h is reloaded)
+	} while (!atomic_compare_exchange_weak(&ring->head, &h, h + 1));
+
+	ring->popped++;
+
+	// the producer holds staged records and waits for a free slot
+	if (atomic_load_explicit(&ring->producer_waiting, memory_order_relaxed) &&
+		atomic_exchange(&ring->producer_waiting, false))
+		signal_efd(ring->space_efd);
+
+	return true;
+}
+
+bool ring_prepare_sleep(ring_t *ring)
+{
+	unsigned long h, t;
+
+	atomic_store(&ring->consumer_waiting, true);
+
+	// a record pushed before the announcement would not trigger a wakeup, so check again
+	h = atomic_load(&ring->head);
+	t = atomic_load(&ring->tail);
+	if (h != t) {
+		atomic_store(&ring->consumer_waiting, false);
+		return false;
+	}
+
+	ring->consumer_wakeups++;
+
+	return true;
+}
+
+void ring_print_stats(ring_t *ring, FILE *f)
+{
+	fprintf(f, "Ring: input stage pushed %lu records (avg depth %.2f, max depth %lu/%d), %lu dropped (folded), %lu coalesced (%lu transitions lost)\n",
+		ring->pushed, ring->pushed ? (double)ring->depth_sum / ring->pushed : 0.0,
+		ring->max_depth, RING_SIZE, ring->dropped, ring->coalesced, ring->lost_transitions);
+	fprintf(f, "Ring: network stage popped %lu records, slept %lu times\n",
+		ring->popped, ring->consumer_wakeups);
+}
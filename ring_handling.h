@@ -0,0 +1,129 @@
+#ifndef _ring_handling
+#define _ring_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "event_sender.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define RING_SIZE 64 // has to be a power of 2
+#define RING_MAX_DEVS 16
+#define RING_CACHE_LINE 64
+
+/* overflow policy, applied by the producer if the ring is full */
+typedef enum _ring_policy_t{
+	RING_DROP_OLDEST = 0,	// the oldest queued record gives up its slot, its still valid values are staged
+	RING_COALESCE			// the record is merged into a staged record of its device
+} ring_policy_t;
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+typedef struct
+{
+	uint8_t dev_id;
+	nun_stat_t stat;
+} ring_rec_t;
+
+/**
+ * Lock-free single-producer/single-consumer ring of ring_rec_t.
+ * The consumer is woken via 'efd' (eventfd) if it announced to sleep, the producer is woken
+ * via 'space_efd' if it holds staged records (RING_COALESCE) and the consumer freed a slot.
+ */
+typedef struct
+{
+	ring_rec_t recs[RING_SIZE];
+	ring_policy_t policy;
+	int efd;
+	int space_efd;
+
+	_Alignas(RING_CACHE_LINE) atomic_ulong head; // next record to pop
+	_Alignas(RING_CACHE_LINE) atomic_ulong tail; // next free slot, only written by the producer
+	atomic_bool consumer_waiting;
+	atomic_bool producer_waiting;
+
+	// producer only, records held back until a slot is free (both policies)
+	_Alignas(RING_CACHE_LINE) ring_rec_t staged[RING_MAX_DEVS];
+	bool staged_valid[RING_MAX_DEVS];
+	unsigned num_staged;
+
+	// producer statistics
+	unsigned long pushed;
+	unsigned long dropped; // records that gave up their slot (RING_DROP_OLDEST)
+	unsigned long coalesced;
+	unsigned long lost_transitions; // button transitions overwritten while coalescing or dropping
+	unsigned long max_depth;
+	unsigned long depth_sum;
+
+	// consumer statistics
+	_Alignas(RING_CACHE_LINE) unsigned long popped;
+	unsigned long consumer_wakeups;
+} ring_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Initialize a ring with the given overflow policy, creates the eventfds
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_ring(ring_t *, ring_policy_t);
+
+/**
+ * Teardown a ring initialized by init_ring()
+ *
+ * return: void
+ */
+void teardown_ring(ring_t *);
+
+/**
+ * Producer: queue a record, the overflow policy is applied if the ring is full.
+ * Wakes the consumer if it is sleeping. Records of a device with a staged record are merged into it,
+ * i.e. the order per device is kept.
+ *
+ * return: void
+ */
+void ring_push(ring_t *, ring_rec_t *);
+
+/**
+ * Producer: push staged records into freed slots.
+ * Has to be called when 'space_efd' becomes readable.
+ *
+ * return: void
+ */
+void ring_flush_staged(ring_t *);
+
+/**
+ * Consumer: dequeue the oldest record
+ *
+ * return: true if a record was dequeued, false if the ring is empty
+ */
+bool ring_pop(ring_t *, ring_rec_t *);
+
+/**
+ * Consumer: announce that the consumer goes to sleep on 'efd'.
+ * Has to be called after the ring was drained by ring_pop().
+ *
+ * return: true if the consumer may sleep, false if records arrived meanwhile
+ */
+bool ring_prepare_sleep(ring_t *);
+
+/**
+ * Print producer and consumer statistics (queue depth, drops, coalesced records)
+ *
+ * return: void
+ */
+void ring_print_stats(ring_t *, FILE *);
+
+
+#endif /* _ring_handling */
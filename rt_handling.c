@@ -0,0 +1,181 @@
+#define _GNU_SOURCE /* sched_setaffinity, CPU_SET */
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* strtol */
+#include <string.h> /* memset, strerror */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* read, close, sysconf */
+#include <sched.h> /* sched_setscheduler, sched_setaffinity */
+#include <malloc.h> /* mallopt */
+#include <sys/mman.h> /* mlockall */
+#include <sys/resource.h> /* getrusage */
+#include <sys/timerfd.h> /* timerfd */
+
+#include "rt_handling.h"
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+// read by the hot path of every thread, only written before the threads are started
+static bool g_rt_quiet = false;
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+
+/* touch every page of the stack once, mlockall() keeps them resident afterwards */
+static __attribute__((noinline)) void prefault_stack(void)
+{
+	unsigned i;
+	volatile char stack[RT_STACK_PREFAULT];
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (i = 0; i < sizeof(stack); i += page)
+		stack[i] = 0;
+}
+
+static void get_faults(long *min_flt, long *maj_flt)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	*min_flt = ru.ru_minflt;
+	*maj_flt = ru.ru_majflt;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_rt(rt_t *rt, const char *spec)
+{
+	char *end;
+	cpu_set_t set;
+	struct sched_param param;
+	struct itimerspec its;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->cpu = -1;
+	rt->probe_fd = -1;
+	init_hist(&rt->wakeup_us);
+
+	if (!spec)
+		return 0;
+
+	// "prio[:cpu]"
+	rt->prio = strtol(spec, &end, 0);
+	if (end == spec || (*end && *end != ':'))
+		goto invalid;
+	if (*end) {
+		spec = end + 1;
+		rt->cpu = strtol(spec, &end, 0);
+		if (end == spec || *end || rt->cpu < 0)
+			goto invalid;
+	}
+	if (rt->prio < sched_get_priority_min(SCHED_FIFO) || rt->prio > sched_get_priority_max(SCHED_FIFO)) {
+		fprintf(stderr, "Real-time priority out of range (%d..%d)\n", sched_get_priority_min(SCHED_FIFO),
+			sched_get_priority_max(SCHED_FIFO));
+		return -EINVAL;
+	}
+
+	if (rt->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "Failed to pin to cpu %d (%s)\n", rt->cpu, strerror(errno));
+			return -errno;
+		}
+	}
+
+	/**
+	 * The heap is never trimmed and large blocks are not mmap()ed, i.e. a free() does not give memory back
+	 * that has to be faulted in again by the next allocation.
+	 */
+#ifdef M_MMAP_MAX
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+
+	// every page that is mapped now (buffers, contexts, libraries) or later is resident and stays so
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stderr, "Failed to lock the memory (%s)\n", strerror(errno));
+		return -errno;
+	}
+	prefault_stack();
+
+	param.sched_priority = rt->prio;
+	if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+		fprintf(stderr, "Failed to set SCHED_FIFO priority %d (%s)\n", rt->prio, strerror(errno));
+		return -errno;
+	}
+
+	// absolute expiries, i.e. the latency of every wakeup is measured against its schedule
+	rt->probe_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (rt->probe_fd < 0) {
+		fprintf(stderr, "Failed to create the latency probe (%s)\n", strerror(errno));
+		return -errno;
+	}
+	rt->next_us = stats_now_us() + RT_PROBE_US;
+	its.it_value.tv_sec = rt->next_us / 1000000;
+	its.it_value.tv_nsec = rt->next_us % 1000000 * 1000;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = RT_PROBE_US * 1000;
+	if (timerfd_settime(rt->probe_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		fprintf(stderr, "Failed to start the latency probe (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	get_faults(&rt->min_flt, &rt->maj_flt);
+	rt->enabled = true;
+	g_rt_quiet = true;
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid real-time spec, expected prio[:cpu]\n");
+	return -EINVAL;
+}
+
+void teardown_rt(rt_t *rt)
+{
+	if (rt->probe_fd >= 0)
+		close(rt->probe_fd);
+
+	rt->probe_fd = -1;
+	g_rt_quiet = false;
+}
+
+bool rt_quiet(void)
+{
+	return g_rt_quiet;
+}
+
+int rt_handle_probe(rt_t *rt)
+{
+	uint64_t exp, now = stats_now_us();
+
+	if (read(rt->probe_fd, &exp, sizeof(exp)) != sizeof(exp))
+		return 0;
+
+	// the first expiration of this read is the late one, the others were missed completely
+	hist_add(&rt->wakeup_us, now > rt->next_us ? now - rt->next_us : 0);
+	rt->overruns += exp - 1;
+	rt->next_us += exp * RT_PROBE_US;
+
+	return 0;
+}
+
+void rt_print_stats(rt_t *rt, FILE *f)
+{
+	long min_flt, maj_flt;
+
+	if (!rt->enabled)
+		return;
+
+	get_faults(&min_flt, &maj_flt);
+	fprintf(f, "RT: SCHED_FIFO priority %d, cpu %d, %ld minor and %ld major page faults since the memory was locked\n",
+		rt->prio, rt->cpu, min_flt - rt->min_flt, maj_flt - rt->maj_flt);
+	fprintf(f, "RT: %lu probe periods of %d us missed\n", rt->overruns, RT_PROBE_US);
+	hist_print(&rt->wakeup_us, "RT: loop latency", "us", f);
+}
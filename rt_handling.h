@@ -0,0 +1,85 @@
+#ifndef _rt_handling
+#define _rt_handling
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "stats_handling.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define RT_STACK_PREFAULT (256 * 1024) // stack that is touched once, mlockall() keeps it resident
+#define RT_PROBE_US 1000 // period of the loop latency probe
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Real-time mode: SCHED_FIFO with the given priority, optionally pinned to one cpu, all memory locked and
+ * prefaulted. A periodic timer of the main loop measures how late the loop wakes up (like cyclictest).
+ */
+typedef struct
+{
+	bool enabled;
+	int prio;
+	int cpu; // -1: not pinned
+
+	// loop latency probe
+	int probe_fd; // timerfd, -1 if disabled
+	uint64_t next_us; // expected expiry
+	hist_t wakeup_us; // expiry until the handler runs
+	unsigned long overruns; // expirations that were missed completely
+
+	// page faults since the memory was locked, i.e. on the hot path
+	long min_flt;
+	long maj_flt;
+} rt_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Switch the calling thread into real-time mode from a spec "prio[:cpu]", threads created afterwards inherit
+ * the policy and the affinity. The memory is locked (current and future) and the stack is prefaulted, i.e. it
+ * should be called once every buffer is allocated. Without a spec (NULL) nothing is changed.
+ *
+ * return: 0 on success, <0 on error (invalid spec, missing privileges)
+ */
+int init_rt(rt_t *, const char *);
+
+/**
+ * Close the probe timer
+ *
+ * return: void
+ */
+void teardown_rt(rt_t *);
+
+/**
+ * Check if the real-time mode is active, the hot path does not print (stdio may block) but only counts then
+ *
+ * return: true if active
+ */
+bool rt_quiet(void);
+
+/**
+ * Handle an expiration of the probe timer (registered with the main loop as 'probe_fd')
+ *
+ * return: 0 on success, <0 on error
+ */
+int rt_handle_probe(rt_t *);
+
+/**
+ * Print the scheduling parameters, the page faults since init_rt() and the loop latency distribution
+ *
+ * return: void
+ */
+void rt_print_stats(rt_t *, FILE *);
+
+
+#endif /* _rt_handling */
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE /* memfd_create, accept4 */
+#include <stdio.h> /* fprintf */
+#include <string.h> /* strerror, strncpy, memset */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* close, unlink, ftruncate, write */
+#include <fcntl.h> /* F_ADD_SEALS */
+#include <sys/mman.h> /* memfd_create, mmap */
+#include <sys/stat.h> /* fstat */
+#include <sys/socket.h> /* socket, sendmsg, recvmsg */
+#include <sys/un.h> /* sockaddr_un */
+#include <sys/eventfd.h> /* eventfd */
+
+#include "shm_handling.h"
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define SHM_MEMFD_NAME "nunchuk_state"
+
+
+/***********************************************************************************************************************
+* GLOBAL DATA
+***********************************************************************************************************************/
+static shm_region_t *g_region = NULL;
+static int g_memfd = -1;
+static int g_efd = -1; // wakeup of the readers, -1 if they poll
+static int g_shm_sock = -1;
+static char g_sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// statistics, owned by the publishing thread except 'g_attached' (main loop)
+static unsigned long g_published = 0;
+static unsigned long g_wakeups = 0;
+static unsigned long g_attached = 0;
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static int bind_socket(const char *path)
+{
+	int rc;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Shared memory socket path too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	g_shm_sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (g_shm_sock < 0) {
+		fprintf(stderr, "Could not create shared memory socket (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	// a stale socket of a previous run would make bind() fail
+	unlink(path);
+	if (bind(g_shm_sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(g_shm_sock, SHM_SOCK_BACKLOG)) {
+		rc = -errno;
+		fprintf(stderr, "Could not bind shared memory socket to %s (%s)\n", path, strerror(errno));
+		close(g_shm_sock);
+		g_shm_sock = -1;
+		return rc;
+	}
+	strcpy(g_sock_path, path);
+
+	return 0;
+}
+
+/* hand the memfd and the eventfd to a reader, both fit into one message */
+static int send_fds(int fd)
+{
+	int fds[2] = {g_memfd, g_efd};
+	unsigned num = g_efd >= 0 ? 2 : 1;
+	uint8_t version = SHM_VERSION;
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &version, .iov_len = sizeof(version) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = CMSG_SPACE(num * sizeof(int)) };
+	struct cmsghdr *cmsg;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, num * sizeof(int));
+
+	return sendmsg(fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) == sizeof(version) ? 0 : -errno;
+}
+
+/**
+ * Receive the fds sent by send_fds()
+ *
+ * return: number of received fds, <0 on error
+ */
+static int recv_fds(int fd, int *fds)
+{
+	uint8_t version;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = &version, .iov_len = sizeof(version) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int num;
+
+	len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		return -errno;
+	if (len != sizeof(version))
+		return -EPROTO;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -EPROTO;
+
+	num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), num * sizeof(int));
+
+	if (version != SHM_VERSION || num < 1) {
+		while (num--)
+			close(fds[num]);
+		return -EPROTO;
+	}
+
+	return num;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_shm(const char *path, bool wake)
+{
+	int i, rc;
+
+	// the size is sealed, a reader can rely on it
+	g_memfd = memfd_create(SHM_MEMFD_NAME, MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (g_memfd < 0) {
+		fprintf(stderr, "Could not create shared memory (%s)\n", strerror(errno));
+		return -errno;
+	}
+	if (ftruncate(g_memfd, sizeof(shm_region_t)) ||
+		fcntl(g_memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL)) {
+		rc = -errno;
+		fprintf(stderr, "Could not size shared memory (%s)\n", strerror(errno));
+		teardown_shm();
+		return rc;
+	}
+
+	g_region = mmap(NULL, sizeof(shm_region_t), PROT_READ|PROT_WRITE, MAP_SHARED, g_memfd, 0);
+	if (g_region == MAP_FAILED) {
+		rc = -errno;
+		g_region = NULL;
+		fprintf(stderr, "Could not map shared memory (%s)\n", strerror(errno));
+		teardown_shm();
+		return rc;
+	}
+
+	g_region->magic = SHM_MAGIC;
+	g_region->version = SHM_VERSION;
+	g_region->slot_size = sizeof(shm_slot_t);
+	g_region->num_slots = SHM_MAX_DEVS;
+	for (i = 0; i < SHM_MAX_DEVS; i++) {
+		atomic_init(&g_region->slots[i].seq, 0);
+		g_region->slots[i].state = (nun_stat_t)NUN_STAT_NEUTRAL;
+	}
+
+	if (wake) {
+		g_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (g_efd < 0) {
+			rc = -errno;
+			fprintf(stderr, "Could not create eventfd (%s)\n", strerror(errno));
+			teardown_shm();
+			return rc;
+		}
+	}
+
+	rc = bind_socket(path);
+	if (rc) {
+		teardown_shm();
+		return rc;
+	}
+
+	g_published = g_wakeups = g_attached = 0;
+
+	return 0;
+}
+
+void teardown_shm(void)
+{
+	if (g_shm_sock >= 0) {
+		close(g_shm_sock);
+		unlink(g_sock_path);
+	}
+	if (g_region)
+		munmap(g_region, sizeof(shm_region_t));
+	if (g_memfd >= 0)
+		close(g_memfd);
+	if (g_efd >= 0)
+		close(g_efd);
+
+	g_shm_sock = -1;
+	g_region = NULL;
+	g_memfd = -1;
+	g_efd = -1;
+}
+
+int shm_get_fd(void)
+{
+	return g_shm_sock;
+}
+
+int shm_handle_socket(void)
+{
+	int fd;
+
+	while (1) {
+		fd = accept4(g_shm_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Could not accept shared memory reader (%s)\n", strerror(errno));
+			return -errno;
+		}
+
+		// one small message, it fits into the socket buffer and never blocks the loop
+		if (send_fds(fd))
+			fprintf(stderr, "Could not pass the shared memory to a reader (%s)\n", strerror(errno));
+		else
+			g_attached++;
+		close(fd);
+	}
+}
+
+int shm_publish(nun_stat_t *stat)
+{
+	shm_slot_t *slot;
+	unsigned seq;
+	uint64_t one = 1;
+
+	if (stat->dev_id >= SHM_MAX_DEVS)
+		return -EINVAL;
+
+	slot = &g_region->slots[stat->dev_id];
+
+	// odd: a reader that overlaps the copy retries, the release fence orders it before the state stores
+	seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->state = *stat;
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	g_published++;
+
+	// the only syscall of the transport, readers that poll do not need it
+	if (g_efd >= 0 && write(g_efd, &one, sizeof(one)) == sizeof(one))
+		g_wakeups++;
+
+	return 0;
+}
+
+void shm_print_stats(FILE *f)
+{
+	fprintf(f, "Shared memory: %lu states published, %lu wakeups, %lu readers attached\n",
+		g_published, g_wakeups, g_attached);
+}
+
+int shm_attach(shm_reader_t *r, const char *path)
+{
+	int fd, rc, num, fds[2];
+	struct stat st;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	void *region;
+
+	memset(r, 0, sizeof(*r));
+	r->efd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Shared memory socket path too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create socket (%s)\n", strerror(errno));
+		return -errno;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		rc = -errno;
+		fprintf(stderr, "Could not connect to %s (%s)\n", path, strerror(errno));
+		close(fd);
+		return rc;
+	}
+
+	num = recv_fds(fd, fds);
+	close(fd);
+	if (num < 0) {
+		fprintf(stderr, "Could not receive the shared memory from %s (%s)\n", path, strerror(-num));
+		return num;
+	}
+
+	// the mapping stays valid after the memfd is closed
+	rc = fstat(fds[0], &st) ? -errno : st.st_size < (off_t)sizeof(shm_region_t) ? -EPROTO : 0;
+	region = rc ? MAP_FAILED : mmap(NULL, sizeof(shm_region_t), PROT_READ, MAP_SHARED, fds[0], 0);
+	if (!rc && region == MAP_FAILED)
+		rc = -errno;
+	close(fds[0]);
+	if (num > 1)
+		r->efd = fds[1];
+	if (rc) {
+		fprintf(stderr, "Could not map the shared memory (%s)\n", strerror(-rc));
+		shm_detach(r);
+		return rc;
+	}
+	r->region = region;
+
+	if (r->region->magic != SHM_MAGIC || r->region->version != SHM_VERSION ||
+		r->region->slot_size != sizeof(shm_slot_t) || r->region->num_slots != SHM_MAX_DEVS) {
+		fprintf(stderr, "Shared memory layout of the sender does not match\n");
+		shm_detach(r);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+void shm_detach(shm_reader_t *r)
+{
+	if (r->region)
+		munmap((void *)r->region, sizeof(shm_region_t));
+	if (r->efd >= 0)
+		close(r->efd);
+
+	r->region = NULL;
+	r->efd = -1;
+}
+
+unsigned shm_read(shm_reader_t *r, unsigned dev, nun_stat_t *stat)
+{
+	const shm_slot_t *slot = &r->region->slots[dev % SHM_MAX_DEVS];
+	unsigned seq;
+
+	while (1) {
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (!(seq & 1)) {
+			*stat = slot->state;
+
+			// the copy is complete before 'seq' is checked again
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq)
+				return seq / 2;
+		}
+		r->retries++;
+	}
+}
@@ -0,0 +1,129 @@
+#ifndef _shm_handling
+#define _shm_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "event_sender.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define SHM_MAGIC 0x4b4e554e // "NUNK"
+#define SHM_VERSION 1
+#define SHM_MAX_DEVS 16 // slot i holds the state of device id i
+#define SHM_CACHE_LINE 64 // every slot has its own lines, a reader of one device does not disturb the others
+#define SHM_SOCK_BACKLOG 4
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Latest complete state of one device, protected by a seqlock: the single writer makes 'seq' odd, updates the
+ * state and makes it even again. A reader copies the state between two loads of an even 'seq' and retries if it
+ * changed meanwhile, i.e. neither side ever blocks or enters the kernel. seq / 2 is the number of updates.
+ */
+typedef struct
+{
+	_Alignas(SHM_CACHE_LINE) atomic_uint seq;
+	nun_stat_t state; // JOY_NO_CHANGE/BUT_KEEP only for values never read, 'seq' is the packet sequence number
+} shm_slot_t;
+
+/**
+ * Layout of the shared memory (memfd), the readers check magic, version and slot size before they use it,
+ * i.e. sender and readers have to be built with the same nun_stat_t.
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t num_slots;
+	shm_slot_t slots[SHM_MAX_DEVS];
+} shm_region_t;
+
+/* a local consumer of the states published by shm_publish() */
+typedef struct
+{
+	const shm_region_t *region; // read-only mapping
+	int efd; // signalled per update if the sender wakes its readers, -1 otherwise
+	unsigned long retries; // reads that overlapped an update
+} shm_reader_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Create the shared memory (memfd) and the UNIX stream socket at the given path. Every client that connects gets
+ * the memfd (and the eventfd if 'wake' is set) via SCM_RIGHTS, see shm_handle_socket() and shm_attach().
+ * With 'wake' every update costs a write() to the eventfd, without it readers have to poll.
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_shm(const char *, bool);
+
+/**
+ * Unmap the shared memory, close the fds and remove the socket. Attached readers keep their mapping.
+ *
+ * return: void
+ */
+void teardown_shm(void);
+
+/**
+ * Get the fd of the listening socket, it becomes readable if a reader connected
+ *
+ * return: fd, -1 if not initialized
+ */
+int shm_get_fd(void);
+
+/**
+ * Accept all pending readers, every one gets the fds and is disconnected
+ *
+ * return: 0 on success, <0 on error
+ */
+int shm_handle_socket(void);
+
+/**
+ * Publish the complete state of the device 'state->dev_id', there must be a single writer per device
+ *
+ * return: 0 on success, <0 on error (invalid device id)
+ */
+int shm_publish(nun_stat_t *);
+
+/**
+ * Print the published updates, wakeups and handed out mappings
+ *
+ * return: void
+ */
+void shm_print_stats(FILE *);
+
+/**
+ * Reader: connect to the socket at the given path and map the shared memory read-only
+ *
+ * return: 0 on success, <0 on error
+ */
+int shm_attach(shm_reader_t *, const char *);
+
+/**
+ * Reader: unmap the shared memory and close the eventfd
+ *
+ * return: void
+ */
+void shm_detach(shm_reader_t *);
+
+/**
+ * Reader: copy the latest state of a device, without any syscall
+ *
+ * return: number of updates of the device so far (0: never published, the state is neutral)
+ */
+unsigned shm_read(shm_reader_t *, unsigned, nun_stat_t *);
+
+
+#endif /* _shm_handling */
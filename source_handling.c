@@ -0,0 +1,402 @@
+#include <stdio.h> /* fprintf */
+#include <stdlib.h> /* strtoul, rand_r */
+#include <string.h> /* strerror, strcmp */
+#include <errno.h> /* err codes */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* read, write, close, access */
+#include <signal.h> /* kill */
+#include <time.h> /* clock_nanosleep */
+
+#include "source_handling.h"
+#include "stats_handling.h"
+
+#include <libevdev-1.0/libevdev/libevdev.h>
+#include <libevdev-1.0/libevdev/libevdev-uinput.h>
+
+
+/***********************************************************************************************************************
+* MACROS/DEFINES
+***********************************************************************************************************************/
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static void set_ev(struct input_event *ev, unsigned type, unsigned code, int value)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/* sleep until the given CLOCK_MONOTONIC time in ns, at most SOURCE_MAX_SLEEP_MS */
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+	uint64_t max = stats_now_ns() + SOURCE_MAX_SLEEP_MS * NS_PER_MS;
+
+	if (t > max)
+		t = max;
+
+	ts.tv_sec = t / NS_PER_SEC;
+	ts.tv_nsec = t % NS_PER_SEC;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* one write() passes all events to the kernel, it stamps and dispatches them like driver events */
+static int write_events(source_t *src, struct input_event *evs, unsigned n)
+{
+	ssize_t len = n * sizeof(*evs);
+
+	if (write(src->fd, evs, len) != len) {
+		fprintf(stderr, "Failed to write events to the virtual device (%s)\n", strerror(errno));
+		return -EIO;
+	}
+
+	src->writes++;
+	src->events += n;
+
+	return 0;
+}
+
+/**
+ * Generate the next event group according to the pattern, the kernel drops unchanged values,
+ * i.e. every pattern changes at least one value per group.
+ *
+ * return: number of events (SYN_REPORT included)
+ */
+static unsigned gen_group(source_t *src, struct input_event *evs)
+{
+	unsigned n = 0;
+
+	switch (src->mode) {
+		case SOURCE_GEN_SWEEP:
+			if (src->seq & 1) {
+				src->joy_y = (src->joy_y + 1) % (SOURCE_AXIS_MAX + 1);
+				set_ev(&evs[n++], EV_ABS, ABS_Y, src->joy_y);
+			} else {
+				src->joy_x = (src->joy_x + 1) % (SOURCE_AXIS_MAX + 1);
+				set_ev(&evs[n++], EV_ABS, ABS_X, src->joy_x);
+			}
+			break;
+		case SOURCE_GEN_RANDOM:
+			src->joy_x = rand_r(&src->rand_seed) % (SOURCE_AXIS_MAX + 1);
+			src->joy_y = rand_r(&src->rand_seed) % (SOURCE_AXIS_MAX + 1);
+			set_ev(&evs[n++], EV_ABS, ABS_X, src->joy_x);
+			set_ev(&evs[n++], EV_ABS, ABS_Y, src->joy_y);
+			if (!(src->seq % 16)) {
+				src->but_c = !src->but_c;
+				set_ev(&evs[n++], EV_KEY, BTN_C, src->but_c);
+			}
+			break;
+		default:
+			if (src->seq & 2) {
+				src->but_z = !src->but_z;
+				set_ev(&evs[n++], EV_KEY, BTN_Z, src->but_z);
+			} else {
+				src->but_c = !src->but_c;
+				set_ev(&evs[n++], EV_KEY, BTN_C, src->but_c);
+			}
+			break;
+	}
+
+	set_ev(&evs[n++], EV_SYN, SYN_REPORT, 0);
+	src->seq++;
+	src->groups++;
+
+	return n;
+}
+
+/**
+ * Write groups at the configured rate. Groups that are due are written with one write() (at most
+ * SOURCE_MAX_BURST), i.e. high rates do not need a wakeup per group.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int run_generator(source_t *src)
+{
+	int rc;
+	unsigned n, cnt;
+	uint64_t start = stats_now_ns(), elapsed, due, done = 0;
+	struct input_event evs[SOURCE_MAX_BURST * SOURCE_GROUP_EVENTS];
+
+	while (!atomic_load(&src->stop)) {
+		elapsed = stats_now_ns() - start;
+		if (src->duration_sec && elapsed >= src->duration_sec * NS_PER_SEC)
+			break;
+
+		// the first group is due right away
+		due = elapsed / 1000 * src->rate_hz / 1000000 + 1;
+		if (due - done > SOURCE_MAX_BURST)
+			src->late++;
+
+		for (n = 0, cnt = 0; done < due && cnt < SOURCE_MAX_BURST; done++, cnt++)
+			n += gen_group(src, &evs[n]);
+
+		rc = write_events(src, evs, n);
+		if (rc)
+			return rc;
+
+		// still behind schedule, write the next burst right away
+		if (done < due)
+			continue;
+
+		sleep_until(start + done * NS_PER_SEC / src->rate_hz);
+	}
+
+	return 0;
+}
+
+/**
+ * Write the groups of the trace with their recorded spacing (divided by the speed). At full speed
+ * up to SOURCE_MAX_BURST groups are written at once. SYN_DROPPED of the recording is skipped.
+ *
+ * return: 0 on success, <0 on error
+ */
+static int run_replay(source_t *src)
+{
+	int rc;
+	ssize_t len;
+	unsigned i, n = 0, cnt = 0;
+	uint64_t start = 0, ts, ts0 = 0, target;
+	struct input_event in[SOURCE_MAX_BURST];
+	struct input_event out[SOURCE_MAX_BURST * SOURCE_GROUP_EVENTS];
+
+	while (!atomic_load(&src->stop)) {
+		len = read(src->trace_fd, in, sizeof(in));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			fprintf(stderr, "Failed to read trace %s (%s)\n", src->trace_path, strerror(errno));
+			return -errno;
+		}
+		if (len < sizeof(in[0]))
+			break;
+
+		for (i = 0; i < len / sizeof(in[0]); i++) {
+			if (in[i].type == EV_SYN && in[i].code == SYN_DROPPED)
+				continue;
+
+			// an oversized group is split, the kernel stamps every part anyway
+			if (n == SOURCE_MAX_BURST * SOURCE_GROUP_EVENTS) {
+				rc = write_events(src, out, n);
+				if (rc)
+					return rc;
+				n = 0;
+			}
+			out[n++] = in[i];
+
+			if (in[i].type != EV_SYN || in[i].code != SYN_REPORT)
+				continue;
+
+			src->groups++;
+			cnt++;
+			ts = (uint64_t)in[i].time.tv_sec * NS_PER_SEC + in[i].time.tv_usec * 1000;
+			if (!start) {
+				start = stats_now_ns();
+				ts0 = ts;
+			}
+
+			if (src->speed > 0) {
+				target = start + (uint64_t)((ts - ts0) / src->speed);
+				while (stats_now_ns() < target && !atomic_load(&src->stop))
+					sleep_until(target);
+			} else if (cnt < SOURCE_MAX_BURST && n + SOURCE_GROUP_EVENTS <= SOURCE_MAX_BURST * SOURCE_GROUP_EVENTS) {
+				continue;
+			}
+
+			rc = write_events(src, out, n);
+			if (rc)
+				return rc;
+			n = 0;
+			cnt = 0;
+		}
+	}
+
+	return n ? write_events(src, out, n) : 0;
+}
+
+/* Source thread, writes events until it is done or stopped */
+static void *source_thread(void *arg)
+{
+	source_t *src = arg;
+	uint64_t start = stats_now_ns();
+	int rc;
+
+	rc = src->mode == SOURCE_REPLAY ? run_replay(src) : run_generator(src);
+	src->elapsed_sec = (stats_now_ns() - start) / 1e9;
+	if (rc)
+		fprintf(stderr, "Source terminated with error (%s)\n", strerror(-rc));
+
+	// a finite source ends the run, the sender gets some time to send the last groups
+	if (!atomic_load(&src->stop) && (src->mode == SOURCE_REPLAY || src->duration_sec)) {
+		printf("Source done, stopping\n");
+		usleep(SOURCE_DRAIN_MS * 1000);
+		kill(getpid(), SIGINT);
+	}
+
+	return NULL;
+}
+
+/* "gen:rate[:pattern[:seconds]]" or "replay:file[:speed]" */
+static int parse_spec(source_t *src, const char *spec)
+{
+	int i;
+	char *mode, *arg, *opt, *save, buf[SOURCE_PATH_LEN];
+	const char *names[] = SOURCE_GEN_NAMES;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	mode = strtok_r(buf, ":", &save);
+	arg = strtok_r(NULL, ":", &save);
+	if (!mode || !arg)
+		return -EINVAL;
+
+	if (!strcmp(mode, "replay")) {
+		src->mode = SOURCE_REPLAY;
+		strncpy(src->trace_path, arg, sizeof(src->trace_path) - 1);
+		src->speed = 1.0;
+		if ((opt = strtok_r(NULL, ":", &save)))
+			src->speed = strcmp(opt, "max") ? strtod(opt, NULL) : 0;
+		return src->speed < 0 ? -EINVAL : 0;
+	}
+
+	if (strcmp(mode, "gen"))
+		return -EINVAL;
+
+	src->rate_hz = strtoul(arg, NULL, 0);
+	if (!src->rate_hz)
+		return -EINVAL;
+
+	src->mode = SOURCE_GEN_SWEEP;
+	if ((opt = strtok_r(NULL, ":", &save))) {
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+			if (!strcmp(opt, names[i]))
+				break;
+		if (i == sizeof(names) / sizeof(names[0]))
+			return -EINVAL;
+		src->mode = i;
+	}
+
+	if ((opt = strtok_r(NULL, ":", &save)))
+		src->duration_sec = strtoul(opt, NULL, 0);
+
+	return 0;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_source(source_t *src, const char *spec, const char *name)
+{
+	int rc, i;
+	const char *node;
+	struct input_absinfo abs = {.minimum = 0, .maximum = SOURCE_AXIS_MAX};
+
+	memset(src, 0, sizeof(*src));
+	src->trace_fd = -1;
+	src->fd = -1;
+	src->rand_seed = 1;
+	atomic_init(&src->stop, false);
+
+	if (parse_spec(src, spec)) {
+		fprintf(stderr, "Invalid source '%s'\n", spec);
+		return -EINVAL;
+	}
+
+	if (src->mode == SOURCE_REPLAY) {
+		src->trace_fd = open(src->trace_path, O_RDONLY|O_CLOEXEC);
+		if (src->trace_fd < 0) {
+			fprintf(stderr, "Failed to open trace %s (%s)\n", src->trace_path, strerror(errno));
+			return -errno;
+		}
+	}
+
+	// the virtual device looks like the nunchuk to the sender (name, event codes and axis range)
+	src->evdev = libevdev_new();
+	if (!src->evdev) {
+		rc = -ENOMEM;
+		goto fail;
+	}
+	libevdev_set_name(src->evdev, name);
+	libevdev_enable_event_type(src->evdev, EV_KEY);
+	libevdev_enable_event_code(src->evdev, EV_KEY, BTN_C, NULL);
+	libevdev_enable_event_code(src->evdev, EV_KEY, BTN_Z, NULL);
+	libevdev_enable_event_type(src->evdev, EV_ABS);
+	libevdev_enable_event_code(src->evdev, EV_ABS, ABS_X, &abs);
+	libevdev_enable_event_code(src->evdev, EV_ABS, ABS_Y, &abs);
+
+	rc = libevdev_uinput_create_from_device(src->evdev, LIBEVDEV_UINPUT_OPEN_MANAGED, &src->uidev);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to create virtual input device (%s)\n", strerror(-rc));
+		goto fail;
+	}
+	src->fd = libevdev_uinput_get_fd(src->uidev);
+
+	node = libevdev_uinput_get_devnode(src->uidev);
+	if (!node) {
+		fprintf(stderr, "Failed to get the device node of the virtual input device\n");
+		rc = -ENODEV;
+		goto fail;
+	}
+	strncpy(src->devnode, node, sizeof(src->devnode) - 1);
+
+	// the node is created asynchronously (devtmpfs/udev)
+	for (i = 0; access(src->devnode, R_OK) && i < SOURCE_NODE_WAIT_MS / 10; i++)
+		usleep(10000);
+
+	printf("Virtual input device %s created\n", src->devnode);
+
+	return 0;
+
+fail:
+	teardown_source(src);
+	return rc;
+}
+
+void teardown_source(source_t *src)
+{
+	if (src->running) {
+		atomic_store(&src->stop, true);
+		pthread_join(src->tid, NULL);
+		src->running = false;
+	}
+
+	if (src->uidev)
+		libevdev_uinput_destroy(src->uidev);
+	if (src->evdev)
+		libevdev_free(src->evdev);
+	if (src->trace_fd >= 0)
+		close(src->trace_fd);
+
+	src->uidev = NULL;
+	src->evdev = NULL;
+	src->trace_fd = -1;
+	src->fd = -1;
+}
+
+int source_start(source_t *src)
+{
+	int rc = pthread_create(&src->tid, NULL, source_thread, src);
+
+	if (rc) {
+		fprintf(stderr, "Failed to create source thread (%s)\n", strerror(rc));
+		return -rc;
+	}
+	src->running = true;
+
+	return 0;
+}
+
+void source_print_stats(source_t *src, FILE *f)
+{
+	double sec = src->elapsed_sec;
+
+	fprintf(f, "Source: %lu groups (%lu events) in %lu writes within %.2f s (%.0f groups/s), %lu times behind schedule\n",
+		src->groups, src->events, src->writes, sec, sec > 0 ? src->groups / sec : 0.0, src->late);
+}
@@ -0,0 +1,114 @@
+#ifndef _source_handling
+#define _source_handling
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/input.h>
+
+#include "input_handling.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define SOURCE_AXIS_MAX 255 // axis range of the virtual device, like the 8 bit axes of the nunchuk
+#define SOURCE_MAX_BURST 64 // max number of groups written by one write() if the generator is behind
+#define SOURCE_GROUP_EVENTS 8 // max number of events of a generated or replayed group (SYN_REPORT included)
+#define SOURCE_MAX_SLEEP_MS 100 // the thread checks for a stop request at least that often
+#define SOURCE_DRAIN_MS 200 // time the sender gets to send the last groups before it is stopped
+#define SOURCE_NODE_WAIT_MS 1000 // max time until the device node of the virtual device appears
+#define SOURCE_PATH_LEN 256
+
+/* what drives the virtual device */
+typedef enum _source_mode_t{
+	SOURCE_GEN_SWEEP = 0,	// joystick axes ramp through their range, one axis changes per group
+	SOURCE_GEN_RANDOM,		// random axis values, every 16th group toggles a button
+	SOURCE_GEN_BUTTONS,		// button transitions only (press/release of C and Z in turn)
+	SOURCE_REPLAY			// recorded struct input_event trace, see input_record()
+} source_mode_t;
+#define SOURCE_GEN_NAMES {"sweep", "random", "buttons"}
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+
+/**
+ * Synthetic input source: a virtual input device (uinput) that is written by a thread of its own.
+ * The sender reads it through its device node like a real one, i.e. the whole evdev path is exercised.
+ */
+typedef struct
+{
+	source_mode_t mode;
+	unsigned rate_hz; // generator: event groups per second
+	unsigned duration_sec; // generator: 0 runs until the sender stops
+	double speed; // replay: 1 is the recorded timing, 0 replays as fast as possible
+	char trace_path[SOURCE_PATH_LEN];
+	int trace_fd;
+
+	struct libevdev *evdev;
+	struct libevdev_uinput *uidev;
+	int fd; // uinput fd, events are written to it directly
+	char devnode[INPUT_PATH_LEN];
+
+	pthread_t tid;
+	bool running;
+	atomic_bool stop;
+
+	// generator state
+	unsigned long seq;
+	unsigned rand_seed; // fixed, i.e. every run generates the same sequence
+	int joy_x;
+	int joy_y;
+	int but_c;
+	int but_z;
+
+	// statistics
+	unsigned long groups;
+	unsigned long events;
+	unsigned long writes;
+	unsigned long late; // wakeups that were more than SOURCE_MAX_BURST groups behind schedule
+	double elapsed_sec;
+} source_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Create a virtual input device with the given name, driven according to the given spec:
+ * "gen:rate[:pattern[:seconds]]" (pattern see SOURCE_GEN_NAMES, default sweep) or "replay:file[:speed]".
+ * The device node is available via 'devnode' afterwards, no events are written before source_start().
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_source(source_t *, const char *, const char *);
+
+/**
+ * Teardown a source initialized by init_source(), stops its thread and removes the virtual device
+ *
+ * return: void
+ */
+void teardown_source(source_t *);
+
+/**
+ * Start writing events on the source thread. A replay and a generator with a duration send SIGINT to
+ * the process once they are done (after SOURCE_DRAIN_MS), i.e. the sender stops like on Ctrl-C.
+ *
+ * return: 0 on success, <0 on error
+ */
+int source_start(source_t *);
+
+/**
+ * Print the written groups and events, the achieved rate and how often the source was behind schedule.
+ * Has to be called after teardown_source(), i.e. once the thread terminated.
+ *
+ * return: void
+ */
+void source_print_stats(source_t *, FILE *);
+
+
+#endif /* _source_handling */
@@ -0,0 +1,115 @@
+#include <stdio.h> /* fprintf */
+#include <string.h> /* memset */
+#include <time.h> /* clock_gettime */
+
+#include "stats_handling.h"
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static unsigned hist_index(uint64_t v)
+{
+	unsigned exp;
+
+	if (v >= (1ULL << 32))
+		v = (1ULL << 32) - 1;
+
+	if (v < HIST_LINEAR)
+		return v;
+
+	// position of the highest set bit, the next HIST_SUB_BITS bits select the sub bucket
+	exp = 63 - __builtin_clzll(v);
+
+	return HIST_LINEAR + (exp - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS +
+		((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* largest value that falls into the bucket */
+static uint64_t hist_upper(unsigned idx)
+{
+	unsigned exp, sub;
+
+	if (idx < HIST_LINEAR)
+		return idx;
+
+	exp = (idx - HIST_LINEAR) / HIST_SUB_BUCKETS + HIST_SUB_BITS + 1;
+	sub = (idx - HIST_LINEAR) % HIST_SUB_BUCKETS;
+
+	return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void init_hist(hist_t *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_add(hist_t *h, uint64_t v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint64_t hist_percentile(hist_t *h, double p)
+{
+	unsigned i;
+	unsigned long seen = 0, rank;
+
+	if (!h->count)
+		return 0;
+
+	// rank of the requested value, at least the first one
+	rank = (unsigned long)(p / 100.0 * h->count + 0.5);
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+	}
+
+	return h->max;
+}
+
+void hist_print(hist_t *h, const char *name, const char *unit, FILE *f)
+{
+	if (!h->count) {
+		fprintf(f, "%s: no samples\n", name);
+		return;
+	}
+
+	fprintf(f, "%s: n=%lu min %llu avg %.1f p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu %s\n",
+		name, h->count, (unsigned long long)h->min, (double)h->sum / h->count,
+		(unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+		(unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+		(unsigned long long)h->max, unit);
+}
@@ -0,0 +1,83 @@
+#ifndef _stats_handling
+#define _stats_handling
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+
+/**
+ * Log-linear buckets: values below HIST_LINEAR get a bucket each, above every power of 2
+ * is split into HIST_SUB_BUCKETS buckets, i.e. the relative error is below 1/HIST_SUB_BUCKETS.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB_BUCKETS)
+#define HIST_BUCKETS (HIST_LINEAR + (32 - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS) // values up to 2^32
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+typedef struct
+{
+	unsigned long buckets[HIST_BUCKETS];
+	unsigned long count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+} hist_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Get the current time of CLOCK_MONOTONIC (the clock of the input event timestamps) in us
+ *
+ * return: time in us
+ */
+uint64_t stats_now_us(void);
+
+/**
+ * Get the current time of CLOCK_MONOTONIC in ns, for short intervals (e.g. the decode time of a packet)
+ *
+ * return: time in ns
+ */
+uint64_t stats_now_ns(void);
+
+/**
+ * Initialize an empty histogram
+ *
+ * return: void
+ */
+void init_hist(hist_t *);
+
+/**
+ * Add a value to the histogram, values of 2^32 and above are clamped
+ *
+ * return: void
+ */
+void hist_add(hist_t *, uint64_t);
+
+/**
+ * Get the given percentile (0..100) of the recorded values, i.e. the upper bound of its bucket
+ *
+ * return: percentile, 0 if the histogram is empty
+ */
+uint64_t hist_percentile(hist_t *, double);
+
+/**
+ * Print count, min, avg, p50, p90, p99, p99.9 and max of the histogram in one line,
+ * prefixed with the given name. The unit of the values is appended.
+ *
+ * return: void
+ */
+void hist_print(hist_t *, const char *, const char *, FILE *);
+
+
+#endif /* _stats_handling */
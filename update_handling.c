@@ -0,0 +1,565 @@
+#include <stdio.h> /* fprintf */
+#include <string.h> /* strerror, memset */
+#include <errno.h> /* err codes */
+#include <unistd.h> /* read, close */
+#include <sys/timerfd.h> /* timerfd */
+
+#include "update_handling.h"
+#include "network_handling.h"
+#include "compact_handling.h"
+#include "metrics_handling.h"
+#include "rt_handling.h"
+
+
+/***********************************************************************************************************************
+* HELPER FUNC
+***********************************************************************************************************************/
+static int set_timer(update_ctx_t *ctx, bool arm)
+{
+	struct itimerspec its = {0};
+	long period_ns = 1000000000L / ctx->rate_hz;
+
+	if (arm) {
+		its.it_value.tv_sec = period_ns / 1000000000L;
+		its.it_value.tv_nsec = period_ns % 1000000000L;
+		its.it_interval = its.it_value;
+	}
+
+	if (timerfd_settime(ctx->timer_fd, 0, &its, NULL)) {
+		fprintf(stderr, "Failed to set coalescing timer (%s)\n", strerror(errno));
+		return -errno;
+	}
+
+	ctx->timer_armed = arm;
+
+	return 0;
+}
+
+/* true if the state carries at least one value */
+static bool has_values(nun_stat_t *stat)
+{
+	return stat->joy_x != JOY_NO_CHANGE || stat->joy_y != JOY_NO_CHANGE ||
+		stat->but_c != BUT_KEEP || stat->but_z != BUT_KEEP;
+}
+
+/**
+ * Compare a state against the last transmitted state. Values that did not change are
+ * replaced by their neutral value (JOY_NO_CHANGE/BUT_KEEP), the remaining ones are recorded as sent.
+ *
+ * return: true if at least one value changed, false if the update is a no-op
+ */
+static bool reduce_to_changes(update_ctx_t *ctx, nun_stat_t *stat)
+{
+	nun_stat_t *last = &ctx->last_sent;
+
+	if (stat->joy_x == last->joy_x)
+		stat->joy_x = JOY_NO_CHANGE;
+	if (stat->joy_y == last->joy_y)
+		stat->joy_y = JOY_NO_CHANGE;
+	if (stat->but_c == last->but_c)
+		stat->but_c = BUT_KEEP;
+	if (stat->but_z == last->but_z)
+		stat->but_z = BUT_KEEP;
+
+	if (!has_values(stat))
+		return false;
+
+	if (stat->joy_x != JOY_NO_CHANGE)
+		last->joy_x = stat->joy_x;
+	if (stat->joy_y != JOY_NO_CHANGE)
+		last->joy_y = stat->joy_y;
+	if (stat->but_c != BUT_KEEP)
+		last->but_c = stat->but_c;
+	if (stat->but_z != BUT_KEEP)
+		last->but_z = stat->but_z;
+
+	return true;
+}
+
+/* merge a newer state into an older one, newer values win but the timestamp of the older one is kept */
+static void merge_stat(nun_stat_t *old, nun_stat_t *new)
+{
+	if (!old->event_ts)
+		old->event_ts = new->event_ts;
+	if (new->but_c != BUT_KEEP)
+		old->but_c = new->but_c;
+	if (new->but_z != BUT_KEEP)
+		old->but_z = new->but_z;
+	if (new->joy_x != JOY_NO_CHANGE)
+		old->joy_x = new->joy_x;
+	if (new->joy_y != JOY_NO_CHANGE)
+		old->joy_y = new->joy_y;
+}
+
+/**
+ * The requested format is used if the server supports it, protobuf is the compatible default.
+ * The local transport only takes the state itself.
+ */
+static void select_format(update_ctx_t *ctx, unsigned formats)
+{
+	wire_format_t format = (formats & WIRE_FORMAT_BIT(ctx->req_format)) ? ctx->req_format :
+		(formats & WIRE_FORMAT_BIT(WIRE_LOCAL)) ? WIRE_LOCAL : WIRE_PROTOBUF;
+
+	if (format == WIRE_PROTOBUF && format != ctx->req_format && format != ctx->format)
+		fprintf(stderr, "Receiver does not support the requested format, falling back to protobuf\n");
+
+	ctx->format = format;
+}
+
+/**
+ * Check the destination of the packets. A new server does not know any previous state, i.e. the complete
+ * state is sent with the next packet. While no server is known the state is only recorded.
+ *
+ * return: true if the state has to be sent, false if it is held back
+ */
+static bool check_destination(update_ctx_t *ctx, nun_stat_t *stat, bool *full)
+{
+	unsigned gen, formats;
+	bool connected = nw_get_destination(&gen, &formats);
+
+	*full = false;
+
+	if (!connected) {
+		merge_stat(&ctx->last_sent, stat);
+		return false;
+	}
+
+	if (gen != ctx->nw_gen) {
+		uint64_t event_ts = stat->event_ts;
+
+		ctx->nw_gen = gen;
+		select_format(ctx, formats);
+		merge_stat(&ctx->last_sent, stat);
+		*stat = ctx->last_sent;
+		stat->event_ts = event_ts;
+		*full = true;
+	}
+
+	return true;
+}
+
+/* a packet that reached no receiver is not fatal, it is counted and logged at most once per UPDATE_FAIL_LOG_US */
+static void account_send_failure(update_ctx_t *ctx, int err, uint64_t now)
+{
+	ctx->send_failures++;
+
+	if (ctx->fail_log_us && now - ctx->fail_log_us < UPDATE_FAIL_LOG_US)
+		return;
+
+	if (!rt_quiet())
+		fprintf(stderr, "Could not send packet of device %u (%s), %lu failed sends so far\n", ctx->dev_id,
+			strerror(-err), ctx->send_failures);
+	ctx->fail_log_us = now;
+}
+
+/* expire the keyframe timer in 'us' for a deferred loss keyframe, the periodic keyframes continue from there */
+static void arm_loss_timer(update_ctx_t *ctx, uint64_t us)
+{
+	struct itimerspec its = {0};
+
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+	its.it_interval.tv_sec = ctx->keyframe_ms / 1000;
+	its.it_interval.tv_nsec = (ctx->keyframe_ms % 1000) * 1000000L;
+
+	if (timerfd_settime(ctx->keyframe_fd, 0, &its, NULL)) {
+		if (!rt_quiet())
+			fprintf(stderr, "Failed to arm keyframe timer of device %u (%s)\n", ctx->dev_id, strerror(errno));
+		return;
+	}
+	ctx->loss_timer = true;
+}
+
+/**
+ * Repair the state at the receivers that missed a packet of the device (see nw_take_losses()). A lost packet
+ * makes the next one a keyframe, at most once per UPDATE_LOSS_KEYFRAME_US, i.e. a congested link is not
+ * flooded with complete states. A deferred keyframe is sent by the keyframe timer if no packet comes first.
+ * A joystick update dropped by the low latency profile only re-sends the axes.
+ *
+ * return: void
+ */
+static void check_losses(update_ctx_t *ctx, nun_stat_t *stat, bool *changed, uint64_t now)
+{
+	bool dropped;
+
+	if (nw_take_losses(ctx->dev_id, &dropped))
+		ctx->loss_pending = true;
+
+	if (ctx->loss_pending && now - ctx->loss_keyframe_us >= UPDATE_LOSS_KEYFRAME_US) {
+		ctx->loss_keyframe_us = now;
+		ctx->keyframe_req = true;
+		ctx->loss_keyframes++;
+		return;
+	}
+
+	if (ctx->loss_pending && !ctx->loss_timer)
+		arm_loss_timer(ctx, ctx->loss_keyframe_us + UPDATE_LOSS_KEYFRAME_US - now);
+
+	if (!dropped || ctx->last_sent.joy_x == JOY_NO_CHANGE)
+		return;
+
+	if (stat->joy_x == JOY_NO_CHANGE)
+		stat->joy_x = ctx->last_sent.joy_x;
+	if (stat->joy_y == JOY_NO_CHANGE)
+		stat->joy_y = ctx->last_sent.joy_y;
+	*changed = true;
+	ctx->joy_resends++;
+}
+
+/* send out the pending state (if it changes anything) and account the number of merged groups */
+static int flush_pending(update_ctx_t *ctx)
+{
+	int rc;
+	uint8_t *buf;
+	uint64_t now, t0, t1, t2 = 0;
+	unsigned len, n = ctx->pending_groups;
+	uint16_t seq;
+	nun_stat_t stat = ctx->pending, state;
+	bool full, changed, sampled, keyframe;
+
+	ctx->pending = (nun_stat_t)NUN_STAT_NEUTRAL;
+	ctx->pending_groups = 0;
+
+	// input is still read while discovery is pending, the latest state is sent once the server is found
+	if (!check_destination(ctx, &stat, &full)) {
+		ctx->held += n;
+		return 0;
+	}
+
+	if (full)
+		changed = has_values(&stat);
+	else
+		changed = reduce_to_changes(ctx, &stat);
+
+	now = stats_now_us();
+	check_losses(ctx, &stat, &changed, now);
+
+	// a requested keyframe carries the complete state, it is sent even if nothing changed
+	keyframe = full || ctx->keyframe_req;
+	if (keyframe && !full) {
+		uint64_t event_ts = stat.event_ts;
+
+		stat = ctx->last_sent;
+		stat.event_ts = event_ts;
+		changed = has_values(&stat);
+	}
+	stat.keyframe = keyframe;
+	stat.normalized = ctx->normalized;
+	ctx->keyframe_req = false;
+	if (keyframe)
+		ctx->loss_pending = false;
+
+	// SYN_REPORT-only groups and repeated values never reach the protobuf/network layer
+	if (!changed) {
+		if (n)
+			ctx->suppressed++;
+		return 0;
+	}
+
+	if (ctx->timestamps)
+		stat.send_ts = now;
+
+	ctx->packets++;
+	if (full)
+		ctx->full_updates++;
+	if (keyframe) {
+		ctx->keyframes++;
+		ctx->keyframe_sent = true;
+	}
+	if (n) {
+		ctx->merge_hist[n <= 4 ? n - 1 : n <= 8 ? 4 : 5]++;
+		if (n > ctx->max_merged)
+			ctx->max_merged = n;
+	}
+
+	// every format carries the sequence number, the receiver detects loss and reordering per device
+	seq = ctx->seq++;
+
+	// the stages of the sampled packets are timed, fill and pack are separate steps except for compact
+	sampled = METRICS_SAMPLED(ctx->packets);
+	t0 = t1 = sampled ? metrics_now() : 0;
+
+	switch (ctx->format) {
+		case WIRE_LOCAL:
+			// not encoded, the readers get the complete state (last_sent holds it after the change detection)
+			state = ctx->last_sent;
+			state.event_ts = stat.event_ts;
+			state.send_ts = stat.send_ts;
+			state.dev_id = ctx->dev_id;
+			state.seq = seq;
+			state.keyframe = stat.keyframe;
+			state.normalized = stat.normalized;
+			buf = (uint8_t *)&state;
+			len = sizeof(state);
+			break;
+		case WIRE_COMPACT:
+			rc = pack_nunchuk_compact(&stat, ctx->dev_id, seq, ctx->compact_buf, sizeof(ctx->compact_buf));
+			if (rc < 0)
+				return rc;
+			len = rc;
+			buf = ctx->compact_buf;
+			break;
+		case WIRE_PROTOBUF_V2:
+			fill_nunchuk_protobuf_v2(&stat, &ctx->nun_protobuf_v2);
+			ctx->nun_protobuf_v2.seq = seq;
+			t1 = sampled ? metrics_now() : 0;
+			rc = pack_nunchuk_protobuf_v2_ctx(&ctx->proto_ctx, &ctx->nun_protobuf_v2, &buf, &len);
+			if (rc)
+				return rc;
+			break;
+		default:
+			fill_nunchuk_protobuf(&stat, ctx->nun_protobuf);
+			ctx->nun_protobuf->seq = seq;
+			t1 = sampled ? metrics_now() : 0;
+			rc = pack_nunchuk_protobuf_ctx(&ctx->proto_ctx, ctx->nun_protobuf, &buf, &len);
+			if (rc) {
+				fprintf(stderr, "Failed to pack protobuf (%s)\n", strerror(-rc));
+				return rc;
+			}
+			break;
+	}
+
+	if (sampled) {
+		t2 = metrics_now();
+		if (ctx->format != WIRE_COMPACT && ctx->format != WIRE_LOCAL)
+			metrics_time(METRICS_FILL, t1 - t0);
+		metrics_time(METRICS_PACK, t2 - t1);
+	}
+
+	// a stale joystick position may be dropped by the low latency profile, a button transition or a keyframe never
+	rc = nw_send(ctx->dev_id, buf, len, stat.but_c == BUT_KEEP && stat.but_z == BUT_KEEP && !stat.keyframe);
+
+	if (sampled)
+		metrics_time(METRICS_SEND, metrics_now() - t2);
+
+	if (!rc) {
+		metrics_count(METRICS_PACKETS, 1);
+		ctx->sent_bytes += len;
+
+		// a full state sent to a new receiver may not have a group of its own
+		if (stat.event_ts)
+			hist_add(&ctx->send_latency, now - stat.event_ts);
+	} else if (rc == -ENOTCONN) {
+		// the last receiver disappeared since check_destination(), the next one gets the complete state anyway
+		ctx->held += n;
+	} else {
+		account_send_failure(ctx, rc, now);
+	}
+
+	// only an encoding error above stops the caller, the network may recover
+	return 0;
+}
+
+/* send the complete state now, pending groups are included */
+static int send_keyframe(update_ctx_t *ctx)
+{
+	ctx->keyframe_req = true;
+
+	return flush_pending(ctx);
+}
+
+/* a pending button transition must not be overwritten by the opposite transition */
+static int button_conflict(but_state_t pending, but_state_t new)
+{
+	return new != BUT_KEEP && pending != BUT_KEEP && pending != new;
+}
+
+
+/***********************************************************************************************************************
+* IMPLEMENTATION OF EXPORTED FUNCTIONS
+***********************************************************************************************************************/
+int init_update(update_ctx_t *ctx, uint8_t dev_id, unsigned rate_hz, wire_format_t format, bool timestamps,
+	unsigned keyframe_ms)
+{
+	struct itimerspec its = {0};
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->dev_id = dev_id;
+	ctx->req_format = format;
+	ctx->format = format;
+	init_proto_ctx(&ctx->proto_ctx);
+	nunchuk_update_v2__init(&ctx->nun_protobuf_v2);
+	ctx->nun_protobuf_v2.device_id = dev_id;
+	ctx->pending = (nun_stat_t)NUN_STAT_NEUTRAL;
+	ctx->last_sent = (nun_stat_t)NUN_STAT_NEUTRAL;
+	ctx->rate_hz = rate_hz;
+	ctx->timer_fd = -1;
+	ctx->timestamps = timestamps;
+	ctx->keyframe_ms = keyframe_ms;
+	ctx->keyframe_fd = -1;
+	init_hist(&ctx->send_latency);
+
+	if (rate_hz > 1000000) {
+		fprintf(stderr, "Invalid coalescing rate %u Hz\n", rate_hz);
+		return -EINVAL;
+	}
+
+	// init the protobuf used to send nunchuk data
+	ctx->nun_protobuf = new_nunchuk_protobuf();
+	if (!ctx->nun_protobuf) {
+		fprintf(stderr, "Error allocating protobuf!\n");
+		return -ENOMEM;
+	}
+	ctx->nun_protobuf->device_id = dev_id;
+
+	if (rate_hz) {
+		ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (ctx->timer_fd < 0) {
+			fprintf(stderr, "Failed to create coalescing timer (%s)\n", strerror(errno));
+			teardown_update(ctx);
+			return -errno;
+		}
+	}
+
+	// runs all the time, an idle device gets a keyframe per interval as well (without one it only serves losses)
+	its.it_value.tv_sec = keyframe_ms / 1000;
+	its.it_value.tv_nsec = (keyframe_ms % 1000) * 1000000L;
+	its.it_interval = its.it_value;
+	ctx->keyframe_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (ctx->keyframe_fd < 0 || timerfd_settime(ctx->keyframe_fd, 0, &its, NULL)) {
+		fprintf(stderr, "Failed to create keyframe timer (%s)\n", strerror(errno));
+		teardown_update(ctx);
+		return -errno;
+	}
+
+	return 0;
+}
+
+void teardown_update(update_ctx_t *ctx)
+{
+	if (ctx->timer_fd >= 0)
+		close(ctx->timer_fd);
+	if (ctx->keyframe_fd >= 0)
+		close(ctx->keyframe_fd);
+
+	free_nunchuk_protobuf(ctx->nun_protobuf);
+
+	ctx->timer_fd = -1;
+	ctx->keyframe_fd = -1;
+	ctx->nun_protobuf = NULL;
+}
+
+int update_submit(update_ctx_t *ctx, nun_stat_t *nun_status)
+{
+	int rc;
+
+	ctx->groups++;
+	ctx->normalized = nun_status->normalized;
+
+	// keep button transitions, i.e. send the pending state early instead of losing a press
+	if (button_conflict(ctx->pending.but_c, nun_status->but_c) ||
+		button_conflict(ctx->pending.but_z, nun_status->but_z)) {
+		ctx->early_flushes++;
+		rc = flush_pending(ctx);
+		if (rc)
+			return rc;
+	}
+
+	// merge the group into the pending state, newer values win
+	merge_stat(&ctx->pending, nun_status);
+	ctx->pending_groups++;
+
+	// the state rebuilt after a resync of the device goes out right away as a keyframe
+	if (nun_status->keyframe) {
+		ctx->resyncs++;
+		ctx->keyframe_req = true;
+		return flush_pending(ctx);
+	}
+
+	/**
+	 * Without coalescing every group is sent immediately.
+	 * Otherwise the first group after an idle period is sent immediately as well and starts the
+	 * periodic timer, following groups are merged until the next tick.
+	 */
+	if (!ctx->rate_hz)
+		return flush_pending(ctx);
+
+	if (!ctx->timer_armed) {
+		rc = set_timer(ctx, true);
+		if (rc)
+			return rc;
+		return flush_pending(ctx);
+	}
+
+	return 0;
+}
+
+int update_tick(update_ctx_t *ctx)
+{
+	uint64_t expirations;
+
+	if (read(ctx->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	// nothing arrived during the last period, stop the timer to avoid idle wakeups
+	if (!ctx->pending_groups)
+		return set_timer(ctx, false);
+
+	return flush_pending(ctx);
+}
+
+int update_keyframe_tick(update_ctx_t *ctx)
+{
+	int rc;
+	uint64_t expirations;
+
+	if (read(ctx->keyframe_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	ctx->loss_timer = false;
+
+	// a keyframe within the interval (e.g. for a new receiver) makes the periodic one redundant
+	if (ctx->keyframe_sent && !ctx->keyframe_req && !ctx->loss_pending) {
+		ctx->keyframe_sent = false;
+		return 0;
+	}
+
+	rc = send_keyframe(ctx);
+	ctx->keyframe_sent = false;
+
+	return rc;
+}
+
+int update_request_keyframe(update_ctx_t *ctx)
+{
+	ctx->keyframe_reqs++;
+
+	return send_keyframe(ctx);
+}
+
+int update_refresh(update_ctx_t *ctx)
+{
+	unsigned gen, formats;
+
+	nw_get_destination(&gen, &formats);
+	if (gen == ctx->nw_gen)
+		return 0;
+
+	// pending groups go out with the full state, the coalescing timer keeps running if armed
+	return flush_pending(ctx);
+}
+
+void update_print_stats(update_ctx_t *ctx, FILE *f)
+{
+	double avg_len = ctx->packets ? (double)ctx->sent_bytes / ctx->packets : 0.0;
+
+	fprintf(f, "Update: %lu packets sent (%lu bytes), %lu no-op updates suppressed (~%.0f bytes saved)\n",
+		ctx->packets, ctx->sent_bytes, ctx->suppressed, ctx->suppressed * avg_len);
+	fprintf(f, "Update: %lu groups in %lu packets (%.2f groups/packet, max %lu), %lu early flushes\n",
+		ctx->groups, ctx->packets, ctx->packets ? (double)ctx->groups / ctx->packets : 0.0,
+		ctx->max_merged, ctx->early_flushes);
+	fprintf(f, "Update: %lu full state updates after a receiver change, %lu groups held back while no receiver was known\n",
+		ctx->full_updates, ctx->held);
+	if (ctx->send_failures)
+		fprintf(f, "Update: %lu packets reached no receiver\n", ctx->send_failures);
+	fprintf(f, "Update: %lu keyframes (%lu requested by a receiver, %lu after a lost packet, %lu after a resync of the device)\n",
+		ctx->keyframes, ctx->keyframe_reqs, ctx->loss_keyframes, ctx->resyncs);
+	if (ctx->joy_resends)
+		fprintf(f, "Update: %lu joystick positions re-sent after a drop\n", ctx->joy_resends);
+
+	if (ctx->rate_hz)
+		fprintf(f, "Update: merged groups per packet 1:%lu 2:%lu 3:%lu 4:%lu 5-8:%lu >8:%lu\n",
+			ctx->merge_hist[0], ctx->merge_hist[1], ctx->merge_hist[2],
+			ctx->merge_hist[3], ctx->merge_hist[4], ctx->merge_hist[5]);
+
+	hist_print(&ctx->send_latency, "Update: event->send latency", "us", f);
+}
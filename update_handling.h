@@ -0,0 +1,157 @@
+#ifndef _update_handling
+#define _update_handling
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "event_sender.h"
+#include "protobuf_handling.h"
+#include "compact_handling.h"
+#include "stats_handling.h"
+
+
+/*******************************************************************************
+* MACROS/DEFINES
+*******************************************************************************/
+#define MERGE_HIST_BUCKETS 6 // merged groups per packet: 1, 2, 3, 4, 5-8, >8
+#define UPDATE_FAIL_LOG_US 1000000 // failed sends are logged at most once per interval
+#define UPDATE_LOSS_KEYFRAME_US 100000 // min interval of the keyframes that repair a lost packet
+
+
+/*******************************************************************************
+* DATA STRUCTURES
+*******************************************************************************/
+typedef struct
+{
+	uint8_t dev_id; // tags every packet, identifies the input device at the receiver
+	wire_format_t req_format; // requested format
+	wire_format_t format; // format used for the current receiver
+	proto_ctx_t proto_ctx;
+	NunchukUpdate *nun_protobuf;
+	NunchukUpdateV2 nun_protobuf_v2;
+	uint8_t compact_buf[COMPACT_TS_MSG_LEN];
+	uint16_t seq;
+	bool timestamps; // packets carry the send timestamp and the age of the event group
+	bool normalized; // the groups are calibrated, every packet carries the flag (see nun_stat_t)
+
+	// coalescing, only active if rate_hz is not 0
+	unsigned rate_hz;
+	int timer_fd;
+	bool timer_armed;
+	nun_stat_t pending; // merged state of all groups since the last flush
+	unsigned pending_groups;
+
+	// change detection, last transmitted value of every field (neutral if never sent)
+	nun_stat_t last_sent;
+	unsigned nw_gen; // generation of the destination that received last_sent (see nw_get_destination())
+
+	/**
+	 * Keyframes (complete state), the packets in between only carry the changes. A keyframe is sent to a new
+	 * receiver, on request (nack or lost packet, see check_losses()) and once per interval unless one was sent within
+	 * the interval.
+	 */
+	unsigned keyframe_ms;
+	int keyframe_fd; // periodic timer (disarmed if keyframe_ms is 0), also expires for a deferred loss keyframe
+	bool keyframe_req; // the next packet is a keyframe
+	bool keyframe_sent; // a keyframe was sent within the current interval
+	bool loss_pending; // a receiver lost a packet, the keyframe that repairs it is rate limited
+	uint64_t loss_keyframe_us; // time of the last keyframe after a lost packet
+	bool loss_timer; // keyframe_fd is armed for the deferred loss keyframe
+
+	// statistics
+	unsigned long groups;
+	unsigned long packets;
+	unsigned long sent_bytes;
+	unsigned long suppressed; // updates without any change that were not sent
+	unsigned long early_flushes; // flushes forced by a button transition within one tick
+	unsigned long full_updates; // complete states sent to a new receiver
+	unsigned long keyframes; // all keyframes, full updates included
+	unsigned long keyframe_reqs; // keyframes requested by a receiver (nack)
+	unsigned long loss_keyframes; // keyframes after a packet did not reach a receiver
+	unsigned long joy_resends; // packets that repeat the axes after a joystick update was dropped
+	unsigned long resyncs; // keyframes of the state rebuilt after SYN_DROPPED
+	unsigned long held; // groups received while no receiver was known
+	unsigned long send_failures; // packets that reached no receiver, the next packet or keyframe repairs the state
+	uint64_t fail_log_us; // time of the last logged failure, 0 if none
+	unsigned long max_merged;
+	unsigned long merge_hist[MERGE_HIST_BUCKETS];
+	hist_t send_latency; // kernel timestamp of the event group until the packet is sent, in us
+} update_ctx_t;
+
+
+/*******************************************************************************
+* PROTOTYPES
+*******************************************************************************/
+
+/**
+ * Initialize the update context of the device with the given id for the requested wire format (protobuf is used if
+ * the receiver does not support it). With a rate of 0 every event group is sent immediately, otherwise groups are
+ * coalesced and sent at most 'rate' times per second.
+ * In coalescing mode 'timer_fd' has to be registered with the main loop (see update_tick()).
+ * If 'timestamps' is set the packets carry the latency timestamps (see nun_stat_t).
+ * 'keyframe_fd' has to be registered with the main loop as well (see update_keyframe_tick()), it expires once
+ * per keyframe interval (in ms, 0: only on request) and for a keyframe that repairs a lost packet.
+ *
+ * return: 0 on success, <0 on error
+ */
+int init_update(update_ctx_t *, uint8_t, unsigned, wire_format_t, bool, unsigned);
+
+/**
+ * Teardown an update context initialized by init_update()
+ *
+ * return: void
+ */
+void teardown_update(update_ctx_t *);
+
+/**
+ * Submit a complete event group. Depending on the mode it is sent right away or merged
+ * into the pending state. Only values that differ from the last transmitted state are sent,
+ * updates without any change are suppressed. A keyframe group (resync of the device) is sent right away
+ * as a keyframe. A packet that reaches no receiver is counted and logged (rate limited) but is no error,
+ * the same applies to every function below that sends.
+ *
+ * return: 0 on success, <0 on error (packet could not be encoded, timer failed)
+ */
+int update_submit(update_ctx_t *, nun_stat_t *);
+
+/**
+ * Handle an expiration of the coalescing timer, i.e. send out the pending state.
+ * The timer is disarmed while no groups arrive.
+ *
+ * return: 0 on success, <0 on error
+ */
+int update_tick(update_ctx_t *);
+
+/**
+ * Handle an expiration of the keyframe timer, i.e. send a keyframe unless one was sent within the interval and
+ * no lost packet is left to repair
+ *
+ * return: 0 on success, <0 on error
+ */
+int update_keyframe_tick(update_ctx_t *);
+
+/**
+ * Send a keyframe right away, e.g. a receiver lost a packet (see nw_get_keyframe_requests())
+ *
+ * return: 0 on success, <0 on error
+ */
+int update_request_keyframe(update_ctx_t *);
+
+/**
+ * Handle a change of the destination (see nw_get_event_fd()). A new receiver gets the complete state
+ * right away, the wire format is selected again according to the formats it supports.
+ *
+ * return: 0 on success, <0 on error
+ */
+int update_refresh(update_ctx_t *);
+
+/**
+ * Print packet, coalescing, keyframe and latency statistics
+ *
+ * return: void
+ */
+void update_print_stats(update_ctx_t *, FILE *);
+
+
+#endif /* _update_handling */